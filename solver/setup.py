@@ -0,0 +1,17 @@
+# Builds the C engine as the _sudoku module, which sudoku.py uses when it
+# is there: python3 setup.py build_ext --inplace (or make python)
+
+from setuptools import Extension, setup
+
+setup(
+    name="sudoku",
+    version="1.0",
+    py_modules=["sudoku"],
+    ext_modules=[
+        Extension("_sudoku", ["sudokumodule.c"],
+                  depends=["sudoku.c", "sudoku.h"],
+                  extra_compile_args=["-O3", "-pthread"],
+                  extra_link_args=["-pthread"],
+                  libraries=["m", "z"]),
+    ],
+)
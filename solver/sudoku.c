@@ -6,21 +6,68 @@
 
 #include "sudoku.h"
 
-static char *default_puzzle =
+static char default_puzzle[BOARD_SIZE + 1] =
         "000000000000000000000000000000000000000000000000000000000000000000000000000000000";
 
-/* For calling thread safe drand */
-static _Thread_local struct drand48_data rng_buf;
+/* Number of puzzles made by --create and --easy */
+static uint64_t number_of_puzzles = 1;
+
+/* Bounds and checkpoint file for --generate */
+static const char *enumerate_from = "", *enumerate_to = "", *checkpoint_path;
+
+/* Number of boards --decode skips */
+static uint64_t decode_skip;
+
+/* Each thread's random number generator (see seed_thread_rng) */
+static _Thread_local struct rng_s rng;
+
+/* Seed from which every thread's random number stream is derived */
+static uint64_t random_seed;
+
+/* Budget of the solve or creation the thread is running, if it has one */
+static _Thread_local struct limits_s *limits;
+
+/* How the thread searches, if not the default way (see --portfolio) */
+static _Thread_local const struct strategy_s *strategy;
+
+/* Every thread's metrics, and the calling thread's (see --metrics) */
+static struct {
+    pthread_mutex_t lock;
+    pthread_once_t once;
+    pthread_key_t key; // To free a thread's metrics when it exits
+    struct metrics_s *all;
+    const char *path;
+} metrics = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_ONCE_INIT };
+static _Thread_local struct metrics_s *thread_metrics;
+static const char *operation_names[] = {"solve", "create", "easy", "rate"};
+
+/* The trace being recorded by the thread, if any (see --trace) */
+static _Thread_local struct trace_s *trace;
+static const char *trace_path;
+
+/* Set on the server's threads, whose OPTIONAL output nobody reads */
+static _Thread_local bool quiet;
+
+/* The rules being played, or NULL for classic Sudoku (see --variant) */
+static const struct variant_s *variant;
+
+/* States the search has refuted, shared by every thread (see --hash-table) */
+static struct {
+    struct hash_entry_s *entries; // NULL when there is no table
+    uint64_t mask; // Number of entries - 1
+    uint64_t zobrist[BOARD_SIZE][BLOCK_SIZE]; // Key of each option of a cell
+} hash_table;
 
 /*
-   Calls vprintf if verbose is set to true or priority is ESSENTIAL.
+   Calls vprintf if verbose is set to true (and the thread isn't quiet) or
+   priority is ESSENTIAL.
 */
 
 static void printf_c(int priority,
               const char *format,
               ...)
 {
-    if (priority == ESSENTIAL || verbose) {
+    if (priority == ESSENTIAL || (verbose && quiet == false)) {
             va_list args;
             va_start(args, format);
             vprintf(format, args);
@@ -56,6 +103,16 @@ get_bit_index(uint32_t n)
     return result;
 }
 
+/*
+  Whether exactly one bit of n is set.
+*/
+
+static bool
+one_bit(uint32_t n)
+{
+    return n && (n & (n - 1)) == 0;
+}
+
 /*
   Counts the number of bits set in an integer.
 */
@@ -110,18 +167,31 @@ char *get_set_bits(uint64_t n) {
 
 
 /*
-   Prints the Sudoku grid as a string. Eg.
+   Writes the Sudoku grid as a string of BOARD_SIZE digits into s, which must
+   have room for BOARD_SIZE + 1 characters. Eg.
    123456789456789123789123456214365897365897241897214365531642978648971532972538614
 */
 
-static void
-print_grid_as_str(const grid_t grid) {
+static char *
+grid_to_str(const grid_t grid, char *s)
+{
     for (size_t i = 0; i < BOARD_SIZE; i++)
         if (grid[i])
-            printf("%u", get_bit_index(grid[i]) + 1);
+            s[i] = '1' + get_bit_index(grid[i]);
         else
-            printf("0");
-    printf("\n");
+            s[i] = '0';
+    s[BOARD_SIZE] = 0;
+    return s;
+}
+
+/*
+   Prints the Sudoku grid as a string.
+*/
+
+static void
+print_grid_as_str(const grid_t grid) {
+    char s[BOARD_SIZE + 1];
+    printf("%s\n", grid_to_str(grid, s));
 }
 
 /*
@@ -137,6 +207,7 @@ init_board(struct board_s *board)
     board->valid = true;
     board->depth = 0;
     board->too_difficult = false;
+    board->timed_out = false;
     board->iterations = 0;
     memset(board->solutions, 0, sizeof(board->solutions));
 }
@@ -162,884 +233,5905 @@ convert_to_bitboard(const grid_t puzzle)
     return bitboard;
 }
 
-///////////// Print functions
+//////////// Random number functions
 
 /*
-  Prints the board in human readable form.
-  This is the function to use for normal human readable view of a Sudoku puzzle.
+  Each thread has its own xoshiro256** generator. All of them are derived
+  from random_seed: stream n is the generator seeded with random_seed and
+  then jumped ahead n times (2^128 numbers each time), so the streams never
+  overlap and a run with the same seed and number of threads repeats exactly.
+  The records made on all threads (see produce_records) have a stream each,
+  so they repeat whatever the number of threads.
 */
 
-static void
-print_puzzle(const grid_t grid)
+static uint64_t
+splitmix64(uint64_t *x)
 {
-    for (size_t i = 0; i < (BLOCK_SIZE * BLOCK_SIZE); i++) {
-        if (grid[i] == 0)
-            printf_c(ESSENTIAL, "_");
-        else
-            printf_c(ESSENTIAL, "%u", get_bit_index(grid[i]) + 1);
-        if ( (i + 1) == BOARD_SIZE)
-            printf_c(ESSENTIAL, "\n");
-        else if ( (i + 1) % (BLOCK_SIZE * MINI_BLOCK_SIZE) == 0)
-            printf_c(ESSENTIAL, "\n\n");
-        else if ( (i + 1) % BLOCK_SIZE == 0)
-            printf_c(ESSENTIAL, "\n");
-        else if ( (i + 1) % MINI_BLOCK_SIZE == 0)
-            printf_c(ESSENTIAL, "  ");
-        else
-            printf_c(ESSENTIAL, " ");
-    }
+    uint64_t z = (*x += 0x9e3779b97f4a7c15);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+    return z ^ (z >> 31);
 }
 
-void print_possibles(const struct board_s* board)
+static uint64_t
+rotl(uint64_t x, int k)
 {
-    for (int i = 0; i < BOARD_SIZE; i++) {
-        char *s = get_set_bits(board->grid[i]);
-        int j = strlen(s);
-        int k = 0;
-        if (j == 0) {
-            putchar(' ');
-        } else if (j == 1) {
-            putchar(s[0]);
-            k++;
-        } else {
-            for (; k < j; k++) {
-                putchar(s[k]);
-            }
-        }
+    return (x << k) | (x >> (64 - k));
+}
 
-        for (; k < BLOCK_SIZE; k++) {
-            putchar(' ');
-        }
-        putchar(' ');
+static uint64_t
+rng_next(struct rng_s *r)
+{
+    uint64_t result = rotl(r->s[1] * 5, 7) * 9;
+    uint64_t t = r->s[1] << 17;
+
+    r->s[2] ^= r->s[0];
+    r->s[3] ^= r->s[1];
+    r->s[1] ^= r->s[2];
+    r->s[0] ^= r->s[3];
+    r->s[2] ^= t;
+    r->s[3] = rotl(r->s[3], 45);
+    return result;
+}
 
-        if ( (i + 1) % 27 == 0) {
-            putchar('\n');
-            putchar('\n');
-        } else if ( (i + 1) % 9 == 0) {
-            putchar('\n');
-        } else if ( (i + 1) % 3 == 0) {
-            putchar(' ');
+/*
+  Advances the generator by 2^128 numbers.
+*/
+
+static void
+rng_jump(struct rng_s *r)
+{
+    static const uint64_t jump[] = {
+        0x180ec6d33cfd0aba, 0xd5a61266f0c9392c,
+        0xa9582618e03fc9aa, 0x39abdc4529b1661c
+    };
+    uint64_t s[4] = {0, 0, 0, 0};
+
+    for (int i = 0; i < 4; i++) {
+        for (int b = 0; b < 64; b++) {
+            if (jump[i] & ((uint64_t) 1 << b))
+                for (int j = 0; j < 4; j++)
+                    s[j] ^= r->s[j];
+            rng_next(r);
         }
     }
+    memcpy(r->s, s, sizeof(s));
 }
 
+/*
+  Seeds the calling thread's generator with stream n of random_seed.
+*/
 
+static void
+seed_thread_rng(long n)
+{
+    uint64_t x = random_seed;
 
-////////////// Solving functions
+    for (int i = 0; i < 4; i++)
+        rng.s[i] = splitmix64(&x);
+    while (n-- > 0)
+        rng_jump(&rng);
+}
 
 /*
-  Finds all the possible values for a cell and sets the bits corresponding
-  to each value.
+  Seeds the calling thread's generator with a stream of random_seed of its
+  own for record i of a production, so that what goes into a record
+  doesn't depend on which thread happens to make it.
 */
 
-static struct board_s
-fill_possibles(const struct board_s *bitboard)
+static void
+seed_record_rng(uint64_t i)
 {
-    struct board_s result = *bitboard;
-    const size_t *lk_up;
-    size_t k;
-    uint32_t mask;
+    uint64_t k = i, x = random_seed ^ splitmix64(&k);
 
-    for (size_t i = 0; i < BOARD_SIZE; i++) {
-        if (count_bits(result.grid[i]) != 1) {
-            mask = 0b11111111111111111111111000000000;
-            lk_up = lookup[i];
-            for (size_t j = 0; j < BLOCK_SIZE; j++) {
-                k = rows[lk_up[0]][j];
-                if (k != i && count_bits(result.grid[k]) == 1)
-                    mask = mask | result.grid[k];
-                k = squares[lk_up[1]][j];
-                if (k != i && count_bits(result.grid[k]) == 1)
-                    mask = mask | result.grid[k];
-                k = cols[lk_up[2]][j];
-                if (k != i && count_bits(result.grid[k]) == 1)
-                    mask = mask | result.grid[k];
-            }
-            result.grid[i] = ~mask;
-        }
-    }
-    return result;
+    for (int j = 0; j < 4; j++)
+        rng.s[j] = splitmix64(&x);
 }
 
 /*
-  Looks for cells which have only one possible value and sets them.
+  Returns a random number from 0 to n-1 from the calling thread's generator,
+  without modulo bias (Lemire's method).
 */
 
-static struct board_s
-fill_exclusions(const struct board_s *bitboard,
-                const size_t indices[BLOCK_SIZE][BLOCK_SIZE])
+static uint32_t
+random_below(uint32_t n)
 {
-    struct board_s result = *bitboard;
-    uint32_t count;
-    size_t l, index;
+    uint64_t m = (rng_next(&rng) >> 32) * n;
+    uint32_t threshold;
 
-    for (size_t i = 0; i < BLOCK_SIZE; i++) {
-        for (size_t j = 0; j < BLOCK_SIZE; j++) {
-            count = 0;
-            for (size_t k = 0;  k < BLOCK_SIZE; k++) {
-                l = indices[i][k];
-                if (result.grid[l] & masks[j]) {
-                    count++;
-                    index = l;
-                }
-            }
-            if (count == 1)
-                result.grid[index] = masks[j];
-        }
+    if ((uint32_t) m < n) {
+        threshold = -n % n;
+        while ((uint32_t) m < threshold)
+            m = (rng_next(&rng) >> 32) * n;
     }
-    return result;
+    return m >> 32;
 }
 
+
+//////////// Metrics functions
+
 /*
-  Saves a completed Sudoku puzzle into the solutions array in the bitboard
-  struct. Called by the check_bitboard function if it finds that a bitboard
-  is complete and valid.
+  Returns the time of the monotonic clock in nanoseconds.
 */
 
-static void
-save_solution(struct board_s *bitboard)
+static uint64_t
+monotonic_ns()
 {
-    for (size_t i = 0; i < MAX_SOLUTIONS; i++) {
-        if (bitboard->solutions[i][0] == 0) {
-            memcpy(bitboard->solutions[i], bitboard->grid,
-                   sizeof(bitboard->grid));
-            break;
-        } else {
-            if (memcmp(bitboard->solutions[i], bitboard->grid,
-                       sizeof(bitboard->grid)) == 0)
-                break;
-        }
-    }
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000ull + t.tv_nsec;
 }
 
 /*
-   Checks if a row, square or column is valid or complete
+  The bucket of a latency: its top METRICS_SUB_BITS + 1 bits.
 */
 
-static bool
-check_bitboard_indices(struct board_s *bitboard,
-                       const size_t indices[BLOCK_SIZE][BLOCK_SIZE])
+static int
+metrics_bucket(uint64_t ns)
 {
-    bool complete = true;
-    for (size_t i = 0; i < BLOCK_SIZE &&
-             (bitboard->complete || bitboard->valid); i++) {
-        uint32_t mask = 0;
-        for (size_t j = 0; j < BLOCK_SIZE; j++) {
-            size_t l = indices[i][j];
-            if (count_bits(bitboard->grid[l]) == 1) {
-                if ( (mask & bitboard->grid[l]) )
-                    bitboard->valid = false;
-                mask = mask | bitboard->grid[l];
-            } else {
-                complete = false;
-                if ( (bitboard->grid[l] == 0)
-                    || (bitboard->grid[l] && (mask ^ bitboard->grid[l]) == 0) )
-                    bitboard->valid = false;
-            }
-        }
-    }
-    return complete;
-}
+    int e;
 
+    if (ns < (1 << METRICS_SUB_BITS))
+        return ns;
+    e = 63 - __builtin_clzll(ns);
+    return ((e - METRICS_SUB_BITS + 1) << METRICS_SUB_BITS) +
+        ((ns >> (e - METRICS_SUB_BITS)) & ((1 << METRICS_SUB_BITS) - 1));
+}
 
 /*
-  Checks a bitboard for completeness or validity. Saves it in the solutions
-  array of the bitboard struct if it is complete and valid.
- */
+  The lowest latency that isn't in bucket b or below.
+*/
+
+static uint64_t
+metrics_bucket_end(int b)
+{
+    int e = (b >> METRICS_SUB_BITS) + METRICS_SUB_BITS - 1;
+    uint64_t mantissa = (1 << METRICS_SUB_BITS) + b % (1 << METRICS_SUB_BITS);
+
+    if (b < (1 << METRICS_SUB_BITS))
+        return b + 1;
+    return (mantissa + 1) << (e - METRICS_SUB_BITS);
+}
 
 static void
-check_bitboard(struct board_s *bitboard)
+release_metrics(void *m)
 {
-    bitboard->valid = true;
-    bitboard->complete = check_bitboard_indices(bitboard, cols);
-    bitboard->complete = check_bitboard_indices(bitboard, squares) &&
-        bitboard->complete;
-    bitboard->complete = check_bitboard_indices(bitboard, rows) &&
-        bitboard->complete;
-    if (bitboard->complete && bitboard->valid)
-        save_solution(bitboard);
+    __atomic_store_n(&((struct metrics_s *) m)->in_use, false,
+                     __ATOMIC_RELEASE);
+}
+
+static void
+create_metrics_key(void)
+{
+    pthread_key_create(&metrics.key, release_metrics);
 }
 
 /*
-  Finds the next cell in the bitboard with more than one possible value.
-  The search_solution algorithm will then try one of the values in this cell.
+  The calling thread's metrics: those of a thread that has exited, whose
+  counts carry on, or new ones.
 */
 
-static void
-get_next_cell(struct board_s *bitboard)
+static struct metrics_s *
+get_thread_metrics(void)
 {
-    do {
-        ++bitboard->current_index;
-        bitboard->current_mask = bitboard->grid[bitboard->current_index];
-    } while (count_bits(bitboard->current_mask) < 2 &&
-             bitboard->current_index < BOARD_SIZE);
+    struct metrics_s *m;
+
+    if (thread_metrics)
+        return thread_metrics;
+    pthread_once(&metrics.once, create_metrics_key);
+    pthread_mutex_lock(&metrics.lock);
+    for (m = metrics.all; m; m = m->next)
+        if (__atomic_load_n(&m->in_use, __ATOMIC_ACQUIRE) == false)
+            break;
+    if (m == NULL) {
+        m = calloc(1, sizeof(*m));
+        m->next = metrics.all;
+        metrics.all = m;
+    }
+    m->in_use = true;
+    pthread_mutex_unlock(&metrics.lock);
+    pthread_setspecific(metrics.key, m);
+    return thread_metrics = m;
 }
 
 /*
-  Repeatedly tries to fill values in until no progress can be made.
+  Adds to a counter of the calling thread, which other threads may be
+  reading.
 */
 
 static void
-fill(struct board_s *bitboard)
+add_to_counter(uint64_t *counter, uint64_t n)
 {
-    int iter = 0;
-    struct board_s prev;
-    do {
-        prev = *bitboard;
-        *bitboard = fill_possibles(bitboard);
-        *bitboard = fill_exclusions(bitboard, rows);
-        *bitboard = fill_possibles(bitboard);
-        *bitboard = fill_exclusions(bitboard, squares);
-        *bitboard = fill_possibles(bitboard);
-        *bitboard = fill_exclusions(bitboard, cols);
-        *bitboard = fill_possibles(bitboard);
-        ++iter;
-    } while (memcmp(prev.grid,bitboard->grid,BOARD_SIZE*sizeof(uint32_t)) != 0);
-
-    if (iter > bitboard->iterations)
-        bitboard->iterations = iter;
+    __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
 }
 
 /*
-  Fills as much of the bitboard as possible without needing recursion
-  and then checks if it's valid.
- */
+  Counts an operation that started at start (see monotonic_ns) and ended
+  now with a status.
+*/
 
 static void
-check_bitboard_comprehensive(struct board_s *bitboard)
+count_operation(int op, uint64_t start, int status)
 {
-    fill(bitboard);
-    check_bitboard(bitboard);
+    struct metrics_s *m = get_thread_metrics();
+    uint64_t ns = monotonic_ns() - start;
+
+    add_to_counter(&m->latency[op][metrics_bucket(ns)], 1);
+    add_to_counter(&m->total_ns[op], ns);
+    add_to_counter(&m->outcomes[op][status], 1);
 }
 
-/*
- * This is the recursive algorithm that searches for a solution to the puzzle.
- * It tries a couple of simple techniques to set the possible values of the
- * missing cells (see the fill function and its subsidiaries) and then
- * if it can't make progress, does a recursive depth first search
- * for a solution.
- */
-struct board_s
-search_solution(struct board_s bitboard, int depth, int max_depth, int *generate)
+static void
+count_attempts(int op, uint64_t n)
 {
-    struct board_s new_board;
+    add_to_counter(&get_thread_metrics()->attempts[op], n);
+}
 
-    if (depth > bitboard.depth)
-        bitboard.depth = depth;
-    if (bitboard.depth > max_depth) {
-        bitboard.too_difficult = true;
-        return bitboard;
+/*
+  Sums the metrics of every thread into sum.
+*/
+
+static void
+merge_metrics(struct metrics_s *sum)
+{
+    memset(sum, 0, sizeof(*sum));
+    pthread_mutex_lock(&metrics.lock);
+    for (struct metrics_s *m = metrics.all; m; m = m->next) {
+        for (int op = 0; op < NUM_OPERATIONS; op++) {
+            for (int b = 0; b < METRICS_BUCKETS; b++)
+                sum->latency[op][b] +=
+                    __atomic_load_n(&m->latency[op][b], __ATOMIC_RELAXED);
+            for (int st = 0; st <= STATUS_TIMED_OUT; st++)
+                sum->outcomes[op][st] +=
+                    __atomic_load_n(&m->outcomes[op][st], __ATOMIC_RELAXED);
+            sum->total_ns[op] +=
+                __atomic_load_n(&m->total_ns[op], __ATOMIC_RELAXED);
+            sum->attempts[op] +=
+                __atomic_load_n(&m->attempts[op], __ATOMIC_RELAXED);
+        }
     }
+    pthread_mutex_unlock(&metrics.lock);
+}
 
-    fill(&bitboard);
+/*
+  The latency (in nanoseconds) below which a fraction q of the operations
+  took, to within a bucket, from merged metrics.
+*/
 
-    check_bitboard(&bitboard);
-    if ( (bitboard.complete && bitboard.valid) ||
-         bitboard.current_index == BOARD_SIZE) {
-        if (*generate > 0) {
-            --*generate;
-            printf("%d,", *generate);
-            print_grid_as_str(bitboard.grid);
-        }
-        return bitboard;
-    } else if (bitboard.valid == false) {
-        return bitboard;
+static uint64_t
+latency_quantile(const struct metrics_s *sum, int op, double q)
+{
+    uint64_t count = 0, seen = 0;
+
+    for (int b = 0; b < METRICS_BUCKETS; b++)
+        count += sum->latency[op][b];
+    for (int b = 0; b < METRICS_BUCKETS && count; b++) {
+        seen += sum->latency[op][b];
+        if (seen >= q * count)
+            return metrics_bucket_end(b);
     }
+    return 0;
+}
 
-    get_next_cell(&bitboard);
+/*
+  Writes the metrics of all threads in the Prometheus text format: a
+  histogram of latencies per operation, the 50th, 99th and 99.9th
+  percentiles, operations by status and attempts at making puzzles. The
+  histogram is kept with 8 buckets per power of two (see metrics_bucket),
+  which the percentiles are worked out from, but only the powers of two
+  from 1024 ns to 2^36 ns are written out as le bounds, each with the count
+  of all the buckets below it. The file is replaced atomically, for
+  scrapers that read it meanwhile (like the textfile collector of
+  node_exporter).
+*/
 
-    for(size_t i = 0; i < BLOCK_SIZE; i++) {
-        if (masks[i] & bitboard.grid[bitboard.current_index]) {
-            new_board = bitboard;
-            new_board.grid[bitboard.current_index] = masks[i];
-            new_board = search_solution(new_board, depth + 1, max_depth,
-                                        generate);
-            if (*generate < 0) {
-                for (size_t j = 0; j < MAX_SOLUTIONS; j++)
-                    if (new_board.solutions[j][0] && !bitboard.solutions[j][0])
-                        memcpy(bitboard.solutions[j], new_board.solutions[j],
-                               sizeof(new_board.solutions[j]));
-                    else
-                        break;
-            } else {
-                if (*generate == 0) return new_board;
-            }
-            if (new_board.depth > bitboard.depth)
-                bitboard.depth = new_board.depth;
-            if (new_board.solutions[MAX_SOLUTIONS - 1][0])
-                return new_board;
+static void
+write_metrics(const char *path)
+{
+    static const char *statuses[] = {
+        "unique", "multiple", "invalid", "too-difficult", "timed-out"
+    };
+    static const double quantiles[] = {0.5, 0.99, 0.999};
+    struct metrics_s *sum = malloc(sizeof(*sum));
+    char tmp[PATH_MAX];
+    uint64_t count;
+    FILE *f;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if ((f = fopen(tmp, "w")) == NULL) {
+        perror(tmp);
+        free(sum);
+        return;
+    }
+    merge_metrics(sum);
+
+    fprintf(f, "# HELP sudoku_operation_duration_seconds Time taken by "
+            "operations.\n# TYPE sudoku_operation_duration_seconds histogram\n");
+    for (int op = 0; op < NUM_OPERATIONS; op++) {
+        count = 0;
+        for (int b = 0; b < METRICS_BUCKETS; b++) {
+            count += sum->latency[op][b];
+            // Powers of two from a microsecond to about a minute
+            if (b % (1 << METRICS_SUB_BITS) == (1 << METRICS_SUB_BITS) - 1 &&
+                metrics_bucket_end(b) >= 1024 &&
+                metrics_bucket_end(b) <= (1ull << 36))
+                fprintf(f, "sudoku_operation_duration_seconds_bucket"
+                        "{operation=\"%s\",le=\"%.9g\"} %llu\n",
+                        operation_names[op], metrics_bucket_end(b) * 1e-9,
+                        (unsigned long long) count);
         }
+        fprintf(f, "sudoku_operation_duration_seconds_bucket"
+                "{operation=\"%s\",le=\"+Inf\"} %llu\n", operation_names[op],
+                (unsigned long long) count);
+        fprintf(f, "sudoku_operation_duration_seconds_sum{operation=\"%s\"} "
+                "%.9f\n", operation_names[op], sum->total_ns[op] * 1e-9);
+        fprintf(f, "sudoku_operation_duration_seconds_count"
+                "{operation=\"%s\"} %llu\n", operation_names[op],
+                (unsigned long long) count);
     }
-    return bitboard;
+
+    fprintf(f, "# HELP sudoku_operation_latency_seconds Percentiles of the "
+            "time taken by operations, to within 12.5%%.\n"
+            "# TYPE sudoku_operation_latency_seconds gauge\n");
+    for (int op = 0; op < NUM_OPERATIONS; op++)
+        for (size_t q = 0; q < sizeof(quantiles) / sizeof(double); q++)
+            fprintf(f, "sudoku_operation_latency_seconds"
+                    "{operation=\"%s\",quantile=\"%g\"} %.9g\n",
+                    operation_names[op], quantiles[q],
+                    latency_quantile(sum, op, quantiles[q]) * 1e-9);
+
+    fprintf(f, "# HELP sudoku_operations_total Operations by outcome.\n"
+            "# TYPE sudoku_operations_total counter\n");
+    for (int op = 0; op < NUM_OPERATIONS; op++)
+        for (int st = 0; st <= STATUS_TIMED_OUT; st++)
+            fprintf(f, "sudoku_operations_total{operation=\"%s\","
+                    "status=\"%s\"} %llu\n", operation_names[op], statuses[st],
+                    (unsigned long long) sum->outcomes[op][st]);
+
+    fprintf(f, "# HELP sudoku_creation_attempts_total Puzzles tried before "
+            "one was good enough, by create and easy.\n"
+            "# TYPE sudoku_creation_attempts_total counter\n");
+    for (int op = OP_CREATE; op <= OP_EASY; op++)
+        fprintf(f, "sudoku_creation_attempts_total{operation=\"%s\"} %llu\n",
+                operation_names[op], (unsigned long long) sum->attempts[op]);
+
+    free(sum);
+    if (fclose(f) != 0 || rename(tmp, path) != 0)
+        perror(path);
 }
 
 
-/*
-  Wrapper around the recursive search_solutions algorithm.
- */
+//////////// Trace functions
 
-void
-solve(struct board_s *bitboard, int max_depth, int generate)
+static void
+flush_trace(struct trace_s *t)
 {
-    check_bitboard_comprehensive(bitboard);
-
-    if (bitboard->valid && bitboard->complete == false)
-        *bitboard = search_solution(*bitboard, 0, max_depth, &generate);
+    if (fwrite(t->events, sizeof(struct trace_event_s), t->n, t->file) < t->n)
+        perror(trace_path);
+    t->n = 0;
 }
 
 /*
-  Checks how many solutions have been found after solve has been called.
- */
+  Records an event, if the thread is tracing. Costs a test of a thread
+  local pointer otherwise.
+*/
 
-int
-num_solutions(const struct board_s *board)
+static inline void
+trace_event(int kind, int depth, int cell, int value)
 {
-    int c = 0;
-    for (size_t i = 0; i < MAX_SOLUTIONS; i++)
-        if (board->solutions[i][0] > 0)
-            c++;
-        else
-            break;
-
-    return c;
+    if (trace == NULL)
+        return;
+    if (trace->n == TRACE_BUFFER)
+        flush_trace(trace);
+    trace->events[trace->n++] = (struct trace_event_s) {
+        kind, depth > UINT8_MAX ? UINT8_MAX : depth, cell, value
+    };
+}
+
+/*
+  Starts tracing a solve on the calling thread, appending to the trace
+  file, which is created with its magic number by the first one.
+*/
+
+static void
+start_trace(const grid_t puzzle)
+{
+    static struct trace_s *t;
+    int clues = 0;
+
+    if (t == NULL) {
+        t = malloc(sizeof(*t));
+        t->n = 0;
+        if ((t->file = fopen(trace_path, "wb")) == NULL) {
+            perror(trace_path);
+            exit(EXIT_FAILURE);
+        }
+        fwrite(TRACE_MAGIC, 1, strlen(TRACE_MAGIC), t->file);
+    }
+    for (int i = 0; i < BOARD_SIZE; i++)
+        clues += (puzzle[i] != 0);
+    trace = t;
+    trace_event(TRACE_START, 0, 0, clues);
+}
+
+static void
+end_trace()
+{
+    flush_trace(trace);
+    fflush(trace->file);
+    trace = NULL;
+}
+
+/*
+  Number of cells with a single value left.
+*/
+
+static int
+count_decided(const struct board_s *board)
+{
+    int n = 0;
+
+    for (int i = 0; i < BOARD_SIZE; i++)
+        n += (count_bits(board->grid[i]) == 1);
+    return n;
+}
+
+/*
+  Opens a trace file and checks its magic number.
+*/
+
+static FILE *
+open_trace(const char *path)
+{
+    char magic[sizeof(TRACE_MAGIC)] = {0};
+    FILE *f = fopen(path, "rb");
+
+    if (f == NULL) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    if (fread(magic, 1, strlen(TRACE_MAGIC), f) < strlen(TRACE_MAGIC) ||
+        strcmp(magic, TRACE_MAGIC) != 0) {
+        fprintf(stderr, "%s: not a trace file\n", path);
+        exit(EXIT_FAILURE);
+    }
+    return f;
+}
+
+/*
+  Summarises a trace: how much search there was, the cells branched on most
+  (the ones a better heuristic might decide earlier), and the size of the
+  subtree under each branch at the top of each solve.
+*/
+
+void
+process_arg_for_trace_summary(const char *path)
+{
+    struct trace_event_s e;
+    uint64_t counts[TRACE_SOLUTION + 1] = {0}, hot[BOARD_SIZE] = {0};
+    uint64_t cells_filled = 0, subtree = 0;
+    int max_depth = 0, top_cell = -1, top_value = 0, hottest[TRACE_HOT_CELLS];
+    FILE *f = open_trace(path);
+
+    while (fread(&e, sizeof(e), 1, f) == 1) {
+        if (e.kind > TRACE_SOLUTION || e.cell >= BOARD_SIZE) {
+            fprintf(stderr, "%s: corrupt trace\n", path);
+            exit(EXIT_FAILURE);
+        }
+        // A branch at depth 0 (or a new solve) ends the subtree of the last
+        if (top_cell >= 0 && (e.kind == TRACE_START ||
+                              (e.kind == TRACE_BRANCH && e.depth == 0))) {
+            printf("Subtree r%dc%d=%d: %llu branches\n",
+                   top_cell / BLOCK_SIZE + 1, top_cell % BLOCK_SIZE + 1,
+                   top_value, (unsigned long long) subtree);
+            top_cell = -1;
+        }
+        if (e.kind == TRACE_START)
+            printf("Solve %llu of a puzzle with %d clues\n",
+                   (unsigned long long) counts[TRACE_START] + 1, e.value);
+        if (e.kind == TRACE_BRANCH) {
+            hot[e.cell]++;
+            if (e.depth == 0) {
+                top_cell = e.cell;
+                top_value = e.value;
+                subtree = 0;
+            }
+            subtree++;
+        }
+        if (e.kind == TRACE_PROPAGATE)
+            cells_filled += e.value;
+        if (e.depth > max_depth)
+            max_depth = e.depth;
+        counts[e.kind]++;
+    }
+    fclose(f);
+    if (top_cell >= 0)
+        printf("Subtree r%dc%d=%d: %llu branches\n",
+               top_cell / BLOCK_SIZE + 1, top_cell % BLOCK_SIZE + 1,
+               top_value, (unsigned long long) subtree);
+
+    printf("Solves: %llu\nBranches: %llu\nContradictions: %llu\n"
+           "Propagations: %llu (%llu cells decided)\nSolutions: %llu\n"
+           "Maximum depth: %d\n",
+           (unsigned long long) counts[TRACE_START],
+           (unsigned long long) counts[TRACE_BRANCH],
+           (unsigned long long) counts[TRACE_CONTRADICTION],
+           (unsigned long long) counts[TRACE_PROPAGATE],
+           (unsigned long long) cells_filled,
+           (unsigned long long) counts[TRACE_SOLUTION], max_depth);
+
+    printf("Hot cells:");
+    for (int k = 0; k < TRACE_HOT_CELLS; k++) {
+        hottest[k] = -1;
+        for (int i = 0; i < BOARD_SIZE; i++) {
+            bool taken = false;
+            for (int j = 0; j < k; j++)
+                taken = taken || hottest[j] == i;
+            if (taken == false && hot[i] &&
+                (hottest[k] < 0 || hot[i] > hot[hottest[k]]))
+                hottest[k] = i;
+        }
+        if (hottest[k] >= 0)
+            printf(" r%dc%d=%llu", hottest[k] / BLOCK_SIZE + 1,
+                   hottest[k] % BLOCK_SIZE + 1,
+                   (unsigned long long) hot[hottest[k]]);
+    }
+    printf("\n");
+}
+
+/*
+  Prints a trace as folded stacks, one line per branch: the branches that
+  led to it, separated by semicolons, and a count of 1. flamegraph.pl
+  draws this as the search tree, each branch as wide as its subtree.
+*/
+
+void
+process_arg_for_trace_folded(const char *path)
+{
+    struct trace_event_s e;
+    struct trace_event_s path_to[UINT8_MAX + 1];
+    uint64_t solve = 0;
+    FILE *f = open_trace(path);
+
+    while (fread(&e, sizeof(e), 1, f) == 1) {
+        if (e.kind == TRACE_START)
+            solve++;
+        if (e.kind != TRACE_BRANCH || e.cell >= BOARD_SIZE)
+            continue;
+        path_to[e.depth] = e;
+        printf("solve%llu", (unsigned long long) solve);
+        for (int d = 0; d <= e.depth; d++)
+            printf(";r%dc%d=%d", path_to[d].cell / BLOCK_SIZE + 1,
+                   path_to[d].cell % BLOCK_SIZE + 1, path_to[d].value);
+        printf(" 1\n");
+    }
+    fclose(f);
+}
+
+
+///////////// Print functions
+
+/*
+  Prints the board in human readable form.
+  This is the function to use for normal human readable view of a Sudoku puzzle.
+*/
+
+static void
+print_puzzle(const grid_t grid)
+{
+    for (size_t i = 0; i < (BLOCK_SIZE * BLOCK_SIZE); i++) {
+        if (grid[i] == 0)
+            printf_c(ESSENTIAL, "_");
+        else
+            printf_c(ESSENTIAL, "%u", get_bit_index(grid[i]) + 1);
+        if ( (i + 1) == BOARD_SIZE)
+            printf_c(ESSENTIAL, "\n");
+        else if ( (i + 1) % (BLOCK_SIZE * MINI_BLOCK_SIZE) == 0)
+            printf_c(ESSENTIAL, "\n\n");
+        else if ( (i + 1) % BLOCK_SIZE == 0)
+            printf_c(ESSENTIAL, "\n");
+        else if ( (i + 1) % MINI_BLOCK_SIZE == 0)
+            printf_c(ESSENTIAL, "  ");
+        else
+            printf_c(ESSENTIAL, " ");
+    }
+}
+
+void print_possibles(const struct board_s* board)
+{
+    for (int i = 0; i < BOARD_SIZE; i++) {
+        char *s = get_set_bits(board->grid[i]);
+        int j = strlen(s);
+        int k = 0;
+        if (j == 0) {
+            putchar(' ');
+        } else if (j == 1) {
+            putchar(s[0]);
+            k++;
+        } else {
+            for (; k < j; k++) {
+                putchar(s[k]);
+            }
+        }
+
+        for (; k < BLOCK_SIZE; k++) {
+            putchar(' ');
+        }
+        putchar(' ');
+
+        if ( (i + 1) % 27 == 0) {
+            putchar('\n');
+            putchar('\n');
+        } else if ( (i + 1) % 9 == 0) {
+            putchar('\n');
+        } else if ( (i + 1) % 3 == 0) {
+            putchar(' ');
+        }
+    }
+}
+
+
+
+//////////// Transposition table functions
+
+/*
+  Gives the table of refuted states the largest power of two entries that
+  fits in megabytes, or removes it for 0. Whatever it held is forgotten.
+  Only called while nothing is being searched.
+*/
+
+void
+set_hash_table(uint64_t megabytes)
+{
+    uint64_t n = 1, x = 0;
+
+    free(hash_table.entries);
+    hash_table.entries = NULL;
+    hash_table.mask = 0;
+    if (megabytes == 0)
+        return;
+    while (2 * n * sizeof(struct hash_entry_s) <= megabytes << 20)
+        n *= 2;
+    hash_table.entries = calloc(n, sizeof(struct hash_entry_s));
+    hash_table.mask = n - 1;
+    for (int c = 0; c < BOARD_SIZE; c++)
+        for (int v = 0; v < BLOCK_SIZE; v++)
+            hash_table.zobrist[c][v] = splitmix64(&x);
+}
+
+/*
+  Forgets every state in the table.
+*/
+
+static void
+clear_hash_table(void)
+{
+    if (hash_table.entries)
+        memset(hash_table.entries, 0,
+               (hash_table.mask + 1) * sizeof(struct hash_entry_s));
+}
+
+/*
+  Returns the key of the options in bits of cell c. A grid's key is the
+  XOR of the keys of all its cells' options (Zobrist hashing), so a change
+  to a cell changes the key by the key of the options it gained or lost.
+*/
+
+static uint64_t
+cell_key(int c, uint32_t bits)
+{
+    uint64_t key = 0;
+
+    for (bits &= FULL_MASK; bits; bits &= bits - 1)
+        key ^= hash_table.zobrist[c][__builtin_ctz(bits)];
+    return key;
+}
+
+static uint64_t
+grid_key(const grid_t grid)
+{
+    uint64_t key = 0;
+
+    for (int c = 0; c < BOARD_SIZE; c++)
+        key ^= cell_key(c, grid[c]);
+    return key;
+}
+
+/*
+  Turns key, that of grid before, into the key of grid after.
+*/
+
+static uint64_t
+update_key(uint64_t key, const grid_t before, const grid_t after)
+{
+    for (int c = 0; c < BOARD_SIZE; c++)
+        if (before[c] != after[c])
+            key ^= cell_key(c, before[c] ^ after[c]);
+    return key;
+}
+
+/*
+  Returns whether the state with this key was refuted by a search going no
+  more than max_height deeper, and puts how much deeper it went in *height.
+  The entry is read without a lock; if another thread is writing it, the
+  two words don't match and it is a miss.
+*/
+
+static bool
+find_refuted(uint64_t key, int max_height, int *height)
+{
+    struct hash_entry_s *e = &hash_table.entries[key & hash_table.mask];
+    uint64_t data = __atomic_load_n(&e->data, __ATOMIC_RELAXED);
+    uint64_t check = __atomic_load_n(&e->check, __ATOMIC_RELAXED);
+
+    if (data == 0 || (check ^ data) != key || (int) data - 1 > max_height)
+        return false;
+    *height = data - 1;
+    return true;
+}
+
+/*
+  Records that the state with this key has no solution, found by a search
+  going height deeper. Replaces whatever state had the entry.
+*/
+
+static void
+save_refuted(uint64_t key, int height)
+{
+    struct hash_entry_s *e = &hash_table.entries[key & hash_table.mask];
+    uint64_t data = height + 1;
+
+    __atomic_store_n(&e->check, key ^ data, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->data, data, __ATOMIC_RELAXED);
+}
+
+
+//////////// Variant functions
+
+/*
+  Adds a unit to v after checking that it is BLOCK_SIZE different cells.
+  Source names the rules it came from, for the error message.
+*/
+
+static void
+add_unit(struct variant_s *v, const size_t cells[BLOCK_SIZE],
+         const char *source)
+{
+    bool seen[BOARD_SIZE] = {false};
+
+    if (v->n_units == MAX_UNITS) {
+        fprintf(stderr, "%s: more than %d units\n", source, MAX_UNITS);
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < BLOCK_SIZE; i++) {
+        if (cells[i] >= BOARD_SIZE || seen[cells[i]]) {
+            fprintf(stderr, "%s: a unit needs %d different cells from 0 to "
+                    "%d\n", source, BLOCK_SIZE, BOARD_SIZE - 1);
+            exit(EXIT_FAILURE);
+        }
+        seen[cells[i]] = true;
+    }
+    memcpy(v->units[v->n_units++], cells, sizeof(v->units[0]));
+}
+
+/*
+  Adds the regions of a jigsaw map to v: BOARD_SIZE characters, the same
+  one marking every cell of a region.
+*/
+
+static void
+add_regions(struct variant_s *v, const char *map, const char *source)
+{
+    size_t regions[BLOCK_SIZE][BLOCK_SIZE];
+    char marks[BLOCK_SIZE];
+    int n_regions = 0, sizes[BLOCK_SIZE] = {0}, r;
+
+    for (int c = 0; c < BOARD_SIZE; c++) {
+        for (r = 0; r < n_regions && marks[r] != map[c]; r++)
+            ;
+        if (r == n_regions && n_regions < BLOCK_SIZE)
+            marks[n_regions++] = map[c];
+        if (r == BLOCK_SIZE || sizes[r] == BLOCK_SIZE) {
+            fprintf(stderr, "%s: a map needs %d regions of %d cells\n",
+                    source, BLOCK_SIZE, BLOCK_SIZE);
+            exit(EXIT_FAILURE);
+        }
+        regions[r][sizes[r]++] = c;
+    }
+    for (r = 0; r < BLOCK_SIZE; r++)
+        add_unit(v, regions[r], source);
+}
+
+/*
+  Adds the units in the file at path to v. A line of BLOCK_SIZE cell
+  numbers (0 to 80, along the rows) is a unit. A jigsaw map (see
+  add_regions) is given either on one line or as BLOCK_SIZE lines of
+  BLOCK_SIZE characters. Empty lines and lines starting with # are left
+  out. Returns whether there was a map.
+*/
+
+static bool
+read_variant(struct variant_s *v, const char *path)
+{
+    char line[MAX_REQUEST_LINE], map[BOARD_SIZE], *p, *end;
+    size_t cells[BLOCK_SIZE], len;
+    int n, map_len = 0;
+    bool any_map = false;
+    FILE *f = fopen(path, "r");
+
+    if (f == NULL) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    while (fgets(line, sizeof(line), f)) {
+        p = line + strspn(line, " \t");
+        if (*p == '#' || *p == '\n' || *p == '\r' || *p == '\0')
+            continue;
+        len = strcspn(p, " \t\r\n");
+        if ((len == BLOCK_SIZE || len == BOARD_SIZE) &&
+            p[len + strspn(p + len, " \t\r\n")] == '\0' &&
+            map_len + len <= BOARD_SIZE) {
+            memcpy(map + map_len, p, len);
+            map_len += len;
+            if (map_len == BOARD_SIZE) {
+                add_regions(v, map, path);
+                map_len = 0;
+                any_map = true;
+            }
+            continue;
+        }
+        for (n = 0; n < BLOCK_SIZE; n++) {
+            p += strspn(p, " \t,");
+            cells[n] = strtoul(p, &end, 10);
+            if (end == p)
+                break;
+            p = end;
+        }
+        if (n < BLOCK_SIZE || p[strspn(p, " \t\r\n")] != '\0') {
+            fprintf(stderr, "%s: expected %d cell numbers or a map of %d "
+                    "regions: %s", path, BLOCK_SIZE, BLOCK_SIZE, line);
+            exit(EXIT_FAILURE);
+        }
+        add_unit(v, cells, path);
+    }
+    fclose(f);
+    if (map_len) {
+        fprintf(stderr, "%s: a map needs %d rows\n", path, BLOCK_SIZE);
+        exit(EXIT_FAILURE);
+    }
+    return any_map;
+}
+
+/*
+  Lists the units every cell of v is in and its peers, the cells sharing
+  one of them.
+*/
+
+static void
+find_variant_peers(struct variant_s *v)
+{
+    static bool known[BOARD_SIZE][BOARD_SIZE];
+    size_t a, b;
+
+    memset(known, 0, sizeof(known));
+    memset(v->n_peers, 0, sizeof(v->n_peers));
+    memset(v->n_cell_units, 0, sizeof(v->n_cell_units));
+    for (int u = 0; u < v->n_units; u++) {
+        for (int i = 0; i < BLOCK_SIZE; i++) {
+            a = v->units[u][i];
+            v->cell_units[a][v->n_cell_units[a]++] = u;
+        }
+        for (int i = 0; i < BLOCK_SIZE; i++) {
+            for (int j = 0; j < BLOCK_SIZE; j++) {
+                a = v->units[u][i];
+                b = v->units[u][j];
+                if (a != b && known[a][b] == false) {
+                    known[a][b] = true;
+                    v->peers[a][v->n_peers[a]++] = b;
+                }
+            }
+        }
+    }
+}
+
+/*
+  Plays by the given rules from now on: classic, x (both long diagonals are
+  units too), windoku (so are the four squares between the squares' gaps)
+  or a file of extra units (see read_variant). Rows and columns are always
+  units, and so are the squares unless the file has a jigsaw map.
+*/
+
+void
+process_arg_for_variant(const char *rules)
+{
+    static struct variant_s v;
+    size_t unit[BLOCK_SIZE];
+    bool map = false;
+
+    if (strcmp(rules, "classic") == 0) {
+        variant = NULL;
+        return;
+    }
+    memset(&v, 0, sizeof(v));
+    for (int i = 0; i < BLOCK_SIZE; i++) {
+        add_unit(&v, rows[i], rules);
+        add_unit(&v, cols[i], rules);
+    }
+    if (strcmp(rules, "x") == 0) {
+        for (int i = 0; i < BLOCK_SIZE; i++)
+            unit[i] = i * (BLOCK_SIZE + 1);
+        add_unit(&v, unit, rules);
+        for (int i = 0; i < BLOCK_SIZE; i++)
+            unit[i] = (i + 1) * (BLOCK_SIZE - 1);
+        add_unit(&v, unit, rules);
+    } else if (strcmp(rules, "windoku") == 0) {
+        for (int w = 0; w < 4; w++) {
+            size_t top = 1 + (w / 2) * (MINI_BLOCK_SIZE + 1);
+            size_t left = 1 + (w % 2) * (MINI_BLOCK_SIZE + 1);
+            for (int i = 0; i < BLOCK_SIZE; i++)
+                unit[i] = (top + i / MINI_BLOCK_SIZE) * BLOCK_SIZE +
+                    left + i % MINI_BLOCK_SIZE;
+            add_unit(&v, unit, rules);
+        }
+    } else {
+        map = read_variant(&v, rules);
+    }
+    if (map == false)
+        for (int i = 0; i < BLOCK_SIZE; i++)
+            add_unit(&v, squares[i], rules);
+    find_variant_peers(&v);
+    variant = &v;
+    clear_hash_table(); // Its states were refuted by other rules
+}
+
+
+////////////// Solving functions
+
+static uint8_t peers[BOARD_SIZE][NUM_PEERS];
+static pthread_once_t peers_once = PTHREAD_ONCE_INIT;
+
+/*
+  Lists the cells that share a row, column or square with each cell.
+*/
+
+static void
+find_peers()
+{
+    const size_t (*units[3])[BLOCK_SIZE] = {rows, squares, cols};
+    int n;
+
+    for (int i = 0; i < BOARD_SIZE; i++) {
+        n = 0;
+        for (int u = 0; u < 3; u++) {
+            for (int j = 0; j < BLOCK_SIZE; j++) {
+                uint8_t k = units[u][lookup[i][u]][j];
+                bool known = (k == i);
+                for (int m = 0; m < n && known == false; m++)
+                    known = (peers[i][m] == k);
+                if (known == false)
+                    peers[i][n++] = k;
+            }
+        }
+    }
+}
+
+/*
+  The tables propagate goes by: a variant's, or with v NULL classic
+  Sudoku's fixed ones (units 0 to 8 are the rows, then the squares, then the
+  columns), whose sizes are constants, so that the classic propagate is
+  compiled with them.
+*/
+
+static inline int
+n_units(const struct variant_s *v)
+{
+    return v ? v->n_units : 3 * BLOCK_SIZE;
+}
+
+static inline size_t
+unit_cell(const struct variant_s *v, int u, int k)
+{
+    const size_t (*units[3])[BLOCK_SIZE] = {rows, squares, cols};
+
+    return v ? v->units[u][k] : units[u / BLOCK_SIZE][u % BLOCK_SIZE][k];
+}
+
+static inline int
+n_cell_units(const struct variant_s *v, int c)
+{
+    return v ? v->n_cell_units[c] : 3;
+}
+
+static inline int
+cell_unit(const struct variant_s *v, int c, int k)
+{
+    return v ? v->cell_units[c][k] : k * BLOCK_SIZE + (int) lookup[c][k];
+}
+
+static inline int
+n_peers(const struct variant_s *v, int c)
+{
+    return v ? v->n_peers[c] : NUM_PEERS;
+}
+
+static inline int
+peer(const struct variant_s *v, int c, int k)
+{
+    return v ? v->peers[c][k] : peers[c][k];
+}
+
+/*
+  Fills in what follows from the cells with one option: their values are
+  taken from their peers' options (naked singles) and, with hidden_singles,
+  a value that fits in only one cell of a unit is set there, until neither
+  changes anything. The options of the other cells are worked out from
+  scratch first. After that it works off two lists: cells just left with one
+  option, whose value is still to be taken from their peers, and units a
+  cell of which has lost options since they were last looked at. So the
+  work follows the changes rather than the size of the board, and it is
+  done when both lists are empty. Counts a sweep each time it starts on the
+  units listed so far in the board's iterations, if there are more than
+  there were. Inlined twice by propagate: once for classic Sudoku, once
+  for a variant's tables.
+*/
+
+static inline __attribute__((always_inline)) void
+propagate_by(struct board_s *bitboard, bool hidden_singles,
+             const struct variant_s *v)
+{
+    uint32_t *grid = bitboard->grid, used[MAX_UNITS] = {0};
+    uint32_t taken, once, twice, hidden, found;
+    uint64_t dirty = 0, sweep = 0, bit;
+    uint8_t queue[BOARD_SIZE];
+    int head = 0, tail = 0, sweeps = 0, c, p, u, k;
+
+    for (u = 0; u < n_units(v); u++)
+        for (k = 0; k < BLOCK_SIZE; k++)
+            if (one_bit(grid[unit_cell(v, u, k)]))
+                used[u] |= grid[unit_cell(v, u, k)];
+    for (c = 0; c < BOARD_SIZE; c++) {
+        if (one_bit(grid[c]))
+            continue;
+        taken = 0;
+        for (k = 0; k < n_cell_units(v, c); k++)
+            taken |= used[cell_unit(v, c, k)];
+        grid[c] = FULL_MASK & ~taken;
+        if (one_bit(grid[c]))
+            queue[tail++] = c;
+    }
+    if (hidden_singles)
+        dirty = (n_units(v) == 64) ? UINT64_MAX : (1ull << n_units(v)) - 1;
+
+    do {
+        sweep = dirty;
+        sweeps++;
+        while (1) {
+            while (head < tail) {
+                c = queue[head++];
+                for (k = 0; hidden_singles && k < n_cell_units(v, c); k++)
+                    dirty |= 1ull << cell_unit(v, c, k);
+                for (k = 0; k < n_peers(v, c); k++) {
+                    p = peer(v, c, k);
+                    if ((grid[p] & grid[c]) == 0 || one_bit(grid[p]))
+                        continue;
+                    grid[p] &= ~grid[c];
+                    if (one_bit(grid[p]))
+                        queue[tail++] = p;
+                    for (int j = 0; hidden_singles &&
+                             j < n_cell_units(v, p); j++)
+                        dirty |= 1ull << cell_unit(v, p, j);
+                }
+            }
+            if (sweep == 0)
+                break;
+            u = __builtin_ctzll(sweep);
+            bit = 1ull << u;
+            sweep &= ~bit;
+            dirty &= ~bit;
+            once = twice = 0;
+            for (k = 0; k < BLOCK_SIZE; k++) {
+                twice |= once & grid[unit_cell(v, u, k)];
+                once |= grid[unit_cell(v, u, k)];
+            }
+            hidden = once & ~twice;
+            for (k = 0; k < BLOCK_SIZE && hidden; k++) {
+                c = unit_cell(v, u, k);
+                if ( (found = grid[c] & hidden) == 0)
+                    continue;
+                hidden &= ~found;
+                if (one_bit(grid[c]) == false) {
+                    grid[c] = found & -found;
+                    queue[tail++] = c;
+                }
+            }
+        }
+    } while (dirty);
+
+    if (sweeps > bitboard->iterations)
+        bitboard->iterations = sweeps;
+}
+
+static void
+propagate(struct board_s *bitboard, bool hidden_singles)
+{
+    if (variant) {
+        propagate_by(bitboard, hidden_singles, variant);
+    } else {
+        pthread_once(&peers_once, find_peers);
+        propagate_by(bitboard, hidden_singles, NULL);
+    }
+}
+
+/*
+  Saves a completed Sudoku puzzle into the solutions array in the bitboard
+  struct. Called by the check_bitboard function if it finds that a bitboard
+  is complete and valid.
+*/
+
+static void
+save_solution(struct board_s *bitboard)
+{
+    for (size_t i = 0; i < MAX_SOLUTIONS; i++) {
+        if (bitboard->solutions[i][0] == 0) {
+            memcpy(bitboard->solutions[i], bitboard->grid,
+                   sizeof(bitboard->grid));
+            break;
+        } else {
+            if (memcmp(bitboard->solutions[i], bitboard->grid,
+                       sizeof(bitboard->grid)) == 0)
+                break;
+        }
+    }
+}
+
+/*
+   Checks if the n units (rows, squares or columns) in indices are valid or
+   complete
+*/
+
+static bool
+check_bitboard_indices(struct board_s *bitboard,
+                       const size_t indices[][BLOCK_SIZE], int n)
+{
+    bool complete = true;
+    for (int i = 0; i < n &&
+             (bitboard->complete || bitboard->valid); i++) {
+        uint32_t mask = 0, options = 0;
+        for (size_t j = 0; j < BLOCK_SIZE; j++) {
+            size_t l = indices[i][j];
+            options |= bitboard->grid[l];
+            if (count_bits(bitboard->grid[l]) == 1) {
+                if ( (mask & bitboard->grid[l]) )
+                    bitboard->valid = false;
+                mask = mask | bitboard->grid[l];
+            } else {
+                complete = false;
+                if ( (bitboard->grid[l] == 0)
+                    || (bitboard->grid[l] && (mask ^ bitboard->grid[l]) == 0) )
+                    bitboard->valid = false;
+            }
+        }
+        if (options != FULL_MASK)
+            bitboard->valid = false;
+    }
+    return complete;
+}
+
+
+/*
+  Checks a bitboard for completeness or validity. Saves it in the solutions
+  array of the bitboard struct if it is complete and valid.
+ */
+
+static void
+check_bitboard(struct board_s *bitboard)
+{
+    bitboard->valid = true;
+    if (variant) {
+        bitboard->complete = check_bitboard_indices(bitboard, variant->units,
+                                                    variant->n_units);
+    } else {
+        bitboard->complete = check_bitboard_indices(bitboard, cols,
+                                                    BLOCK_SIZE);
+        bitboard->complete = check_bitboard_indices(bitboard, squares,
+                                                    BLOCK_SIZE) &&
+            bitboard->complete;
+        bitboard->complete = check_bitboard_indices(bitboard, rows,
+                                                    BLOCK_SIZE) &&
+            bitboard->complete;
+    }
+    if (bitboard->complete && bitboard->valid)
+        save_solution(bitboard);
+}
+
+/*
+  Finds the next cell in the bitboard with more than one possible value.
+  The search_solution algorithm will then try one of the values in this cell.
+*/
+
+static void
+get_next_cell(struct board_s *bitboard)
+{
+    do {
+        ++bitboard->current_index;
+        bitboard->current_mask = bitboard->grid[bitboard->current_index];
+    } while (count_bits(bitboard->current_mask) < 2 &&
+             bitboard->current_index < BOARD_SIZE);
+}
+
+/*
+  Picks the cell to branch on the way the thread's strategy says. Sets
+  current_index to BOARD_SIZE if every cell has a single option.
+*/
+
+static void
+choose_cell(struct board_s *bitboard)
+{
+    int bits, fewest = BLOCK_SIZE + 1, ties = 0;
+
+    if (strategy->cell_order == CELL_FIRST) {
+        get_next_cell(bitboard);
+        return;
+    }
+    bitboard->current_index = BOARD_SIZE;
+    for (int i = 0; i < BOARD_SIZE; i++) {
+        bits = count_bits(bitboard->grid[i]);
+        if (bits < 2)
+            continue;
+        if (strategy->cell_order == CELL_LAST) {
+            bitboard->current_index = i;
+        } else if (bits < fewest) {
+            bitboard->current_index = i;
+            fewest = bits;
+            ties = 1;
+        } else if (bits == fewest && strategy->random_ties &&
+                   random_below(++ties) == 0) {
+            bitboard->current_index = i;
+        }
+    }
+    if (bitboard->current_index < BOARD_SIZE)
+        bitboard->current_mask = bitboard->grid[bitboard->current_index];
+}
+
+/*
+  Writes the order in which the thread's strategy tries the values of a
+  cell.
+*/
+
+static void
+order_values(uint8_t order[BLOCK_SIZE])
+{
+    for (int i = 0; i < BLOCK_SIZE; i++)
+        order[i] = (strategy->value_order == VALUES_DESCENDING) ?
+            BLOCK_SIZE - 1 - i : i;
+    if (strategy->value_order == VALUES_RANDOM) {
+        for (int i = BLOCK_SIZE - 1; i > 0; i--) {
+            int r = random_below(i + 1);
+            uint8_t t = order[r];
+            order[r] = order[i];
+            order[i] = t;
+        }
+    }
+}
+
+/*
+  Only fills in cells with a single option left (naked singles), for
+  strategies that leave out the rest of fill.
+*/
+
+static void
+fill_naked_singles(struct board_s *bitboard)
+{
+    propagate(bitboard, false);
+}
+
+/*
+  Fills in everything that follows from naked and hidden singles (see
+  propagate).
+*/
+
+static void
+fill(struct board_s *bitboard)
+{
+    propagate(bitboard, true);
+}
+
+/*
+  Fills as much of the bitboard as possible without needing recursion
+  and then checks if it's valid.
+ */
+
+static void
+check_bitboard_comprehensive(struct board_s *bitboard)
+{
+    fill(bitboard);
+    check_bitboard(bitboard);
+}
+
+/*
+  Gives the calling thread a budget of timeout milliseconds and nodes steps
+  (0 for no limit), also stopping when *cancel is set. Everything it runs
+  until end_limits counts against the budget.
+*/
+
+static void
+start_limits(struct limits_s *l, uint64_t timeout, uint64_t nodes,
+             const bool *cancel)
+{
+    memset(l, 0, sizeof(*l));
+    if (timeout)
+        l->deadline = monotonic_ns() + timeout * 1000000ull;
+    l->max_nodes = nodes;
+    l->cancel = cancel;
+    limits = (timeout || nodes || cancel) ? l : NULL;
+}
+
+static void
+end_limits()
+{
+    limits = NULL;
+}
+
+/*
+  Counts a step against the budget. Returns true once the budget has run
+  out. The clock is only read every DEADLINE_CHECK_NODES steps, unless the
+  step is a slow one (look_at_clock).
+*/
+
+static bool
+out_of_budget(bool look_at_clock)
+{
+    if (limits == NULL)
+        return false;
+    if (limits->expired)
+        return true;
+    limits->nodes++;
+    if (limits->max_nodes && limits->nodes > limits->max_nodes)
+        limits->expired = true;
+    if (limits->cancel && __atomic_load_n(limits->cancel, __ATOMIC_RELAXED))
+        limits->expired = true;
+    if (limits->deadline &&
+        (look_at_clock || limits->nodes % DEADLINE_CHECK_NODES == 0) &&
+        monotonic_ns() >= limits->deadline)
+        limits->expired = true;
+    return limits->expired;
+}
+
+/*
+  Checks how many solutions have been found after solve has been called.
+ */
+
+int
+num_solutions(const struct board_s *board)
+{
+    int c = 0;
+    for (size_t i = 0; i < MAX_SOLUTIONS; i++)
+        if (board->solutions[i][0] > 0)
+            c++;
+        else
+            break;
+
+    return c;
+}
+
+/*
+ * This is the recursive algorithm that searches for a solution to the puzzle.
+ * It tries a couple of simple techniques to set the possible values of the
+ * missing cells (see the fill function and its subsidiaries) and then
+ * if it can't make progress, does a recursive depth first search
+ * for a solution.
+ *
+ * Key is the Zobrist key of the board as it comes in (see grid_key), and
+ * *height is set to how much deeper than depth the search went. With a
+ * transposition table, a board found to have no solution is saved in it,
+ * and a board saved there before isn't searched again as long as the
+ * search it skips would have stayed within max_depth. So results, depths
+ * included, are the same as without the table.
+ */
+static struct board_s
+search_keyed(struct board_s bitboard, int depth, int max_depth, uint64_t key,
+             int *height)
+{
+    static const uint8_t ascending[BLOCK_SIZE] = {0, 1, 2, 3, 4, 5, 6, 7, 8};
+    uint8_t shuffled[BLOCK_SIZE];
+    const uint8_t *order = ascending;
+    struct board_s new_board;
+    int decided = 0, found = 0, child_height;
+    bool keyed = hash_table.entries;
+    uint64_t entry_key = key;
+    grid_t before;
+
+    *height = 0;
+    if (depth > bitboard.depth)
+        bitboard.depth = depth;
+    if (bitboard.depth > max_depth) {
+        bitboard.too_difficult = true;
+        return bitboard;
+    }
+    if (out_of_budget(false)) {
+        bitboard.timed_out = true;
+        return bitboard;
+    }
+    if (keyed) {
+        if (find_refuted(key, max_depth - depth, height)) {
+            if (depth + *height > bitboard.depth)
+                bitboard.depth = depth + *height;
+            trace_event(TRACE_CONTRADICTION, depth, 0, 0);
+            return bitboard;
+        }
+        found = num_solutions(&bitboard);
+        memcpy(before, bitboard.grid, sizeof(before));
+    }
+
+    if (trace)
+        decided = count_decided(&bitboard);
+    if (strategy && strategy->hidden_singles == false)
+        fill_naked_singles(&bitboard);
+    else
+        fill(&bitboard);
+    if (trace)
+        trace_event(TRACE_PROPAGATE, depth, 0,
+                    count_decided(&bitboard) - decided);
+
+    check_bitboard(&bitboard);
+    if ( (bitboard.complete && bitboard.valid) ||
+         bitboard.current_index == BOARD_SIZE) {
+        trace_event(TRACE_SOLUTION, depth, 0, 0);
+        return bitboard;
+    } else if (bitboard.valid == false) {
+        trace_event(TRACE_CONTRADICTION, depth, 0, 0);
+        return bitboard;
+    }
+
+    if (strategy) {
+        choose_cell(&bitboard);
+        if (bitboard.current_index == BOARD_SIZE)
+            return bitboard;
+        order_values(shuffled);
+        order = shuffled;
+    } else {
+        get_next_cell(&bitboard);
+    }
+    if (keyed)
+        key = update_key(key, before, bitboard.grid);
+
+    for(size_t k = 0; k < BLOCK_SIZE; k++) {
+        size_t i = order[k];
+        if (masks[i] & bitboard.grid[bitboard.current_index]) {
+            new_board = bitboard;
+            new_board.grid[bitboard.current_index] = masks[i];
+            trace_event(TRACE_BRANCH, depth, bitboard.current_index, i + 1);
+            new_board = search_keyed(new_board, depth + 1, max_depth,
+                                     keyed ? key ^
+                                     cell_key(bitboard.current_index,
+                                              bitboard.grid[
+                                                  bitboard.current_index] ^
+                                              masks[i]) : 0, &child_height);
+            for (size_t j = 0; j < MAX_SOLUTIONS; j++)
+                if (new_board.solutions[j][0] && !bitboard.solutions[j][0])
+                    memcpy(bitboard.solutions[j], new_board.solutions[j],
+                           sizeof(new_board.solutions[j]));
+                else
+                    break;
+            if (new_board.depth > bitboard.depth)
+                bitboard.depth = new_board.depth;
+            if (child_height + 1 > *height)
+                *height = child_height + 1;
+            if (new_board.timed_out) {
+                bitboard.timed_out = true;
+                return bitboard;
+            }
+            if (new_board.solutions[MAX_SOLUTIONS - 1][0])
+                return new_board;
+        }
+    }
+    if (keyed && num_solutions(&bitboard) == found &&
+        depth + *height <= max_depth)
+        save_refuted(entry_key, *height);
+    return bitboard;
+}
+
+/*
+  Searches bitboard (see search_keyed), working its key out first if there
+  is a transposition table.
+*/
+
+struct board_s
+search_solution(struct board_s bitboard, int depth, int max_depth)
+{
+    int height;
+
+    return search_keyed(bitboard, depth, max_depth,
+                        hash_table.entries ? grid_key(bitboard.grid) : 0,
+                        &height);
+}
+
+
+/*
+  Wrapper around the recursive search_solutions algorithm.
+ */
+
+void
+solve(struct board_s *bitboard, int max_depth)
+{
+    check_bitboard_comprehensive(bitboard);
+
+    if (bitboard->valid && bitboard->complete == false)
+        *bitboard = search_solution(*bitboard, 0, max_depth);
+}
+
+/*
+  Starts handing out the solutions of board (see next_solution) whose paths
+  are in [from, to), or (from, to) if exclusive. An empty from or to means
+  the start or the end.
+*/
+
+void
+start_solutions(struct solution_iter_s *it, const struct board_s *board,
+                const char *from, bool exclusive, const char *to)
+{
+    it->n_frames = 0;
+    it->board = *board;
+    it->from_len = strlen(from);
+    it->to_len = strlen(to);
+    memcpy(it->from, from, it->from_len + 1);
+    memcpy(it->to, to, it->to_len + 1);
+    it->exclusive = exclusive;
+    it->started = it->done = it->timed_out = false;
+}
+
+/*
+  Propagates the board the search has reached through it->n_frames
+  branches. Copies it to solution and returns true if it is a solution to
+  hand out, and otherwise stacks it as a new branch unless it is invalid.
+*/
+
+static bool
+visit_board(struct solution_iter_s *it, struct board_s *board,
+            bool from_edge, bool to_edge, grid_t solution)
+{
+    struct solution_frame_s *f;
+    int depth = it->n_frames, cell;
+
+    fill(board);
+    check_bitboard(board);
+    if (board->valid == false)
+        return false;
+    if (board->complete) {
+        // On the from edge this path is a prefix of from, so it comes
+        // before it, unless it is from itself and from is included.
+        if (from_edge && (depth < it->from_len || it->exclusive))
+            return false;
+        memcpy(solution, board->grid, sizeof(grid_t));
+        it->path[depth] = 0;
+        return true;
+    }
+    for (cell = 0; cell < BOARD_SIZE && count_bits(board->grid[cell]) < 2;
+         cell++)
+        ;
+    f = &it->stack[it->n_frames++];
+    memcpy(f->grid, board->grid, sizeof(f->grid));
+    f->cell = cell;
+    f->digit = 0;
+    f->from_edge = from_edge;
+    f->to_edge = to_edge;
+    return false;
+}
+
+/*
+  Copies the next solution into solution and its path into it->path.
+  Returns false once there are none left or the budget (see start_limits)
+  has run out, which sets it->timed_out. The search always branches on the
+  first cell with more than one option and tries its digits in order, so
+  solutions come out in the order of their paths, and it only ever holds
+  the branches leading to the board it is looking at.
+*/
+
+bool
+next_solution(struct solution_iter_s *it, grid_t solution)
+{
+    struct board_s board = it->board;
+    struct solution_frame_s *f;
+    bool from_child, to_child;
+    char digit;
+    int d, i;
+
+    if (it->started == false) {
+        it->started = true;
+        if (visit_board(it, &board, it->from_len > 0, it->to_len > 0,
+                        solution))
+            return true;
+    }
+    while (it->n_frames > 0 && it->done == false) {
+        if (out_of_budget(false)) {
+            it->timed_out = true;
+            return false;
+        }
+        d = it->n_frames - 1;
+        f = &it->stack[d];
+        for (i = f->digit; i < BLOCK_SIZE && (masks[i] & f->grid[f->cell]) == 0;
+             i++)
+            ;
+        if (i == BLOCK_SIZE) {
+            it->n_frames--;
+            continue;
+        }
+        f->digit = i + 1;
+        digit = '1' + i;
+        from_child = f->from_edge && d < it->from_len;
+        if (from_child) {
+            if (digit < it->from[d])
+                continue;
+            from_child = (digit == it->from[d]);
+        }
+        to_child = f->to_edge;
+        if (to_child) {
+            if (digit > it->to[d] ||
+                (digit == it->to[d] && d + 1 == it->to_len))
+                break;
+            to_child = (digit == it->to[d]);
+        }
+        it->path[d] = digit;
+        memcpy(board.grid, f->grid, sizeof(f->grid));
+        board.grid[f->cell] = masks[i];
+        if (visit_board(it, &board, from_child, to_child, solution))
+            return true;
+    }
+    it->done = true;
+    return false;
+}
+
+/*
+  Returns the status of a solved board: one of the STATUS_ values.
+*/
+
+static int
+result_status(const struct board_s *board)
+{
+    int n = num_solutions(board);
+
+    if (board->timed_out)
+        return STATUS_TIMED_OUT;
+    if (board->too_difficult)
+        return STATUS_TOO_DIFFICULT;
+    if (n == 1)
+        return STATUS_UNIQUE;
+    return (n > 1) ? STATUS_MULTIPLE : STATUS_INVALID;
 }
 
 /*
   User friendly printout of results of attempt to solve puzzle.
  */
 
-void print_result(const struct board_s *board)
+void print_result(const struct board_s *board)
+{
+    int n = num_solutions(board);
+    if (board->timed_out) {
+        printf_c(ESSENTIAL, "Ran out of time after %llu steps.\n",
+                 (unsigned long long) (limits ? limits->nodes : 0));
+    } else if (board->too_difficult) {
+        printf_c(ESSENTIAL, "Puzzle was too hard to solve.\n");
+    } else if (n == 1) {
+        printf_c(ESSENTIAL, "Unique solution with depth %d\n",
+                 board->depth);
+        if (verbose) {
+            print_puzzle(board->solutions[0]);
+        }
+    } else if (n > 1) {
+        printf_c(ESSENTIAL, "Multiple solutions\n");
+        for (size_t j = 0; j < MAX_SOLUTIONS; j++) {
+            printf_c(ESSENTIAL, "Solution %zu\n", j);
+            print_puzzle(board->solutions[j]);
+            printf_c(ESSENTIAL, "\n");
+        }
+    } else {
+        printf_c(ESSENTIAL, "Invalid puzzle\n");
+    }
+}
+
+/*
+  Prints puzzle information. If verbosity is on, prints count which indicates
+  how much of the board is solved, and depth which indicates puzzle difficulty.
+*/
+
+void
+print_puzzle_info(const struct board_s *board)
+{
+    int count = 0;
+    for (size_t i = 0; i < BOARD_SIZE; i++)
+        if (count_bits(board->grid[i]) == 1)
+            count++;
+    printf_c(ESSENTIAL, "Count: %d\n", count);
+    printf_c(ESSENTIAL, "Depth: %d\n", board->depth);
+
+    printf_c(ESSENTIAL, "Puzzle: ", board->depth);
+    print_grid_as_str(board->grid);
+}
+
+/*
+  Prints the solutions to a puzzle.
+ */
+
+void
+output_solution(grid_t grid, int max_depth)
+{
+    struct board_s board;
+    struct limits_s l;
+    uint64_t start;
+    int n;
+    board = convert_to_bitboard(grid);
+    if (verbose)
+        print_puzzle(board.grid);
+    start_limits(&l, timeout_ms, max_nodes, NULL);
+    if (trace_path)
+        start_trace(grid);
+    start = monotonic_ns();
+    solve(&board, max_depth);
+    count_operation(OP_SOLVE, start, result_status(&board));
+    if (trace_path)
+        end_trace();
+
+    if (verbose || board.timed_out)
+        print_result(&board);
+    end_limits();
+
+    n = num_solutions(&board);
+    for (int i = 0; i < n; i++) {
+        printf("%d,", i+1);
+        print_grid_as_str(board.solutions[i]);
+    }
+}
+
+/*
+  Shuffles an array of unsigned integers.
+*/
+
+void
+shuffle(uint32_t arr[],
+        size_t n)
+{
+    for (size_t i = n - 1; i > 0; i--) {
+        uint32_t r = random_below(i + 1);
+        uint32_t t = arr[r];
+        arr[r] = arr[i];
+        arr[i] = t;
+    }
+}
+
+/*
+  Fills an array from 0 to n-1.
+ */
+
+void
+fill_0_to_n(uint32_t arr[],
+            size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        arr[i] = i;
+}
+
+/*
+  Fills an array from 0 to n-1 and then shuffles it.
+ */
+
+void fill_and_shuffle(uint32_t arr[], size_t n)
+{
+    fill_0_to_n(arr, n);
+    shuffle(arr, n);
+}
+
+/*
+  Randomly sets an integer to have one and only one of the first n bits set
+  where n is the size of the Sudoku alphabet (9 in the default version).
+*/
+
+void
+set_random_bit(uint32_t *n)
+{
+    int i = 0, j = random_below(count_bits(*n)) + 1, count = 0;
+
+    for (;count < j; i++)
+        if (masks[i] & *n)
+            ++count;
+
+    *n = masks[i - 1];
+}
+
+/* Creates puzzles that are generally very hard to solve.
+   The higher min_depth the harder (and slower to create) it is. But
+   even leaving min_depth at 0 generally makes it hard enough. Setting
+   max_depth too high may result in a very long time to create some puzzles.
+   A budget (see start_limits) bounds that time: the board returned then has
+   timed_out set.
+*/
+
+struct board_s
+create_puzzle(int min_depth,
+              int max_depth,
+              bool symmetry)
+{
+    uint32_t cells[BOARD_SIZE], *cell, *mirror_cell, i, mask, n, c = 0;
+    struct board_s board, test_board;
+
+    // Loop until we have a valid puzzle with a unique solution
+    // of sufficient depth
+    do {
+        printf_c(OPTIONAL, "Trying ... %u\n", c);
+
+        // We use two boards. One will be passed to the solving algorithm
+        // and will used to test for a solution.
+        // The other holds the current position.
+        init_board(&board);
+        init_board(&test_board);
+        n = 0;
+        memset(board.grid, 0, sizeof(board.grid));
+
+        // Shuffle an array of indices into the board
+        if (symmetry)
+            fill_and_shuffle(cells, BOARD_SIZE / 2 + 1);
+        else
+            fill_and_shuffle(cells, BOARD_SIZE);
+
+        // Randomly, but legally, set 16 cells
+        for (i = 0; i < 16 / ((int) (symmetry + 1)); i++) {
+            fill(&board);
+            if (board.grid[cells[i]] == 0) {
+                board.valid = false;
+                break;
+            }
+            set_random_bit(&board.grid[cells[i]]);
+            if (symmetry && cells[i] != BOARD_SIZE / 2 + 1) {
+                fill(&board);
+                if (board.grid[BOARD_SIZE - cells[i] - 1] == 0) {
+                    board.valid = false;
+                } else {
+                    assert(count_bits(board.grid[BOARD_SIZE - cells[i] - 1]));
+                    set_random_bit(&board.grid[BOARD_SIZE - cells[i] - 1]);
+                }
+            }
+        }
+
+        if (board.valid == false)
+            continue;
+        fill(&board);
+
+        // Now loop until a solution is found or the board is invalid
+        // On each iteration, randomly select an unfilled cell,
+        // set it to a randomly selected legal value, and
+        // check for a solution
+        do {
+            cell = &board.grid[cells[i]];
+            mask = *cell;
+            if (*cell == 0) {
+                board.valid = false;
+                break;
+            }
+            assert(count_bits(*cell));
+            set_random_bit(cell);
+            memcpy(&test_board, &board, sizeof(board));
+            fill(&test_board);
+            if (symmetry && cells[i] != BOARD_SIZE / 2 + 1) {
+                mirror_cell = &board.grid[BOARD_SIZE - cells[i] - 1];
+                if (*mirror_cell == 0) {
+                    board.valid = false;
+                    break;
+                }
+                assert(count_bits(*mirror_cell));
+                set_random_bit(mirror_cell);
+                memcpy(&test_board, &board, sizeof(board));
+                fill(&test_board);
+            }
+            solve(&test_board, max_depth);
+            if (test_board.timed_out)
+                break;
+            n = num_solutions(&test_board);
+            if (n == 0) {
+                *cell = mask ^ *cell;
+                if (*cell == 0 || test_board.depth > max_depth) {
+                    board.valid = false;
+                    break;
+                }
+            } else {
+                i++;
+            }
+        } while (n != 1 && i < (BOARD_SIZE / ((int) symmetry + 1) ) );
+        c++;
+    } while (out_of_budget(true) == false &&
+             (test_board.depth < min_depth || test_board.depth > max_depth ||
+              n != 1 || board.valid == false));
+    test_board.timed_out = (limits && limits->expired);
+    count_attempts(OP_CREATE, c);
+
+    // We have a valid solution in test_board and the starting grid in board.
+    // So copy the starting grid into test_board and that's what we return.
+    memcpy(test_board.grid, board.grid, sizeof(test_board.grid));
+    for (i = 0; i < BOARD_SIZE; i++)
+        if (count_bits(test_board.grid[i]) > 1)
+            test_board.grid[i] = 0;
+
+    return test_board;
+}
+
+/*
+  Runs fill on the board and records the old value of every cell it changed
+  on the trail, so that the change can be undone. Returns false if the trail
+  is full.
+*/
+
+static bool
+fill_with_trail(struct board_s *b, struct trail_s *trail)
+{
+    grid_t before;
+
+    memcpy(before, b->grid, sizeof(before));
+    fill(b);
+    for (int i = 0; i < BOARD_SIZE; i++) {
+        if (b->grid[i] != before[i]) {
+            if (trail->len == TRAIL_SIZE)
+                return false;
+            trail->entries[trail->len].cell = i;
+            trail->entries[trail->len].mask = before[i];
+            trail->len++;
+        }
+    }
+    return true;
+}
+
+/*
+  Restores the cells changed since the trail was mark entries long.
+*/
+
+static void
+undo_trail(struct board_s *b, struct trail_s *trail, int mark)
+{
+    while (trail->len > mark) {
+        trail->len--;
+        b->grid[trail->entries[trail->len].cell] =
+            trail->entries[trail->len].mask;
+    }
+}
+
+/*
+  This is used to create a random complete Sudoku board from which simpler
+  puzzles can be created. It's an order of magnitude slower at solving than the
+  search_solution algorithm. But it is useful for calculating the likely number
+  of completed Sudoku puzzles.
+
+  It works on a single board. Every change is recorded on a trail of (cell,
+  old value) pairs, and backtracking undoes the trail back to the mark of the
+  level being left, so the whole search only needs a few KB.
+*/
+struct board_choices_s
+make_random_complete_board(struct board_s *board)
+{
+    struct board_choices_s result;
+    struct trail_s trail;
+    struct trail_level_s levels[BOARD_SIZE + 1], *level;
+    int sp = 0, min_bits, bits;
+    uint32_t bit;
+
+    result.board = *board;
+    trail.len = 0;
+    fill(&result.board);
+    levels[0].mark = 0;
+    levels[0].cell = -1;
+
+    while (sp >= 0) {
+        level = &levels[sp];
+        if (level->cell < 0) {
+            // First visit: give up on this level if it's invalid, or finish if
+            // it's complete. Otherwise branch on the cell with fewest options.
+            check_bitboard(&result.board);
+            if (result.board.valid && result.board.complete)
+                break;
+            if (result.board.valid) {
+                min_bits = BLOCK_SIZE + 1;
+                for (int i = 0; i < BOARD_SIZE; i++) {
+                    bits = count_bits(result.board.grid[i]);
+                    if (bits > 1 && bits < min_bits) {
+                        level->cell = i;
+                        min_bits = bits;
+                    }
+                }
+                level->options = result.board.grid[level->cell];
+            }
+        }
+        if (result.board.valid == false || level->options == 0 ||
+            sp == BOARD_SIZE) {
+            if (--sp >= 0)
+                undo_trail(&result.board, &trail, levels[sp + 1].mark);
+            result.board.valid = true;
+            continue;
+        }
+
+        // Try a random option that hasn't been tried yet
+        level->choices = count_bits(level->options);
+        bit = masks[get_nth_set_bit(level->options,
+                                    random_below(level->choices))];
+        level->options &= ~bit;
+
+        levels[sp + 1].mark = trail.len;
+        levels[sp + 1].cell = -1;
+        trail.entries[trail.len].cell = level->cell;
+        trail.entries[trail.len].mask = result.board.grid[level->cell];
+        trail.len++;
+        result.board.grid[level->cell] = bit;
+        ++sp;
+        if (fill_with_trail(&result.board, &trail) == false)
+            result.board.valid = false;
+    }
+
+    if (sp < 0) {
+        init_board(&result.board);
+        result.board.valid = false;
+        result.board.complete = false;
+        result.log_choices = -INFINITY;
+    } else {
+        result.log_choices = 0.0;
+        for (int i = 0; i < sp; i++)
+            result.log_choices += log(levels[i].choices);
+        memcpy(result.board.grid, result.board.solutions[0],
+               BOARD_SIZE * sizeof(uint32_t));
+    }
+    return result;
+}
+
+bool
+unique_solution(struct board_s board)
+{
+    solve(&board, SOLVING_MAX_DEPTH);
+    if (board.valid && board.timed_out == false && num_solutions(&board) == 1)
+        return true;
+    else
+        return false;
+}
+
+/*
+  Makes easyish puzzles. At least not usually as hard as the default method.
+  The symmetry parameter ensures the puzzle is symmetrical. The min_removals
+  parameter is the minimum number of blank squares needed for the puzzle.
+  Note that the higher the value of min_removals the slower this will be and at
+  some high value it sends this function into an endless loop, unless the
+  thread has a budget (see start_limits), which makes it give up with
+  timed_out set.
+*/
+
+struct board_s
+make_easy_puzzle(bool symmetry, int min_removals) {
+    struct board_s board, prev;
+    int i;
+    uint64_t tries = 0;
+    if (symmetry) min_removals /= 2;
+    do {
+        i = 0;
+        tries++;
+        struct board_choices_s bc;
+        uint32_t shuffled_indices[BOARD_SIZE];
+        int num_cells;
+
+        if (symmetry) {
+            num_cells = BOARD_SIZE / 2 + 1;
+        } else {
+            num_cells = BOARD_SIZE;
+        }
+        fill_and_shuffle(shuffled_indices, num_cells);
+
+        init_board(&board);
+        memset(board.grid, 0, sizeof(board.grid));
+        bc = make_random_complete_board(&board);
+
+        memcpy(board.grid, bc.board.solutions[0], BOARD_SIZE * sizeof(uint32_t));
+        board.complete = false;
+
+        for (; i < num_cells && (i < min_removals || min_removals == 0); i++) {
+            int r = shuffled_indices[i];
+            prev = board;
+            board.grid[r] = 0;
+            if (symmetry && r != 40)
+                board.grid[80 - r] = 0;
+            if (unique_solution(board) == false)
+                break;
+        }
+    } while (i < min_removals && out_of_budget(true) == false);
+    if (min_removals == 0)
+        board = prev;
+    board.timed_out = (limits && limits->expired);
+    count_attempts(OP_EASY, tries);
+    return board;
+}
+
+/*
+  Number of worker threads to use: the --threads option or one per core.
+*/
+
+static int
+get_num_threads()
+{
+    long n = num_threads;
+    if (n <= 0)
+        n = sysconf(_SC_NPROCESSORS_ONLN);
+    return (n > 0) ? (int) n : 1;
+}
+
+/*
+  Worker of find_redundant_clue. Takes the next clue to check, unless a
+  redundant one was already found before it. Threads check under the
+  caller's deadline, and the steps of each check count against the caller's
+  node budget.
+*/
+
+static void *
+check_clues(void *arg)
+{
+    struct clue_check_s *check = arg;
+    int id = __atomic_fetch_add(&check->workers, 1, __ATOMIC_RELAXED);
+    struct limits_s l;
+    struct board_s board;
+    grid_t puzzle;
+    uint64_t start = 0;
+    int i, cell;
+    bool redundant, expired;
+
+    while (true) {
+        pthread_mutex_lock(&check->lock);
+        i = check->next++;
+        if (i >= check->found) {
+            pthread_mutex_unlock(&check->lock);
+            break;
+        }
+        check->current[id] = i;
+        __atomic_store_n(&check->cancel[id], false, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&check->lock);
+
+        memcpy(puzzle, check->puzzle, sizeof(grid_t));
+        cell = check->cells[i];
+        puzzle[cell] = 0;
+        if (check->symmetry)
+            puzzle[BOARD_SIZE - cell - 1] = 0;
+        board = convert_to_bitboard(puzzle);
+        if (check->threaded) {
+            start_limits(&l, 0, check->max_nodes, &check->cancel[id]);
+            l.deadline = check->deadline;
+            l.nodes = __atomic_load_n(&check->nodes, __ATOMIC_RELAXED);
+            start = l.nodes;
+        }
+        redundant = unique_solution(board);
+        expired = (redundant == false && limits && limits->expired);
+        if (check->threaded) {
+            __atomic_fetch_add(&check->nodes, l.nodes - start,
+                               __ATOMIC_RELAXED);
+            end_limits();
+        }
+        if (redundant == false && expired == false)
+            continue;
+
+        // Clues after this one no longer matter: cancel their checks
+        pthread_mutex_lock(&check->lock);
+        if (i < check->found) {
+            check->found = i;
+            check->expired = expired;
+            for (int t = 0; t < check->n_threads; t++)
+                if (check->current[t] > i)
+                    __atomic_store_n(&check->cancel[t], true,
+                                     __ATOMIC_RELAXED);
+        }
+        pthread_mutex_unlock(&check->lock);
+    }
+    return NULL;
+}
+
+/*
+  Looks for a redundant clue of a puzzle (in digits), one whose removal
+  leaves the solution unique, among cells[start] to cells[n - 1]. With
+  symmetry each clue is removed together with its mirror. Returns the index
+  of the first redundant one, -1 if there are none, or CLUE_UNDETERMINED if
+  the calling thread's budget (see start_limits) ran out first. The checks
+  run on n_threads threads, which stop as soon as the answer is known. With
+  one thread they run on the calling thread.
+*/
+
+static int
+find_redundant_clue(const grid_t puzzle, const uint32_t *cells, int n,
+                    int start, bool symmetry, int n_threads)
+{
+    struct clue_check_s check;
+    pthread_t *threads = malloc(n_threads * sizeof(pthread_t));
+
+    pthread_mutex_init(&check.lock, NULL);
+    memcpy(check.puzzle, puzzle, sizeof(grid_t));
+    check.cells = cells;
+    check.symmetry = symmetry;
+    check.threaded = (n_threads > 1);
+    check.n_threads = n_threads;
+    check.next = start;
+    check.found = n;
+    check.expired = false;
+    check.deadline = limits ? limits->deadline : 0;
+    check.max_nodes = limits ? limits->max_nodes : 0;
+    check.nodes = limits ? limits->nodes : 0;
+    check.workers = 0;
+    check.current = malloc(n_threads * sizeof(int));
+    check.cancel = calloc(n_threads, sizeof(bool));
+    for (int t = 0; t < n_threads; t++)
+        check.current[t] = -1;
+
+    if (check.threaded) {
+        for (int t = 0; t < n_threads; t++)
+            pthread_create(&threads[t], NULL, check_clues, &check);
+        for (int t = 0; t < n_threads; t++)
+            pthread_join(threads[t], NULL);
+    } else {
+        check_clues(&check);
+    }
+
+    free(threads);
+    free(check.current);
+    free(check.cancel);
+    pthread_mutex_destroy(&check.lock);
+    if (check.threaded && limits) {
+        limits->nodes = check.nodes;
+        limits->expired |= check.expired;
+    }
+    if (check.found >= n)
+        return -1;
+    return check.expired ? CLUE_UNDETERMINED : check.found;
+}
+
+/*
+  Removes clues from a puzzle, in a random order, until none is redundant:
+  the puzzle becomes minimal (with symmetry, minimal among symmetrical
+  puzzles). A clue that isn't redundant stays so as others are removed, so
+  one pass over the clues is enough. The board is then solved again, as
+  create_puzzle leaves it.
+*/
+
+static void
+make_minimal(struct board_s *board, bool symmetry, int n_threads)
+{
+    uint32_t order[BOARD_SIZE], cells[BOARD_SIZE];
+    grid_t puzzle;
+    int n = 0;
+
+    for (int c = 0; c < BOARD_SIZE; c++)
+        puzzle[c] = count_bits(board->grid[c]) == 1 ?
+            get_bit_index(board->grid[c]) + 1 : 0;
+    fill_and_shuffle(order, BOARD_SIZE);
+    for (int i = 0; i < BOARD_SIZE; i++)
+        if (puzzle[order[i]] && (symmetry == false ||
+                                 order[i] <= BOARD_SIZE - order[i] - 1))
+            cells[n++] = order[i];
+
+    for (int i = 0; (i = find_redundant_clue(puzzle, cells, n, i, symmetry,
+                                             n_threads)) >= 0; i++) {
+        puzzle[cells[i]] = 0;
+        if (symmetry)
+            puzzle[BOARD_SIZE - cells[i] - 1] = 0;
+    }
+
+    *board = convert_to_bitboard(puzzle);
+    solve(board, SOLVING_MAX_DEPTH);
+    memcpy(board->grid, convert_to_bitboard(puzzle).grid, sizeof(grid_t));
+    board->timed_out = (limits && limits->expired);
+}
+
+/*
+  Difficulty of a puzzle as create_puzzle measures it: the depth of the
+  search that solves it. Returns -1 if it doesn't have a unique solution
+  or needs to go deeper than max_depth, and sets *timed_out if the
+  thread's budget ran out.
+*/
+
+static int
+puzzle_depth(const grid_t puzzle, int max_depth, bool *timed_out)
+{
+    struct board_s board;
+
+    init_board(&board);
+    memcpy(board.grid, puzzle, sizeof(grid_t));
+    solve(&board, max_depth);
+    *timed_out = board.timed_out;
+    if (board.valid == false || board.timed_out || board.too_difficult ||
+        board.depth > max_depth || num_solutions(&board) != 1)
+        return -1;
+    return board.depth;
+}
+
+/*
+  Picks a random cell of puzzle (out of the first n) that is a clue if
+  clue is true or a blank otherwise. Returns -1 if there is none.
+*/
+
+static int
+random_cell(const grid_t puzzle, int n, bool clue)
+{
+    int cells[BOARD_SIZE], count = 0;
+
+    for (int i = 0; i < n; i++)
+        if ((puzzle[i] != 0) == clue)
+            cells[count++] = i;
+    return count ? cells[random_below(count)] : -1;
+}
+
+/*
+  Creates a puzzle with a depth from min_depth to max_depth by local
+  search, instead of starting again from nothing whenever a puzzle misses,
+  like create_puzzle. A chain starts from an easy puzzle and its solution,
+  and each move removes a clue, adds one from the solution or does both,
+  keeping the solution unique. Moves that bring the depth nearer to
+  min_depth are kept, and ones that take it further away by d are kept
+  with probability exp(-d / temperature) (simulated annealing), the
+  temperature falling with each move. After ANNEAL_MOVES moves the chain
+  starts afresh. With symmetry, a clue and its mirror image move
+  together. Returns the board the way create_puzzle does.
+*/
+
+struct board_s
+anneal_puzzle(int min_depth, int max_depth, bool symmetry)
+{
+    int n = symmetry ? BOARD_SIZE / 2 + 1 : BOARD_SIZE;
+    int depth = -1, new_depth, moves = 0, removed, added;
+    double temperature = ANNEAL_TEMPERATURE;
+    uint64_t tries = 0;
+    struct board_s board;
+    grid_t puzzle, candidate, solution;
+    bool timed_out = false;
+
+    do {
+        if (depth < 0 || moves == ANNEAL_MOVES) {
+            board = make_easy_puzzle(symmetry, 0);
+            if (board.timed_out)
+                break;
+            memcpy(puzzle, board.grid, sizeof(grid_t));
+            solve(&board, SOLVING_MAX_DEPTH);
+            memcpy(solution, board.solutions[0], sizeof(grid_t));
+            depth = puzzle_depth(puzzle, max_depth, &timed_out);
+            temperature = ANNEAL_TEMPERATURE;
+            moves = 0;
+            continue;
+        }
+
+        memcpy(candidate, puzzle, sizeof(grid_t));
+        removed = added = -1;
+        switch (random_below(3)) {
+        case 0:
+            removed = random_cell(candidate, n, true);
+            break;
+        case 1:
+            added = random_cell(candidate, n, false);
+            break;
+        default:
+            removed = random_cell(candidate, n, true);
+            added = random_cell(candidate, n, false);
+        }
+        if (removed >= 0) {
+            candidate[removed] = 0;
+            if (symmetry)
+                candidate[BOARD_SIZE - removed - 1] = 0;
+        }
+        if (added >= 0) {
+            candidate[added] = solution[added];
+            if (symmetry)
+                candidate[BOARD_SIZE - added - 1] =
+                    solution[BOARD_SIZE - added - 1];
+        }
+        moves++;
+        tries++;
+        temperature *= ANNEAL_COOLING;
+
+        new_depth = puzzle_depth(candidate, max_depth, &timed_out);
+        if (new_depth < 0)
+            continue;
+        if (new_depth >= depth || random_below(1 << 30) <
+            exp((new_depth - depth) / temperature) * (1 << 30)) {
+            memcpy(puzzle, candidate, sizeof(grid_t));
+            depth = new_depth;
+        }
+    } while (depth < min_depth && timed_out == false &&
+             out_of_budget(true) == false);
+
+    count_attempts(OP_CREATE, tries);
+    init_board(&board);
+    memcpy(board.grid, puzzle, sizeof(grid_t));
+    board.depth = depth;
+    board.timed_out = (limits && limits->expired);
+    if (board.timed_out == false && depth >= 0) {
+        // The chain kept the solution unique, so it is the solution
+        memcpy(board.solutions[0], solution, sizeof(grid_t));
+        board.valid = true;
+    }
+    return board;
+}
+
+/* Shared by the chains of anneal_in_parallel */
+static struct {
+    pthread_mutex_t lock;
+    int min_depth, max_depth;
+    bool symmetry;
+    bool done; // Set by the first chain to reach its target, to stop the rest
+    uint64_t nodes; // Steps taken by all the chains
+    struct board_s result;
+} chains = { PTHREAD_MUTEX_INITIALIZER };
+
+/*
+  Worker thread. Runs a chain of anneal_puzzle until it or another one has
+  a puzzle.
+*/
+
+static void *
+run_chain(void *arg)
+{
+    long id = (long) arg;
+    struct board_s board;
+    struct limits_s l;
+
+    seed_thread_rng(id + 1);
+    start_limits(&l, timeout_ms, max_nodes, &chains.done);
+    board = anneal_puzzle(chains.min_depth, chains.max_depth,
+                          chains.symmetry);
+    end_limits();
+
+    pthread_mutex_lock(&chains.lock);
+    chains.nodes += l.nodes;
+    if (board.timed_out == false && chains.done == false) {
+        __atomic_store_n(&chains.done, true, __ATOMIC_RELAXED);
+        chains.result = board;
+    }
+    pthread_mutex_unlock(&chains.lock);
+    return NULL;
+}
+
+/*
+  Runs a chain of anneal_puzzle on every thread and returns the first
+  puzzle found, or a board with timed_out set if the budget (each chain's)
+  ran out first. The chains' steps are counted in the caller's budget.
+*/
+
+struct board_s
+anneal_in_parallel(int min_depth, int max_depth, bool symmetry)
+{
+    int n = get_num_threads();
+    pthread_t *threads = malloc(n * sizeof(pthread_t));
+
+    chains.min_depth = min_depth;
+    chains.max_depth = max_depth;
+    chains.symmetry = symmetry;
+    chains.done = false;
+    chains.nodes = 0;
+    init_board(&chains.result);
+    chains.result.timed_out = true;
+    for (long i = 0; i < n; i++)
+        pthread_create(&threads[i], NULL, run_chain, (void *) i);
+    for (int i = 0; i < n; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    if (limits)
+        limits->nodes += chains.nodes;
+    return chains.result;
+}
+
+/*
+  Checks the depths requested for creating a puzzle. Returns an error message
+  or NULL if they're fine.
+*/
+
+static const char *
+check_creating_depths(int min_depth, int max_depth)
+{
+    if (max_depth - min_depth < 3)
+        return "Depth for puzzle too close to max depth.";
+    if (max_depth < 0)
+        return "Depths must be positive.";
+    if (min_depth > CREATING_MAX_DEPTH)
+        return "Depth is too ambitious.";
+    return NULL;
+}
+
+/*
+  Wrapper function for creating a new puzzle.
+*/
+
+void
+output_puzzle(int min_depth, bool symmetry, bool minimal, int max_depth,
+              bool anneal)
+{
+    struct board_s board;
+    struct limits_s l;
+    uint64_t start;
+    const char *error = check_creating_depths(min_depth, max_depth);
+
+    if (error) {
+        fprintf(stderr, "%s\n", error);
+        exit(EXIT_FAILURE);
+    }
+
+    start_limits(&l, timeout_ms, max_nodes, NULL);
+    start = monotonic_ns();
+    board = anneal ? anneal_in_parallel(min_depth, max_depth, symmetry) :
+        create_puzzle(min_depth, max_depth, symmetry);
+    if (minimal && board.timed_out == false)
+        make_minimal(&board, symmetry, get_num_threads());
+    end_limits();
+    count_operation(OP_CREATE, start, board.timed_out ? STATUS_TIMED_OUT :
+                    STATUS_UNIQUE);
+    if (board.timed_out) {
+        printf_c(ESSENTIAL, "Ran out of time after %llu steps.\n",
+                 (unsigned long long) l.nodes);
+        return;
+    }
+    if (verbose)
+        print_puzzle(board.grid);
+
+    if (verbose)
+        print_result(&board);
+
+    print_puzzle_info(&board);
+}
+
+/*
+  CLI help.
+ */
+
+void
+print_help(const char *prog)
+{
+    printf_c(ESSENTIAL, "%s: A Sudoku puzzle creater and solver\n", prog);
+    printf_c(ESSENTIAL, "Options are: \n\n");
+    for (int i = 0; i < sizeof(long_options)/sizeof(struct option) - 1; i++) {
+        if (long_options[i].val < OPT_SERVE)
+            printf_c(ESSENTIAL, "--%s (or -%c) ", long_options[i].name,
+                     long_options[i].val);
+        else
+            printf_c(ESSENTIAL, "--%s ", long_options[i].name);
+        if (long_options[i].has_arg == required_argument)
+            printf_c(ESSENTIAL, "<%s>", arguments[i]);
+        putchar('\n');
+        printf_c(ESSENTIAL, "%s\n\n", descriptions[i]);
+    }
+    printf_c(ESSENTIAL, "Examples:\n");
+    printf_c(ESSENTIAL, "%s -c 0\n (Creates a simple puzzle)\n", prog);
+    printf_c(ESSENTIAL, "%s -m -c 2\n (Creates a hard symmetry puzzle)\n", prog);
+    printf_c(ESSENTIAL, "%s -s 3009857000080000200004000080006304000058219000090470006"
+           "00004000010000200002106009\n"
+           "(Solves the puzzle)\n", prog);
+}
+
+/*
+  Converts a string of BOARD_SIZE digits into a grid of human numbers. Returns
+  an error message or NULL if the string is a well formed puzzle.
+ */
+
+static const char *
+parse_puzzle(const char *puzzle_string, grid_t grid)
+{
+    size_t l = strlen(puzzle_string);
+    const char *c;
+    uint32_t *g;
+
+    if (l < BOARD_SIZE)
+        return "Too few cells specified";
+    else if (l > BOARD_SIZE)
+        return "Too many cells specified";
+    for (c = puzzle_string, g = grid; *c; c++, g++) {
+        if (*c >= '0' && *c <= '9')
+            *g = (uint32_t) (*c - '0');
+        else
+            return "Incorrect character used";
+    }
+    return NULL;
+}
+
+/*
+  Processes the command line option for solving a puzzle.
+ */
+
+void
+process_arg_for_solving(char *puzzle_string,
+                        int max_depth)
+{
+    grid_t grid;
+    const char *error = parse_puzzle(puzzle_string, grid);
+
+    if (error) {
+        fprintf(stderr, "%s\n", error);
+        exit(EXIT_FAILURE);
+    }
+    output_solution(grid, (max_depth == -1) ? SOLVING_MAX_DEPTH : max_depth);
+}
+
+/*
+  Checks that a puzzle is minimal: it has a unique solution and none of its
+  clues can be removed without losing that.
+*/
+
+void
+process_arg_for_checking_minimal(char *puzzle_string)
+{
+    uint32_t cells[BOARD_SIZE];
+    struct board_s board;
+    struct limits_s l;
+    grid_t grid;
+    int n = 0, redundant;
+    bool unique;
+    const char *error = parse_puzzle(puzzle_string, grid);
+
+    if (error) {
+        fprintf(stderr, "%s\n", error);
+        exit(EXIT_FAILURE);
+    }
+    board = convert_to_bitboard(grid);
+    for (int c = 0; c < BOARD_SIZE; c++)
+        if (grid[c])
+            cells[n++] = c;
+    start_limits(&l, timeout_ms, max_nodes, NULL);
+    unique = unique_solution(board);
+    redundant = unique ? find_redundant_clue(grid, cells, n, 0, false,
+                                             get_num_threads()) : -1;
+    end_limits();
+    if (l.expired && (unique == false || redundant == CLUE_UNDETERMINED))
+        printf_c(ESSENTIAL, "Undetermined: ran out of time after %llu "
+                 "steps\n", (unsigned long long) l.nodes);
+    else if (unique == false)
+        printf_c(ESSENTIAL, "Not minimal: no unique solution\n");
+    else if (redundant < 0)
+        printf_c(ESSENTIAL, "Minimal: all %d clues are needed\n", n);
+    else
+        printf_c(ESSENTIAL, "Not minimal: the clue at row %d, column %d "
+                 "can be removed\n", cells[redundant] / BLOCK_SIZE + 1,
+                 cells[redundant] % BLOCK_SIZE + 1);
+}
+
+/*
+  Allows the user to change the puzzle from which generation (creation of n
+  complete Sudoku board) will take place.
+*/
+
+void
+set_default_puzzle(const char *puzzle_str)
+{
+    int n = strlen(puzzle_str);
+    if (n != BOARD_SIZE) {
+        fprintf(stderr, "Incorrect puzzle length %d\n", n);
+        exit(1);
+    }
+
+    for (const char *c = puzzle_str; *c; c++) {
+        if (*c < '0' || *c > '9') {
+            fprintf(stderr, "Incorrect character used %c\n", *c);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    strcpy(default_puzzle, puzzle_str);
+}
+
+//////////// Record functions
+
+static struct records_s records;
+
+/*
+  Makes room for n records: maps the output file, grown to the size of n
+  records, or allocates memory when writing to standard output.
+*/
+
+static void
+open_records(uint64_t n)
+{
+    int fd;
+
+    records.size = records.binary ? BINARY_RECORD_SIZE : TEXT_RECORD_SIZE;
+    records.n = n;
+    records.first = 0;
+    if (records.path == NULL) {
+        if ((records.data = malloc(n * records.size + 1)) == NULL) {
+            perror("records");
+            exit(EXIT_FAILURE);
+        }
+        return;
+    }
+    if ((fd = open(records.path, O_RDWR | O_CREAT, 0644)) < 0 ||
+        ftruncate(fd, n * records.size) < 0) {
+        perror(records.path);
+        exit(EXIT_FAILURE);
+    }
+    records.data = (n == 0) ? malloc(1) :
+        mmap(NULL, n * records.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (records.data == MAP_FAILED) {
+        perror(records.path);
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+}
+
+/*
+  Makes room for records up to index n, when their number wasn't known at
+  open_records. Records already written stay where they are in the file,
+  but the mapping may move, so nothing may be writing meanwhile.
+*/
+
+static void
+reserve_records(uint64_t n)
+{
+    uint64_t size = (records.n > records.first) ? records.n - records.first : 1;
+    uint8_t *data;
+
+    if (n <= records.n)
+        return;
+    while (size < n - records.first)
+        size *= 2;
+    if (records.path == NULL) {
+        data = realloc(records.data, size * records.size + 1);
+    } else if (truncate(records.path, size * records.size) < 0) {
+        data = MAP_FAILED;
+    } else if (records.n == 0) {
+        int fd = open(records.path, O_RDWR);
+        free(records.data);
+        data = (fd < 0) ? MAP_FAILED : mmap(NULL, size * records.size,
+                                            PROT_READ | PROT_WRITE,
+                                            MAP_SHARED, fd, 0);
+        if (fd >= 0)
+            close(fd);
+    } else {
+        data = mremap(records.data, records.n * records.size,
+                      size * records.size, MREMAP_MAYMOVE);
+    }
+    if (data == NULL || data == MAP_FAILED) {
+        perror(records.path ? records.path : "records");
+        exit(EXIT_FAILURE);
+    }
+    records.data = data;
+    records.n = records.first + size;
+}
+
+/*
+  Prints the records up to index n, all written and none after them yet,
+  and reuses their memory, when writing to standard output. Files keep
+  everything.
+*/
+
+static void
+flush_records(uint64_t n)
+{
+    if (records.path != NULL)
+        return;
+    fwrite(records.data, records.size, n - records.first, stdout);
+    records.n += n - records.first;
+    records.first = n;
+}
+
+/*
+  Writes record i: the digits of a grid and a newline, or a status byte
+  followed by the digits packed two to a byte, the first in the low nibble,
+  or just the digits as bytes. A NULL grid is written as zeros. The status
+  also goes to records.status if there is one.
+*/
+
+static void
+write_record(uint64_t i, const grid_t grid, int status)
+{
+    uint8_t *r = records.data + (i - records.first) * records.size;
+    uint8_t digit;
+
+    if (records.binary) {
+        memset(r, 0, BINARY_RECORD_SIZE);
+        r[0] = status;
+        for (int j = 0; grid && j < BOARD_SIZE; j++) {
+            digit = grid[j] ? get_bit_index(grid[j]) + 1 : 0;
+            r[1 + j / 2] |= digit << (4 * (j % 2));
+        }
+    } else if (records.digits) {
+        for (int j = 0; j < BOARD_SIZE; j++)
+            r[j] = (grid && grid[j]) ? get_bit_index(grid[j]) + 1 : 0;
+    } else {
+        for (int j = 0; j < BOARD_SIZE; j++)
+            r[j] = (grid && grid[j]) ? '1' + get_bit_index(grid[j]) : '0';
+        r[BOARD_SIZE] = '\n';
+    }
+    if (records.status)
+        records.status[i - records.first] = status;
+}
+
+/*
+  Finishes with the records, of which the first n were written: the file is
+  cut down to them, or they are printed.
+*/
+
+static void
+close_records(uint64_t n)
+{
+    if (records.path == NULL) {
+        fwrite(records.data, records.size, n - records.first, stdout);
+        free(records.data);
+    } else {
+        if (records.n == 0)
+            free(records.data);
+        else
+            munmap(records.data, records.n * records.size);
+        if (truncate(records.path, n * records.size) < 0)
+            perror(records.path);
+    }
+    records.data = NULL;
+}
+
+
+//////////// Delta functions
+
+/*
+  A --delta file holds the boards of --generate, which come out in order and
+  so mostly start the way the one before did. A board is written as the
+  number of digits it shares with the start of the previous one, in
+  DELTA_PREFIX_BITS, and then the rest of its digits less one, in
+  DELTA_DIGIT_BITS each, packed from the low bit of each byte up. The boards
+  are grouped in blocks, each framed by its number of boards, its size in
+  bytes and its CRC-32, and the first board of a block shares nothing with
+  the one before, so every block can be decoded on its own. The file starts
+  with DELTA_MAGIC. After the blocks come an index, where each block starts
+  and the number of its first board, and a trailer: where the index starts,
+  the number of blocks and of boards, and DELTA_INDEX_MAGIC. Numbers are
+  little endian.
+*/
+
+static struct delta_s delta;
+
+static void
+put_le(uint8_t *p, uint64_t v, int n)
+{
+    for (int i = 0; i < n; i++, v >>= 8)
+        p[i] = v & 0xff;
+}
+
+static uint64_t
+get_le(const uint8_t *p, int n)
+{
+    uint64_t v = 0;
+
+    while (n--)
+        v = v << 8 | p[n];
+    return v;
+}
+
+/*
+  Appends the n (up to 8) low bits of v to buf, which must be zeroed ahead
+  of pos.
+*/
+
+static void
+put_bits(uint8_t *buf, uint64_t *pos, uint32_t v, int n)
+{
+    int shift = *pos % 8;
+
+    buf[*pos / 8] |= v << shift;
+    if (shift + n > 8)
+        buf[*pos / 8 + 1] |= v >> (8 - shift);
+    *pos += n;
+}
+
+static uint32_t
+get_bits(const uint8_t *buf, uint64_t *pos, int n)
+{
+    int shift = *pos % 8;
+    uint32_t v = buf[*pos / 8] >> shift;
+
+    if (shift + n > 8)
+        v |= buf[*pos / 8 + 1] << (8 - shift);
+    *pos += n;
+    return v & ((1u << n) - 1);
+}
+
+static void
+add_to_delta_index(uint64_t offset, uint64_t first)
+{
+    if (delta.n_blocks == delta.capacity) {
+        delta.capacity = delta.capacity ? 2 * delta.capacity : 64;
+        delta.index = realloc(delta.index,
+                              delta.capacity * sizeof(*delta.index));
+    }
+    delta.index[delta.n_blocks].offset = offset;
+    delta.index[delta.n_blocks++].first = first;
+}
+
+/*
+  Writes the block being filled, if it has any boards, and starts a new
+  one.
+*/
+
+static void
+end_delta_block()
+{
+    uint8_t frame[DELTA_FRAME_SIZE];
+    size_t bytes = (delta.bits + 7) / 8;
+
+    if (delta.n == 0)
+        return;
+    add_to_delta_index(ftello(delta.file), delta.count - delta.n);
+    put_le(frame, delta.n, 4);
+    put_le(frame + 4, bytes, 4);
+    put_le(frame + 8, crc32(0, delta.block, bytes), 4);
+    fwrite(frame, 1, sizeof(frame), delta.file);
+    fwrite(delta.block, 1, bytes, delta.file);
+    memset(delta.block, 0, bytes);
+    delta.bits = 0;
+    delta.n = 0;
+}
+
+static void
+add_delta_board(const grid_t grid)
+{
+    uint8_t digits[BOARD_SIZE];
+    int same = 0;
+
+    for (int j = 0; j < BOARD_SIZE; j++)
+        digits[j] = get_bit_index(grid[j]);
+    if (delta.n)
+        while (same < BOARD_SIZE && digits[same] == delta.prev[same])
+            same++;
+    put_bits(delta.block, &delta.bits, same, DELTA_PREFIX_BITS);
+    for (int j = same; j < BOARD_SIZE; j++)
+        put_bits(delta.block, &delta.bits, digits[j], DELTA_DIGIT_BITS);
+    memcpy(delta.prev, digits, sizeof(digits));
+    delta.count++;
+    if (++delta.n == DELTA_BLOCK_BOARDS)
+        end_delta_block();
+}
+
+/*
+  Reads the frames of f from its first block until the blocks hold at
+  least stop boards or there are no more whole ones, indexing them. Returns
+  where the last of them ends, and the number of boards in *count.
+*/
+
+static off_t
+scan_delta_blocks(FILE *f, uint64_t stop, uint64_t *count)
+{
+    uint8_t frame[DELTA_FRAME_SIZE];
+    off_t offset = strlen(DELTA_MAGIC), size;
+
+    fseeko(f, 0, SEEK_END);
+    size = ftello(f);
+    *count = 0;
+    while (*count < stop && fseeko(f, offset, SEEK_SET) == 0 &&
+           fread(frame, 1, sizeof(frame), f) == sizeof(frame) &&
+           get_le(frame, 4) <= DELTA_BLOCK_BOARDS &&
+           offset + DELTA_FRAME_SIZE + get_le(frame + 4, 4) <= size) {
+        add_to_delta_index(offset, *count);
+        *count += get_le(frame, 4);
+        offset += DELTA_FRAME_SIZE + get_le(frame + 4, 4);
+    }
+    return offset;
+}
+
+/*
+  Starts writing delta.path, or carries on after the first resume boards
+  of it when a run is resumed from a checkpoint (which ends a block).
+*/
+
+static void
+open_delta(uint64_t resume)
+{
+    char magic[sizeof(DELTA_MAGIC)] = "";
+    off_t end;
+
+    delta.file = fopen(delta.path, resume ? "r+b" : "wb");
+    if (delta.file == NULL) {
+        perror(delta.path);
+        exit(EXIT_FAILURE);
+    }
+    delta.n_blocks = delta.count = delta.n = delta.bits = 0;
+    if (resume == 0) {
+        fwrite(DELTA_MAGIC, 1, strlen(DELTA_MAGIC), delta.file);
+    } else if (fread(magic, 1, strlen(DELTA_MAGIC), delta.file) !=
+               strlen(DELTA_MAGIC) || strcmp(magic, DELTA_MAGIC) ||
+               (end = scan_delta_blocks(delta.file, resume, &delta.count),
+                delta.count != resume) ||
+               ftruncate(fileno(delta.file), end) < 0) {
+        fprintf(stderr, "%s doesn't hold the %llu boards of the checkpoint\n",
+                delta.path, (unsigned long long) resume);
+        exit(EXIT_FAILURE);
+    } else {
+        fseeko(delta.file, end, SEEK_SET);
+    }
+    delta.block = calloc(1, DELTA_BLOCK_BYTES + 1);
+}
+
+/*
+  Writes the last block, the index and the trailer.
+*/
+
+static void
+close_delta()
+{
+    uint8_t entry[16], trailer[DELTA_TRAILER_SIZE];
+
+    end_delta_block();
+    put_le(trailer, ftello(delta.file), 8);
+    for (uint64_t b = 0; b < delta.n_blocks; b++) {
+        put_le(entry, delta.index[b].offset, 8);
+        put_le(entry + 8, delta.index[b].first, 8);
+        fwrite(entry, 1, sizeof(entry), delta.file);
+    }
+    put_le(trailer + 8, delta.n_blocks, 8);
+    put_le(trailer + 16, delta.count, 8);
+    memcpy(trailer + 24, DELTA_INDEX_MAGIC, 8);
+    fwrite(trailer, 1, sizeof(trailer), delta.file);
+    if (ferror(delta.file) | fclose(delta.file)) {
+        perror(delta.path);
+        exit(EXIT_FAILURE);
+    }
+    free(delta.block);
+    delta.file = NULL;
+}
+
+/*
+  Reads the boards of a --delta file from number skip on, up to max of
+  them, into boards or, if that is NULL, printing them one per line. The
+  block holding board skip is found through the index, or, for a file
+  whose run never finished, by reading the frames. Returns the number of
+  boards read.
+*/
+
+uint64_t
+decode_delta(const char *path, uint64_t skip, uint64_t max, grid_t *boards)
+{
+    uint8_t trailer[DELTA_TRAILER_SIZE], frame[DELTA_FRAME_SIZE], *block;
+    uint8_t digits[BOARD_SIZE], entry[16];
+    char magic[sizeof(DELTA_MAGIC)] = "", line[BOARD_SIZE + 1];
+    uint64_t count, first, pos, n_read = 0, b = 0;
+    uint32_t n, bytes, same;
+    off_t end;
+    FILE *f = fopen(path, "rb");
+
+    if (f == NULL || fread(magic, 1, strlen(DELTA_MAGIC), f) !=
+        strlen(DELTA_MAGIC) || strcmp(magic, DELTA_MAGIC)) {
+        fprintf(stderr, "%s isn't a --delta file\n", path);
+        exit(EXIT_FAILURE);
+    }
+    delta.n_blocks = 0;
+    if (fseeko(f, -DELTA_TRAILER_SIZE, SEEK_END) == 0 &&
+        fread(trailer, 1, sizeof(trailer), f) == sizeof(trailer) &&
+        memcmp(trailer + 24, DELTA_INDEX_MAGIC, 8) == 0) {
+        end = get_le(trailer, 8);
+        fseeko(f, end, SEEK_SET);
+        for (uint64_t i = 0; i < get_le(trailer + 8, 8) &&
+                 fread(entry, 1, sizeof(entry), f) == sizeof(entry); i++)
+            add_to_delta_index(get_le(entry, 8), get_le(entry + 8, 8));
+    } else {
+        printf_c(OPTIONAL, "%s has no index, reading its blocks\n", path);
+        end = scan_delta_blocks(f, UINT64_MAX, &count);
+    }
+    while (b + 1 < delta.n_blocks && delta.index[b + 1].first <= skip)
+        b++;
+
+    block = calloc(1, DELTA_BLOCK_BYTES + 1);
+    line[BOARD_SIZE] = '\n';
+    for (; b < delta.n_blocks && n_read < max; b++) {
+        first = delta.index[b].first;
+        if (fseeko(f, delta.index[b].offset, SEEK_SET) ||
+            fread(frame, 1, sizeof(frame), f) != sizeof(frame) ||
+            (n = get_le(frame, 4)) > DELTA_BLOCK_BOARDS ||
+            (bytes = get_le(frame + 4, 4)) > DELTA_BLOCK_BYTES ||
+            delta.index[b].offset + DELTA_FRAME_SIZE + bytes > end ||
+            fread(block, 1, bytes, f) != bytes ||
+            crc32(0, block, bytes) != get_le(frame + 8, 4))
+            goto corrupt;
+        memset(block + bytes, 0, 1);
+        pos = 0;
+        for (uint32_t k = 0; k < n && n_read < max; k++) {
+            same = get_bits(block, &pos, DELTA_PREFIX_BITS);
+            if (same > BOARD_SIZE || (k == 0 && same))
+                goto corrupt;
+            for (int j = same; j < BOARD_SIZE; j++)
+                if ((digits[j] = get_bits(block, &pos,
+                                          DELTA_DIGIT_BITS)) >= BLOCK_SIZE)
+                    goto corrupt;
+            if (pos > 8 * (uint64_t) bytes)
+                goto corrupt;
+            if (first + k < skip)
+                continue;
+            for (int j = 0; j < BOARD_SIZE; j++) {
+                if (boards)
+                    boards[n_read][j] = masks[digits[j]];
+                else
+                    line[j] = '1' + digits[j];
+            }
+            if (boards == NULL)
+                fwrite(line, 1, sizeof(line), stdout);
+            n_read++;
+        }
+    }
+    free(block);
+    fclose(f);
+    return n_read;
+
+corrupt:
+    fprintf(stderr, "%s: block %llu is corrupt\n", path,
+            (unsigned long long) b);
+    exit(EXIT_FAILURE);
+}
+
+void
+process_arg_for_decoding(const char *path)
+{
+    decode_delta(path, decode_skip, UINT64_MAX, NULL);
+}
+
+
+//////////// Enumerating functions
+
+/*
+  Ordered enumeration of every completed board that can be made from the
+  default puzzle (see --generate), pulled from next_solution. Every board
+  has a path: the digits chosen at each branch of the search, which always
+  branches on the first cell with more than one option and tries its digits
+  in order. Boards come out in the order of their paths, so a range of
+  paths [from, to) is a shard of the enumeration and the path of the last
+  board written is enough to resume.
+*/
+
+/*
+  Writes the checkpoint file: the path of the last board written and how
+  many have been written. It's written to a temporary file which is then
+  renamed, so a run stopped at any moment leaves a usable checkpoint.
+*/
+
+static void
+write_checkpoint(struct enumeration_s *e, bool done)
+{
+    char tmp[PATH_MAX];
+    FILE *f;
+
+    fflush(stdout);
+    if (delta.file) {
+        end_delta_block();
+        fflush(delta.file);
+    }
+    snprintf(tmp, sizeof(tmp), "%s.tmp", e->checkpoint);
+    if ( (f = fopen(tmp, "w")) == NULL) {
+        perror(tmp);
+        return;
+    }
+    fprintf(f, "after=%s\ncount=%llu\ndone=%d\n", e->after,
+            (unsigned long long) e->count, done);
+    fclose(f);
+    rename(tmp, e->checkpoint);
+    e->last_checkpoint = time(NULL);
+}
+
+/*
+  Reads a checkpoint written by an earlier run. Returns false if there is
+  none.
+*/
+
+static bool
+read_checkpoint(struct enumeration_s *e, bool *done)
+{
+    FILE *f = fopen(e->checkpoint, "r");
+    unsigned long long count;
+    int d;
+
+    if (f == NULL)
+        return false;
+    if (fscanf(f, "after=%81[1-9]", e->after) != 1)
+        e->after[0] = 0;
+    if (fscanf(f, "\ncount=%llu\ndone=%d", &count, &d) != 2) {
+        fprintf(stderr, "Can't read checkpoint %s\n", e->checkpoint);
+        exit(EXIT_FAILURE);
+    }
+    fclose(f);
+    e->count = count;
+    *done = d;
+    return true;
+}
+
+static void
+emit_grid(struct enumeration_s *e, const grid_t grid, const char *path)
+{
+    e->count++;
+    if (delta.file) {
+        add_delta_board(grid);
+    } else if (records.data) {
+        write_record(e->count - 1, grid, STATUS_UNIQUE);
+    } else {
+        printf("%llu,", (unsigned long long) (e->limit - e->count));
+        print_grid_as_str(grid);
+    }
+    strcpy(e->after, path);
+    if (e->checkpoint && (e->count & 1023) == 0 &&
+        time(NULL) - e->last_checkpoint >= CHECKPOINT_SECONDS)
+        write_checkpoint(e, false);
+}
+
+/*
+  Enumerates up to limit completed boards from board, in order, with paths
+  in [from, to). An empty from or to means the start or the end. With a
+  checkpoint file an interrupted run carries on from where it stopped.
+  Returns the number of boards written, counting those of earlier runs.
+*/
+
+uint64_t
+enumerate_grids(struct board_s board, uint64_t limit, const char *from,
+                const char *to, const char *checkpoint)
+{
+    struct solution_iter_s *it;
+    struct enumeration_s e;
+    bool done = false, exclusive = false;
+    grid_t grid;
+
+    memset(&e, 0, sizeof(e));
+    e.limit = limit;
+    e.checkpoint = checkpoint;
+    if (checkpoint && read_checkpoint(&e, &done)) {
+        if (done || e.count >= limit)
+            return e.count;
+        from = e.after;
+        exclusive = true;
+    }
+    e.last_checkpoint = time(NULL);
+    if (delta.path)
+        open_delta(e.count);
+    it = malloc(sizeof(*it));
+    start_solutions(it, &board, from, exclusive, to);
+    while (e.count < e.limit && next_solution(it, grid))
+        emit_grid(&e, grid, it->path);
+    free(it);
+    if (delta.path)
+        close_delta();
+    if (checkpoint)
+        write_checkpoint(&e, e.count < e.limit);
+    return e.count;
+}
+
+
+/*
+  Wrapper function for generating as many complete Sudoku boards as possible.
+*/
+
+void
+process_arg_for_generating(int num_solutions,
+                           int max_depth)
+{
+    uint32_t *g;
+    char *c;
+    grid_t grid;
+
+    struct board_s board;
+    uint64_t n;
+
+    for (c = default_puzzle, g = grid; *c; c++, g++)
+        *g = (uint32_t) (*c - '0');
+
+    board = convert_to_bitboard(grid);
+    if (records.path && delta.path == NULL)
+        open_records(num_solutions);
+    n = enumerate_grids(board, num_solutions, enumerate_from, enumerate_to,
+                        checkpoint_path);
+    if (records.path && delta.path == NULL)
+        close_records(n);
+}
+
+
+/*
+  Process the make easy puzzle command line argument. Note the puzzle may not be
+  easy at all. But in general should be easier than the default puzzle creation
+  algorithm. max_cells specifies the maximum number of cells that may be filled
+  in.
+*/
+
+void
+process_arg_for_easy(int symmetry, bool minimal, int max_cells)
+{
+    struct board_s board;
+    struct limits_s l;
+    uint64_t start;
+
+    start_limits(&l, timeout_ms, max_nodes, NULL);
+    start = monotonic_ns();
+    board = make_easy_puzzle(symmetry, max_cells);
+    if (minimal && board.timed_out == false)
+        make_minimal(&board, symmetry, get_num_threads());
+    end_limits();
+    count_operation(OP_EASY, start, board.timed_out ? STATUS_TIMED_OUT :
+                    STATUS_UNIQUE);
+    if (board.timed_out)
+        printf_c(ESSENTIAL, "Ran out of time after %llu steps.\n",
+                 (unsigned long long) l.nodes);
+    else
+        print_grid_as_str(board.grid);
+}
+
+
+
+//////////// Estimating functions
+
+/*
+  Knuth's estimate of the size of a search tree: walks down one random path,
+  picking a random option in the cell with the fewest options each time.
+  The product of the number of options along the way is an unbiased estimate
+  of the number of completed boards below the starting board. A dead end
+  counts as zero. Returns false for a dead end, otherwise sets log_choices to
+  the log of the estimate (so it can't overflow).
+*/
+
+static bool
+random_descent(struct board_s b, double *log_choices)
+{
+    int min_index, min_bits, bits;
+
+    *log_choices = 0.0;
+    while (1) {
+        fill(&b);
+        check_bitboard(&b);
+        if (b.valid == false)
+            return false;
+        if (b.complete)
+            return true;
+
+        min_index = 0;
+        min_bits = BLOCK_SIZE + 1;
+        for (int i = 0; i < BOARD_SIZE; i++) {
+            bits = count_bits(b.grid[i]);
+            if (bits > 1 && bits < min_bits) {
+                min_index = i;
+                min_bits = bits;
+            }
+        }
+        b.grid[min_index] = masks[get_nth_set_bit(b.grid[min_index],
+                                                  random_below(min_bits))];
+        *log_choices += log(min_bits);
+    }
+}
+
+/*
+  Adds one estimate to a running mean and variance (Welford's algorithm).
+*/
+
+static void
+add_estimate(struct estimate_s *e, long double x)
+{
+    long double delta = x - e->mean;
+
+    e->n++;
+    e->mean += delta / e->n;
+    e->m2 += delta * (x - e->mean);
+}
+
+/*
+  Merges the running mean and variance of b into a (Chan et al.).
+*/
+
+static void
+merge_estimates(struct estimate_s *a, const struct estimate_s *b)
+{
+    long double delta = b->mean - a->mean;
+    uint64_t n = a->n + b->n;
+
+    if (b->n == 0)
+        return;
+    a->m2 += b->m2 + delta * delta * a->n * b->n / n;
+    a->mean += delta * b->n / n;
+    a->n = n;
+}
+
+/* Shared by the threads running random descents */
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    struct estimate_s total;
+    struct board_s board; // Where each descent starts
+    uint64_t descents; // Total number to run
+    int threads;
+    int running;
+} estimation = {
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER
+};
+
+/*
+  Runs this thread's share of the descents, merging its results into the
+  total every ESTIMATE_BATCH descents.
+*/
+
+static void *
+run_descents(void *arg)
+{
+    long id = (long) arg;
+    struct estimate_s local = {0};
+    double log_choices;
+    uint64_t n = estimation.descents / estimation.threads +
+        ((uint64_t) id < estimation.descents % estimation.threads);
+
+    seed_thread_rng(id + 1);
+    for (uint64_t i = 0; i < n; i++) {
+        if (random_descent(estimation.board, &log_choices))
+            add_estimate(&local, expl(log_choices));
+        else
+            add_estimate(&local, 0.0L);
+        if (local.n == ESTIMATE_BATCH || i == n - 1) {
+            pthread_mutex_lock(&estimation.lock);
+            merge_estimates(&estimation.total, &local);
+            pthread_mutex_unlock(&estimation.lock);
+            memset(&local, 0, sizeof(local));
+        }
+    }
+    pthread_mutex_lock(&estimation.lock);
+    estimation.running--;
+    pthread_cond_signal(&estimation.done);
+    pthread_mutex_unlock(&estimation.lock);
+    return NULL;
+}
+
+/*
+  Prints the number of descents so far, the mean, the variance and a 95%
+  confidence interval for the number of completed boards.
+*/
+
+static void
+print_estimate(const struct estimate_s *e)
+{
+    long double variance = (e->n > 1) ? e->m2 / (e->n - 1) : 0.0L;
+    long double half_width = 1.96L * sqrtl(variance / e->n);
+
+    printf_c(ESSENTIAL, "%llu,%.6Le,%.6Le,%.6Le,%.6Le\n",
+             (unsigned long long) e->n, e->mean, variance,
+             e->mean - half_width, e->mean + half_width);
+    fflush(stdout);
+}
+
+/*
+  Estimates the number of completed boards that can be made from the default
+  puzzle by running n random descents on all cores. Prints the estimate
+  every second while it runs.
+*/
+
+void
+process_arg_for_estimating(uint64_t n)
+{
+    uint32_t *g;
+    char *c;
+    grid_t grid;
+    pthread_t *threads;
+    struct timespec t;
+    uint64_t printed = 0;
+
+    for (c = default_puzzle, g = grid; *c; c++, g++)
+        *g = (uint32_t) (*c - '0');
+    estimation.board = convert_to_bitboard(grid);
+    estimation.descents = n;
+    estimation.threads = get_num_threads();
+    estimation.running = estimation.threads;
+    memset(&estimation.total, 0, sizeof(estimation.total));
+
+    printf_c(OPTIONAL, "descents,mean,variance,lower 95%%,upper 95%%\n");
+    threads = malloc(estimation.threads * sizeof(pthread_t));
+    for (long i = 0; i < estimation.threads; i++)
+        pthread_create(&threads[i], NULL, run_descents, (void *) i);
+
+    pthread_mutex_lock(&estimation.lock);
+    while (estimation.running > 0) {
+        clock_gettime(CLOCK_REALTIME, &t);
+        t.tv_sec++;
+        pthread_cond_timedwait(&estimation.done, &estimation.lock, &t);
+        if (estimation.total.n > printed && estimation.running > 0) {
+            print_estimate(&estimation.total);
+            printed = estimation.total.n;
+        }
+    }
+    print_estimate(&estimation.total);
+    pthread_mutex_unlock(&estimation.lock);
+
+    for (int i = 0; i < estimation.threads; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+}
+
+
+/*
+  Estimates the number of completed boards below a board from PLAN_SAMPLES
+  random descents.
+*/
+
+static long double
+sample_size(const struct board_s *board)
+{
+    long double total = 0.0L;
+    double log_choices;
+
+    for (int i = 0; i < PLAN_SAMPLES; i++)
+        if (random_descent(*board, &log_choices))
+            total += expl(log_choices);
+    return total / PLAN_SAMPLES;
+}
+
+/*
+  Replaces node i of the plan by its children in the enumeration tree (see
+  enumerate), keeping the nodes in enumeration order. Returns false if the
+  node has no children.
+*/
+
+static bool
+expand_plan_node(struct plan_node_s **nodes, int *n, int *size, int i)
+{
+    struct board_s board = (*nodes)[i].board;
+    struct plan_node_s *children;
+    int cell, len = strlen((*nodes)[i].path), n_children = 0;
+
+    fill(&board);
+    check_bitboard(&board);
+    if (board.valid == false || board.complete)
+        return false;
+    for (cell = 0; count_bits(board.grid[cell]) < 2; cell++)
+        ;
+
+    children = malloc(BLOCK_SIZE * sizeof(struct plan_node_s));
+    for (int j = 0; j < BLOCK_SIZE; j++) {
+        if ((masks[j] & board.grid[cell]) == 0)
+            continue;
+        struct plan_node_s *child = &children[n_children++];
+        memcpy(child->path, (*nodes)[i].path, len);
+        child->path[len] = '1' + j;
+        child->path[len + 1] = 0;
+        child->board = board;
+        child->board.grid[cell] = masks[j];
+        child->estimate = sample_size(&child->board);
+        child->expandable = true;
+    }
+
+    if (*n + n_children > *size) {
+        *size = 2 * (*n + n_children);
+        *nodes = realloc(*nodes, *size * sizeof(struct plan_node_s));
+    }
+    memmove(&(*nodes)[i + n_children], &(*nodes)[i + 1],
+            (*n - i - 1) * sizeof(struct plan_node_s));
+    memcpy(&(*nodes)[i], children, n_children * sizeof(struct plan_node_s));
+    *n += n_children - 1;
+    free(children);
+    return true;
+}
+
+/*
+  Splits the enumeration of the default puzzle into shards of roughly equal
+  size, for running --generate with --from and --to on many machines. The
+  enumeration tree is expanded, largest estimated subtree first, until there
+  are PLAN_NODES_PER_SHARD subtrees per shard, and consecutive subtrees are
+  then grouped so each shard gets about the same estimated number of boards.
+  Prints one line per shard: number, from, to, estimated number of boards.
+*/
+
+void
+process_arg_for_planning(int shards)
+{
+    struct plan_node_s *nodes;
+    int n = 1, size = 1, largest, shard = 0;
+    long double total = 0.0L, sum = 0.0L, shard_sum = 0.0L;
+    const char *from = "";
+    uint32_t *g;
+    char *c;
+    grid_t grid;
+
+    if (shards < 1) {
+        fprintf(stderr, "Need at least one shard\n");
+        exit(EXIT_FAILURE);
+    }
+    for (c = default_puzzle, g = grid; *c; c++, g++)
+        *g = (uint32_t) (*c - '0');
+    nodes = malloc(sizeof(struct plan_node_s));
+    nodes[0].path[0] = 0;
+    nodes[0].board = convert_to_bitboard(grid);
+    nodes[0].estimate = sample_size(&nodes[0].board);
+    nodes[0].expandable = true;
+
+    while (n < PLAN_NODES_PER_SHARD * shards) {
+        largest = -1;
+        for (int i = 0; i < n; i++)
+            if (nodes[i].expandable && (largest < 0 ||
+                                        nodes[i].estimate > nodes[largest].estimate))
+                largest = i;
+        if (largest < 0)
+            break;
+        if (expand_plan_node(&nodes, &n, &size, largest) == false)
+            nodes[largest].expandable = false;
+    }
+
+    for (int i = 0; i < n; i++)
+        total += nodes[i].estimate;
+    printf_c(OPTIONAL, "shard,from,to,estimated boards\n");
+    for (int i = 0; i < n; i++) {
+        sum += nodes[i].estimate;
+        shard_sum += nodes[i].estimate;
+        if (i + 1 < n && shard < shards - 1 &&
+            sum >= total * (shard + 1) / shards) {
+            printf_c(ESSENTIAL, "%d,%s,%s,%.3Le\n", shard, from,
+                     nodes[i + 1].path, shard_sum);
+            from = nodes[i + 1].path;
+            shard_sum = 0.0L;
+            shard++;
+        }
+    }
+    printf_c(ESSENTIAL, "%d,%s,,%.3Le\n", shard, from, shard_sum);
+    free(nodes);
+}
+
+
+//////////// Counting functions
+
+/*
+  Counts the completions of a board by enumerating them without printing.
+*/
+
+static uint64_t
+count_completions(struct board_s board)
+{
+    struct solution_iter_s *it = malloc(sizeof(*it));
+    uint64_t n = 0;
+    grid_t grid;
+
+    start_solutions(it, &board, "", false, "");
+    while (next_solution(it, grid))
+        n++;
+    free(it);
+    return n;
+}
+
+/*
+  Writes a 128 bit count in decimal. s needs room for 40 digits.
+*/
+
+static char *
+count_to_str(unsigned __int128 n, char *s)
+{
+    char digits[40];
+    int len = 0;
+
+    do {
+        digits[len++] = '0' + (int) (n % 10);
+        n /= 10;
+    } while (n);
+    for (int i = 0; i < len; i++)
+        s[i] = digits[len - 1 - i];
+    s[len] = 0;
+    return s;
+}
+
+/*
+  Moves the cells of a band by a symmetry, then relabels the free digits in
+  order of first appearance, the same way fill_band writes them.
+*/
+
+static void
+transform_band(const struct band_counting_s *c, const uint8_t *symmetry,
+               const uint8_t *band, uint8_t *result)
+{
+    uint8_t relabel[BLOCK_SIZE + 1] = {0};
+    int next = 0;
+
+    for (int i = 0; i < BAND_SIZE; i++)
+        result[symmetry[i]] = band[i];
+    for (int i = 0; i < BAND_SIZE; i++) {
+        if (c->free[result[i]] == false)
+            continue;
+        if (relabel[result[i]] == 0)
+            relabel[result[i]] = c->free_digits[next++];
+        result[i] = relabel[result[i]];
+    }
+}
+
+/*
+  Keeps a band if it is the smallest of its class, along with the size of
+  the class: the number of symmetries over the number that leave it alone,
+  times the number of ways to relabel the free digits.
+*/
+
+static void
+add_band(struct band_counting_s *c, const uint8_t *band)
+{
+    uint8_t image[BAND_SIZE];
+    int fixed = 0, cmp;
+
+    for (int i = 0; i < c->n_symmetries; i++) {
+        transform_band(c, c->symmetries[i], band, image);
+        cmp = memcmp(image, band, BAND_SIZE);
+        if (cmp < 0)
+            return;
+        fixed += (cmp == 0);
+    }
+    if (c->n_classes == c->size) {
+        c->size = c->size ? 2 * c->size : 1024;
+        c->classes = realloc(c->classes, c->size * sizeof(*c->classes));
+    }
+    memcpy(c->classes[c->n_classes].band, band, BAND_SIZE);
+    c->classes[c->n_classes].weight =
+        (unsigned __int128) c->relabellings * (c->n_symmetries / fixed);
+    c->n_classes++;
+}
+
+/*
+  Writes every first band that fits the clues, cell by cell. A free digit
+  may only be used once the free digits before it have been, so only one
+  band is written out of all the ways of relabelling them.
+*/
+
+static void
+fill_band(struct band_counting_s *c, uint8_t *band, int i, int used_free,
+          uint32_t *row_used, uint32_t *box_used, uint32_t *col_used)
+{
+    int row = i / BLOCK_SIZE, col = i % BLOCK_SIZE;
+    int box = col / MINI_BLOCK_SIZE, next_free;
+    uint32_t allowed, bit;
+
+    if (i == BAND_SIZE) {
+        add_band(c, band);
+        return;
+    }
+    allowed = ~(row_used[row] | box_used[box] | col_used[col]);
+    if (c->puzzle[i])
+        allowed &= set_only_bit(c->puzzle[i] - 1);
+    else
+        allowed &= ~(c->row_clues[row] | c->box_clues[box] | c->col_clues[col]);
+
+    for (int d = 1; d <= BLOCK_SIZE; d++) {
+        bit = set_only_bit(d - 1);
+        if ((allowed & bit) == 0)
+            continue;
+        next_free = used_free;
+        if (c->free[d]) {
+            if (d > c->free_digits[used_free])
+                continue;
+            if (d == c->free_digits[used_free])
+                next_free++;
+        }
+        band[i] = d;
+        row_used[row] |= bit;
+        box_used[box] |= bit;
+        col_used[col] |= bit;
+        fill_band(c, band, i + 1, next_free, row_used, box_used, col_used);
+        row_used[row] &= ~bit;
+        box_used[box] &= ~bit;
+        col_used[col] &= ~bit;
+    }
+}
+
+/*
+  Finds the symmetries that map the clues onto themselves, out of all the
+  orders of the rows of the first band, of the stacks and of the columns in
+  each stack. Each is stored as where it moves the cells of the band.
+*/
+
+static void
+find_band_symmetries(struct band_counting_s *c)
+{
+    static const uint8_t orders[6][MINI_BLOCK_SIZE] = {
+        {0, 1, 2}, {0, 2, 1}, {1, 0, 2}, {1, 2, 0}, {2, 0, 1}, {2, 1, 0}
+    };
+    uint8_t to_col[BLOCK_SIZE], *symmetry;
+    int in_stack[MINI_BLOCK_SIZE], moved, stack;
+    bool fixes;
+
+    c->n_symmetries = 0;
+    for (int n = 0; n < BAND_SYMMETRIES; n++) {
+        int rows = n % 6, stacks = n / 6 % 6;
+        for (int s = 0, k = n / 36; s < MINI_BLOCK_SIZE; s++, k /= 6)
+            in_stack[s] = k % 6;
+        for (int j = 0; j < BLOCK_SIZE; j++) {
+            stack = j / MINI_BLOCK_SIZE;
+            to_col[j] = MINI_BLOCK_SIZE * orders[stacks][stack] +
+                orders[in_stack[stack]][j % MINI_BLOCK_SIZE];
+        }
+        symmetry = c->symmetries[c->n_symmetries];
+        for (int i = 0; i < BAND_SIZE; i++)
+            symmetry[i] = BLOCK_SIZE * orders[rows][i / BLOCK_SIZE] +
+                to_col[i % BLOCK_SIZE];
+        fixes = true;
+        for (int i = 0; i < BOARD_SIZE && fixes; i++) {
+            moved = (i < BAND_SIZE) ? symmetry[i] :
+                i - i % BLOCK_SIZE + to_col[i % BLOCK_SIZE];
+            fixes = (c->puzzle[moved] == c->puzzle[i]);
+        }
+        if (fixes)
+            c->n_symmetries++;
+    }
+}
+
+/* Shared by the threads counting the completions of the classes */
+static struct {
+    struct band_counting_s *c;
+    int next; // Next class to count
+    pthread_mutex_t lock;
+    unsigned __int128 total;
+} band_counting = { NULL, 0, PTHREAD_MUTEX_INITIALIZER, 0 };
+
+static void *
+count_classes(void *arg)
+{
+    struct band_counting_s *c = band_counting.c;
+    unsigned __int128 total = 0;
+    grid_t grid;
+    int i;
+
+    (void) arg;
+    while ((i = __atomic_fetch_add(&band_counting.next, 1,
+                                   __ATOMIC_RELAXED)) < c->n_classes) {
+        memcpy(grid, c->puzzle, sizeof(grid));
+        for (int j = 0; j < BAND_SIZE; j++)
+            grid[j] = c->classes[i].band[j];
+        total += c->classes[i].weight *
+            count_completions(convert_to_bitboard(grid));
+    }
+    pthread_mutex_lock(&band_counting.lock);
+    band_counting.total += total;
+    pthread_mutex_unlock(&band_counting.lock);
+    return NULL;
+}
+
+/*
+  Counts the completions of a puzzle the way all Sudoku grids were first
+  counted. Every completion has a first band (its top three rows). Bands
+  that a symmetry of the clues maps onto each other have the same number of
+  completions, so only the smallest band of each class has its completions
+  counted, and the count is multiplied by the size of the class. The
+  symmetries are relabelling the digits that aren't clues, and reordering
+  the rows of the band, the stacks and the columns of each stack when that
+  leaves the clues where they were. n_classes is set to the number of
+  classes counted.
+*/
+
+unsigned __int128
+count_with_symmetry(const grid_t puzzle, int *n_classes)
+{
+    struct band_counting_s *c = calloc(1, sizeof(*c));
+    uint32_t row_used[MINI_BLOCK_SIZE] = {0}, box_used[MINI_BLOCK_SIZE] = {0};
+    uint32_t col_used[BLOCK_SIZE] = {0}, bit;
+    uint8_t band[BAND_SIZE];
+    int n_free = 0, n = get_num_threads();
+    pthread_t *threads;
+
+    memcpy(c->puzzle, puzzle, sizeof(c->puzzle));
+    for (int d = 1; d <= BLOCK_SIZE; d++)
+        c->free[d] = true;
+    for (int i = 0; i < BOARD_SIZE; i++) {
+        if (puzzle[i] == 0)
+            continue;
+        c->free[puzzle[i]] = false;
+        bit = set_only_bit(puzzle[i] - 1);
+        if (i < BAND_SIZE) {
+            c->row_clues[i / BLOCK_SIZE] |= bit;
+            c->box_clues[i % BLOCK_SIZE / MINI_BLOCK_SIZE] |= bit;
+        } else {
+            c->col_clues[i % BLOCK_SIZE] |= bit;
+        }
+    }
+    c->relabellings = 1;
+    for (int d = 1; d <= BLOCK_SIZE; d++)
+        if (c->free[d]) {
+            c->free_digits[n_free++] = d;
+            c->relabellings *= n_free;
+        }
+    c->free_digits[n_free] = BLOCK_SIZE + 1;
+
+    find_band_symmetries(c);
+    fill_band(c, band, 0, 0, row_used, box_used, col_used);
+    printf_c(OPTIONAL, "%d symmetries, %d classes of first bands\n",
+             c->n_symmetries, c->n_classes);
+
+    band_counting.c = c;
+    band_counting.next = 0;
+    band_counting.total = 0;
+    threads = malloc(n * sizeof(pthread_t));
+    for (int i = 0; i < n; i++)
+        pthread_create(&threads[i], NULL, count_classes, NULL);
+    for (int i = 0; i < n; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+
+    *n_classes = c->n_classes;
+    free(c->classes);
+    free(c);
+    return band_counting.total;
+}
+
+/*
+  Wrapper function for counting the completions of the default puzzle.
+*/
+
+void
+process_arg_for_counting()
+{
+    char s[40];
+    grid_t grid;
+    int n_classes;
+
+    if (variant) {
+        fprintf(stderr, "--count only knows the symmetries of classic "
+                "Sudoku\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < BOARD_SIZE; i++)
+        grid[i] = (uint32_t) (default_puzzle[i] - '0');
+    printf_c(ESSENTIAL, "%s\n",
+             count_to_str(count_with_symmetry(grid, &n_classes), s));
+}
+
+
+//////////// Lane functions
+
+/*
+  Solves BATCH_LANES puzzles at once with the vector units: lanes_s holds
+  cell c of every puzzle in cells[c], one puzzle per lane, and the rules of
+  fill are applied to all lanes with the same instructions. Only the easy
+  puzzles that the rules finish need nothing else. The rest drop out to
+  solve.
+*/
+
+static bool
+any_lane(const lanes_t *v)
+{
+    for (int i = 0; i < BATCH_LANES; i++)
+        if ((*v)[i])
+            return true;
+    return false;
+}
+
+/*
+  Applies the rules of fill to every lane until no lane changes: a cell
+  with one option takes it from its peers (naked singles) and an option
+  that fits in only one cell of a unit is set there (hidden singles).
+  Then marks the lanes that are solved and the ones that are invalid: with
+  a cell without options, a value twice in a unit or a value that fits
+  nowhere in one.
+*/
+
+static void
+propagate_lanes(struct lanes_s *b, lanes_t *solved, lanes_t *invalid)
+{
+    const size_t (*units[3])[BLOCK_SIZE] = {rows, squares, cols};
+    const lanes_t all = (lanes_t) {} + FULL_MASK, zero = (lanes_t) {};
+    lanes_t singles[BOARD_SIZE], changed, x, taken, once, twice, hit;
+
+    do {
+        changed = zero;
+        for (int c = 0; c < BOARD_SIZE; c++) {
+            x = b->cells[c];
+            singles[c] = x & (lanes_t) ((x & (x - 1)) == 0);
+        }
+        for (int c = 0; c < BOARD_SIZE; c++) {
+            taken = zero;
+            for (int p = 0; p < NUM_PEERS; p++)
+                taken |= singles[peers[c][p]];
+            x = b->cells[c];
+            x &= ~(taken & ~(lanes_t) (singles[c] != 0));
+            changed |= x ^ b->cells[c];
+            b->cells[c] = x;
+        }
+        for (int u = 0; u < 3; u++) {
+            for (int i = 0; i < BLOCK_SIZE; i++) {
+                once = twice = zero;
+                for (int j = 0; j < BLOCK_SIZE; j++) {
+                    x = b->cells[units[u][i][j]];
+                    twice |= once & x;
+                    once |= x;
+                }
+                for (int j = 0; j < BLOCK_SIZE; j++) {
+                    x = b->cells[units[u][i][j]];
+                    hit = x & once & ~twice;
+                    hit = (hit & (lanes_t) (hit != 0)) |
+                        (x & (lanes_t) (hit == 0));
+                    changed |= hit ^ x;
+                    b->cells[units[u][i][j]] = hit;
+                }
+            }
+        }
+    } while (any_lane(&changed));
+
+    *solved = ~zero;
+    *invalid = zero;
+    for (int c = 0; c < BOARD_SIZE; c++) {
+        x = b->cells[c];
+        *solved &= (lanes_t) ((x & (x - 1)) == 0);
+        *invalid |= (lanes_t) (x == 0);
+    }
+    for (int u = 0; u < 3; u++) {
+        for (int i = 0; i < BLOCK_SIZE; i++) {
+            once = twice = taken = zero;
+            for (int j = 0; j < BLOCK_SIZE; j++) {
+                x = b->cells[units[u][i][j]];
+                hit = x & (lanes_t) ((x & (x - 1)) == 0);
+                twice |= once & hit;
+                once |= hit;
+                taken |= x;
+            }
+            *invalid |= (lanes_t) (twice != 0) | (lanes_t) (taken != all);
+        }
+    }
+    *solved &= ~*invalid;
+}
+
+/*
+  Solves count (up to BATCH_LANES) puzzles from puzzles[first] on, and
+  writes their records, that of puzzles[0] being record base.
+*/
+
+static void
+solve_lanes(const grid_t *puzzles, const bool *malformed, uint64_t base,
+            uint64_t first, int count, int max_depth)
+{
+    struct lanes_s b;
+    struct board_s board;
+    struct limits_s l;
+    lanes_t solved, invalid;
+    uint32_t d;
+    grid_t grid;
+    int status;
+    uint64_t start = monotonic_ns(), shared;
+
+    pthread_once(&peers_once, find_peers);
+    for (int c = 0; c < BOARD_SIZE; c++) {
+        for (int lane = 0; lane < BATCH_LANES; lane++) {
+            d = (lane < count) ? puzzles[first + lane][c] : 0;
+            b.cells[c][lane] = d ? set_only_bit(d - 1) : FULL_MASK;
+        }
+    }
+    // The lanes only know the classic units, so variants all go to solve
+    if (variant)
+        solved = invalid = (lanes_t) {};
+    else
+        propagate_lanes(&b, &solved, &invalid);
+
+    // Each puzzle's latency is its share of the lanes and its own search
+    shared = (monotonic_ns() - start) / (count ? count : 1);
+    for (int lane = 0; lane < count; lane++) {
+        uint64_t i = first + lane;
+        start = monotonic_ns() - shared;
+        if (malformed[i] || invalid[lane]) {
+            status = STATUS_INVALID;
+            write_record(base + i, NULL, status);
+        } else if (solved[lane]) {
+            for (int c = 0; c < BOARD_SIZE; c++)
+                grid[c] = b.cells[c][lane];
+            status = STATUS_UNIQUE;
+            write_record(base + i, grid, status);
+        } else {
+            board = convert_to_bitboard(puzzles[i]);
+            start_limits(&l, timeout_ms, max_nodes, NULL);
+            solve(&board, max_depth);
+            end_limits();
+            status = result_status(&board);
+            write_record(base + i, (status == STATUS_UNIQUE ||
+                                    status == STATUS_MULTIPLE) ?
+                         board.solutions[0] : NULL, status);
+        }
+        count_operation(OP_SOLVE, start, status);
+    }
+}
+
+
+//////////// Batch functions
+
+static struct production_s production;
+
+/*
+  Worker thread. Makes records until there are none left to make.
+*/
+
+static void *
+produce_records(void *arg)
+{
+    long id = (long) arg;
+    struct board_s board;
+    struct limits_s l;
+    uint64_t i, start;
+    int step = (production.kind == 's') ? BATCH_LANES : 1;
+
+    seed_thread_rng(id + 1);
+    while ((i = __atomic_fetch_add(&production.next, step, __ATOMIC_RELAXED)) <
+           production.n) {
+        seed_record_rng(production.stream + i);
+        if (step > 1) {
+            solve_lanes(production.puzzles, production.malformed,
+                        production.base, i,
+                        (production.n - i < BATCH_LANES) ?
+                        production.n - i : BATCH_LANES, production.max_depth);
+            continue;
+        }
+        start_limits(&l, timeout_ms, max_nodes, NULL);
+        start = monotonic_ns();
+        switch (production.kind) {
+        case 'c':
+        case 'a':
+            board = (production.kind == 'a') ?
+                anneal_puzzle(production.level, production.max_depth,
+                              production.symmetry) :
+                create_puzzle(production.level, production.max_depth,
+                              production.symmetry);
+            if (production.minimal && board.timed_out == false)
+                make_minimal(&board, production.symmetry, 1);
+            write_record(production.base + i,
+                         board.timed_out ? NULL : board.grid,
+                         board.timed_out ? STATUS_TIMED_OUT : STATUS_UNIQUE);
+            count_operation(OP_CREATE, start, board.timed_out ?
+                            STATUS_TIMED_OUT : STATUS_UNIQUE);
+            break;
+        case 'e':
+            board = make_easy_puzzle(production.symmetry, production.level);
+            if (production.minimal && board.timed_out == false)
+                make_minimal(&board, production.symmetry, 1);
+            write_record(production.base + i,
+                         board.timed_out ? NULL : board.grid,
+                         board.timed_out ? STATUS_TIMED_OUT : STATUS_UNIQUE);
+            count_operation(OP_EASY, start, board.timed_out ?
+                            STATUS_TIMED_OUT : STATUS_UNIQUE);
+            break;
+        }
+        end_limits();
+    }
+    return NULL;
+}
+
+/*
+  Produces the records of production on all threads. Which thread makes
+  which record doesn't matter, so each just takes the next index. Every
+  record has a random stream of its own, and the next run carries on with
+  new ones.
+*/
+
+static void
+run_workers(void)
+{
+    int n_threads = get_num_threads();
+    pthread_t *threads = malloc(n_threads * sizeof(pthread_t));
+
+    production.next = 0;
+    for (long i = 0; i < n_threads; i++)
+        pthread_create(&threads[i], NULL, produce_records, (void *) i);
+    for (int i = 0; i < n_threads; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    production.stream += production.n;
+}
+
+/*
+  Produces n records on all threads. Standard output gets them
+  PRODUCTION_CHUNK at a time, so that they needn't all fit in memory.
+*/
+
+static void
+run_production(uint64_t n)
+{
+    uint64_t chunk = records.path ? n : PRODUCTION_CHUNK;
+
+    open_records(records.path ? n : 0);
+    for (uint64_t first = 0; first < n; first += chunk) {
+        production.base = first;
+        production.n = (n - first < chunk) ? n - first : chunk;
+        reserve_records(first + production.n);
+        run_workers();
+        flush_records(first + production.n);
+    }
+    close_records(n);
+}
+
+/*
+  Creates n puzzles (with -c if kind is 'c', --anneal if it is 'a' or -e if it
+  is 'e') as records.
+*/
+
+void
+process_arg_for_creating_many(char kind, int level, bool symmetry,
+                              bool minimal, int max_depth, uint64_t n)
+{
+    const char *error;
+
+    if ((kind == 'c' || kind == 'a') &&
+        (error = check_creating_depths(level, max_depth)) != NULL) {
+        fprintf(stderr, "%s\n", error);
+        exit(EXIT_FAILURE);
+    }
+    production.kind = kind;
+    production.level = level;
+    production.symmetry = symmetry;
+    production.minimal = minimal;
+    production.max_depth = max_depth;
+    run_production(n);
+}
+
+/* Shared by the thread reading --batch and the one solving it */
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t changed; // A block was filled or solved
+    struct input_s input;
+    struct batch_block_s *blocks; // Two of them
+} batch = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static void
+input_error(const struct input_s *in)
+{
+    fprintf(stderr, "%s: corrupt or truncated input\n", in->path);
+    exit(EXIT_FAILURE);
+}
+
+/*
+  Opens a file of puzzles, zstd if it starts with the zstd magic number,
+  otherwise gzip or plain text, which zlib tells apart by itself.
+*/
+
+static void
+open_input(struct input_s *in, const char *path)
+{
+    static const uint8_t zstd_magic[4] = {0x28, 0xb5, 0x2f, 0xfd};
+    uint8_t magic[4] = {0};
+    FILE *f = fopen(path, "rb");
+
+    if (f == NULL) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    if (fread(magic, 1, sizeof(magic), f) < sizeof(magic))
+        clearerr(f);
+    in->path = path;
+    in->gz = NULL;
+    if (memcmp(magic, zstd_magic, sizeof(magic)) == 0) {
+#ifdef HAVE_ZSTD
+        rewind(f);
+        in->file = f;
+        in->zstd = ZSTD_createDStream();
+        in->in = (ZSTD_inBuffer) {malloc(INPUT_BUFFER), 0, 0};
+        in->out = (ZSTD_outBuffer) {malloc(INPUT_BUFFER), INPUT_BUFFER, 0};
+        in->pos = in->left = 0;
+        return;
+#else
+        fprintf(stderr, "%s: zstd input needs a build with HAVE_ZSTD\n", path);
+        exit(EXIT_FAILURE);
+#endif
+    }
+    fclose(f);
+    if ((in->gz = gzopen(path, "rb")) == NULL) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    gzbuffer(in->gz, INPUT_BUFFER);
+}
+
+/*
+  Reads the next line, decompressing as much as that takes, like fgets.
+  Returns false at the end of the file.
+*/
+
+static bool
+read_line(struct input_s *in, char *line, int size)
 {
-    int n = num_solutions(board);
-    if (board->too_difficult) {
-        printf_c(ESSENTIAL, "Puzzle was too hard to solve.\n");
-    } else if (n == 1) {
-        printf_c(ESSENTIAL, "Unique solution with depth %d\n",
-                 board->depth);
-        if (verbose) {
-            print_puzzle(board->solutions[0]);
+    if (in->gz != NULL) {
+        int error = Z_OK;
+        if (gzgets(in->gz, line, size) != NULL)
+            return true;
+        gzerror(in->gz, &error);
+        if (error != Z_OK)
+            input_error(in);
+        return false;
+    }
+#ifdef HAVE_ZSTD
+    int n = 0;
+
+    while (n < size - 1 && (n == 0 || line[n - 1] != '\n')) {
+        if (in->pos == in->out.pos) {
+            in->pos = in->out.pos = 0;
+            if (in->in.pos == in->in.size) {
+                in->in.size = fread((void *) in->in.src, 1, INPUT_BUFFER,
+                                    in->file);
+                in->in.pos = 0;
+            }
+            if (in->in.size == 0 && in->left == 0)
+                break;
+            in->left = ZSTD_decompressStream(in->zstd, &in->out, &in->in);
+            if (ZSTD_isError(in->left) ||
+                (in->out.pos == 0 && in->in.size == 0))
+                input_error(in);
+            continue;
         }
-    } else if (n > 1) {
-        printf_c(ESSENTIAL, "Multiple solutions\n");
-        for (size_t j = 0; j < MAX_SOLUTIONS; j++) {
-            printf_c(ESSENTIAL, "Solution %zu\n", j);
-            print_puzzle(board->solutions[j]);
-            printf_c(ESSENTIAL, "\n");
+        line[n++] = ((char *) in->out.dst)[in->pos++];
+    }
+    line[n] = 0;
+    return n > 0;
+#else
+    return false;
+#endif
+}
+
+static void
+close_input(struct input_s *in)
+{
+    if (in->gz != NULL) {
+        gzclose(in->gz);
+        return;
+    }
+#ifdef HAVE_ZSTD
+    ZSTD_freeDStream(in->zstd);
+    free((void *) in->in.src);
+    free(in->out.dst);
+    fclose(in->file);
+#endif
+}
+
+/*
+  Reader thread of --batch. Fills the two blocks in turn, each once the
+  workers are done with it, until a block isn't full: the end of the input.
+*/
+
+static void *
+read_blocks(void *arg)
+{
+    char line[MAX_REQUEST_LINE];
+    uint64_t next = 0;
+    struct batch_block_s *block;
+    bool too_long;
+
+    for (int b = 0; ; b ^= 1) {
+        block = &batch.blocks[b];
+        pthread_mutex_lock(&batch.lock);
+        while (block->full)
+            pthread_cond_wait(&batch.changed, &batch.lock);
+        pthread_mutex_unlock(&batch.lock);
+
+        block->first = next;
+        block->n = 0;
+        while (block->n < BATCH_BLOCK &&
+               read_line(&batch.input, line, sizeof(line))) {
+            // A line that doesn't fit is one malformed record: the rest of
+            // it is skipped
+            too_long = (strlen(line) == sizeof(line) - 1 &&
+                        line[sizeof(line) - 2] != '\n');
+            line[strcspn(line, "\r\n")] = 0;
+            block->malformed[block->n] =
+                (parse_puzzle(line, block->puzzles[block->n]) != NULL ||
+                 too_long);
+            while (too_long && read_line(&batch.input, line, sizeof(line)))
+                too_long = (strchr(line, '\n') == NULL);
+            block->n++;
+        }
+        next += block->n;
+
+        pthread_mutex_lock(&batch.lock);
+        block->full = true;
+        pthread_cond_broadcast(&batch.changed);
+        pthread_mutex_unlock(&batch.lock);
+        if (block->n < BATCH_BLOCK)
+            return NULL;
+    }
+}
+
+/*
+  Solves every puzzle in a file, one per line, as records. A record holds
+  the solution (the first one if there are several), or zeros if there is
+  none or it was too difficult; binary records say which. The file may be
+  compressed with gzip (or zstd, see open_input). It streams: a thread
+  reads and decompresses one block of puzzles while the workers solve the
+  previous one, records being made room for between blocks and, on
+  standard output, printed after each.
+*/
+
+void
+process_arg_for_batch(const char *path, int max_depth)
+{
+    pthread_t reader;
+    struct batch_block_s *block;
+    uint64_t n = 0;
+
+    open_input(&batch.input, path);
+    batch.blocks = calloc(2, sizeof(struct batch_block_s));
+    production.kind = 's';
+    production.max_depth = (max_depth == -1) ? SOLVING_MAX_DEPTH : max_depth;
+    open_records(0);
+    pthread_create(&reader, NULL, read_blocks, NULL);
+
+    for (int b = 0; ; b ^= 1) {
+        block = &batch.blocks[b];
+        pthread_mutex_lock(&batch.lock);
+        while (!block->full)
+            pthread_cond_wait(&batch.changed, &batch.lock);
+        pthread_mutex_unlock(&batch.lock);
+
+        n = block->first + block->n;
+        reserve_records(n);
+        production.puzzles = block->puzzles;
+        production.malformed = block->malformed;
+        production.base = block->first;
+        production.n = block->n;
+        run_workers();
+        flush_records(n);
+
+        pthread_mutex_lock(&batch.lock);
+        block->full = false;
+        pthread_cond_broadcast(&batch.changed);
+        pthread_mutex_unlock(&batch.lock);
+        if (block->n < BATCH_BLOCK)
+            break;
+    }
+
+    pthread_join(reader, NULL);
+    close_records(n);
+    close_input(&batch.input);
+    free(batch.blocks);
+}
+
+
+//////////// Verification functions
+
+static const char *verdict_names[] = {"valid", "invalid", "givens",
+                                      "malformed"};
+
+/* The file being checked by --verify and what each chunk of it holds */
+static struct {
+    const char *data;
+    uint64_t size;
+    uint64_t n_chunks, next;
+    struct verify_chunk_s *chunks;
+} verification;
+
+/*
+  Checks a solved grid of BOARD_SIZE digits, each stored as zero plus the
+  digit, and that it has the givens of puzzle (any other value is a blank)
+  unless that is NULL. Returns a VERIFY_ verdict. There are no branches on
+  the cells: each digit's bit is ORed into the masks of its units, and as
+  a unit has BLOCK_SIZE cells, it has every digit once only if its mask is
+  full.
+*/
+
+int
+verify_grid(const uint8_t *grid, const uint8_t *puzzle, uint8_t zero)
+{
+    uint32_t bits[BOARD_SIZE], units[3 * BLOCK_SIZE] = {0};
+    uint32_t all = FULL_MASK, malformed = 0, wrong = 0, m;
+    uint8_t d;
+
+    for (int i = 0; i < BOARD_SIZE; i++) {
+        d = grid[i] - zero - 1;
+        malformed |= (d >= BLOCK_SIZE);
+        bits[i] = 1u << (d & 31);
+    }
+    if (variant) {
+        for (int u = 0; u < variant->n_units; u++) {
+            m = 0;
+            for (int j = 0; j < BLOCK_SIZE; j++)
+                m |= bits[variant->units[u][j]];
+            all &= m;
         }
     } else {
-        printf_c(ESSENTIAL, "Invalid puzzle\n");
+        for (int i = 0; i < BOARD_SIZE; i++) {
+            units[lookup[i][0]] |= bits[i];
+            units[BLOCK_SIZE + lookup[i][1]] |= bits[i];
+            units[2 * BLOCK_SIZE + lookup[i][2]] |= bits[i];
+        }
+        for (int u = 0; u < 3 * BLOCK_SIZE; u++)
+            all &= units[u];
     }
+    if (puzzle) {
+        for (int i = 0; i < BOARD_SIZE; i++) {
+            d = puzzle[i] - zero - 1;
+            wrong |= (d < BLOCK_SIZE) & (puzzle[i] != grid[i]);
+        }
+    }
+    if (malformed)
+        return VERIFY_MALFORMED;
+    if (all != FULL_MASK)
+        return VERIFY_INVALID;
+    return wrong ? VERIFY_GIVENS : VERIFY_VALID;
 }
 
 /*
-  Prints puzzle information. If verbosity is on, prints count which indicates
-  how much of the board is solved, and depth which indicates puzzle difficulty.
+  Checks a line of --verify, len characters without the newline: a grid,
+  or a puzzle, one separating character and a grid. Counts it in chunk c.
+*/
+
+static void
+verify_line(struct verify_chunk_s *c, const char *line, size_t len)
+{
+    const uint8_t *p = (const uint8_t *) line;
+    int verdict;
+
+    if (len && line[len - 1] == '\r')
+        len--;
+    if (len) {
+        if (len == BOARD_SIZE)
+            verdict = verify_grid(p, NULL, '0');
+        else if (len == 2 * BOARD_SIZE + 1)
+            verdict = verify_grid(p + BOARD_SIZE + 1, p, '0');
+        else
+            verdict = VERIFY_MALFORMED;
+        c->verdicts[verdict]++;
+        if (verdict != VERIFY_VALID) {
+            if (c->n_bad == c->capacity) {
+                c->capacity = c->capacity ? 2 * c->capacity : 64;
+                c->bad = realloc(c->bad, c->capacity * sizeof(uint64_t));
+            }
+            c->bad[c->n_bad++] = c->lines << 2 | verdict;
+        }
+    }
+    c->lines++;
+}
+
+/*
+  Worker thread. Checks the lines that start in the next chunk of the file
+  until there are no chunks left.
+*/
+
+static void *
+verify_chunks(void *arg)
+{
+    const char *data = verification.data, *end = data + verification.size;
+    const char *p, *q, *stop;
+    uint64_t k;
+
+    while ((k = __atomic_fetch_add(&verification.next, 1, __ATOMIC_RELAXED)) <
+           verification.n_chunks) {
+        p = data + k * VERIFY_CHUNK;
+        stop = (end - p > VERIFY_CHUNK) ? p + VERIFY_CHUNK : end;
+        if (p > data && p[-1] != '\n') {
+            q = memchr(p, '\n', end - p);
+            p = q ? q + 1 : end;
+        }
+        while (p < stop) {
+            q = memchr(p, '\n', end - p);
+            if (q == NULL)
+                q = end;
+            verify_line(&verification.chunks[k], p, q - p);
+            p = (q < end) ? q + 1 : end;
+        }
+    }
+    return NULL;
+}
+
+/*
+  Checks every line of a file of solved grids (see verify_line) and prints
+  the number and verdict of each one that isn't valid. A plain file is
+  mapped into memory and split into chunks for all the threads to check,
+  so it goes as fast as it can be read; a gzip or zstd one is read through
+  the decompressor by this thread.
 */
 
 void
-print_puzzle_info(const struct board_s *board)
+process_arg_for_verify(const char *path)
 {
-    int count = 0;
-    for (size_t i = 0; i < BOARD_SIZE; i++)
-        if (count_bits(board->grid[i]) == 1)
-            count++;
-    printf_c(ESSENTIAL, "Count: %d\n", count);
-    printf_c(ESSENTIAL, "Depth: %d\n", board->depth);
+    static const uint8_t gzip_magic[2] = {0x1f, 0x8b};
+    static const uint8_t zstd_magic[4] = {0x28, 0xb5, 0x2f, 0xfd};
+    uint8_t magic[4] = {0};
+    uint64_t line = 0, total[VERIFY_MALFORMED + 1] = {0};
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0 || fstat(fd, &st) < 0 || pread(fd, magic, 4, 0) < 0) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    verification.next = 0;
+    verification.size = st.st_size;
+    if (memcmp(magic, gzip_magic, 2) == 0 || memcmp(magic, zstd_magic, 4) == 0) {
+        struct input_s in;
+        char buffer[MAX_REQUEST_LINE];
+
+        verification.n_chunks = 1;
+        verification.chunks = calloc(1, sizeof(struct verify_chunk_s));
+        open_input(&in, path);
+        while (read_line(&in, buffer, sizeof(buffer)))
+            verify_line(verification.chunks, buffer, strcspn(buffer, "\n"));
+        close_input(&in);
+    } else {
+        int n_threads = get_num_threads();
+        pthread_t *threads = malloc(n_threads * sizeof(pthread_t));
+
+        verification.n_chunks = (verification.size + VERIFY_CHUNK - 1) /
+            VERIFY_CHUNK;
+        verification.chunks = calloc(verification.n_chunks,
+                                     sizeof(struct verify_chunk_s));
+        verification.data = verification.size ?
+            mmap(NULL, verification.size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+        if (verification.data == MAP_FAILED) {
+            perror(path);
+            exit(EXIT_FAILURE);
+        }
+        madvise((void *) verification.data, verification.size,
+                MADV_SEQUENTIAL);
+        for (long i = 0; i < n_threads; i++)
+            pthread_create(&threads[i], NULL, verify_chunks, (void *) i);
+        for (int i = 0; i < n_threads; i++)
+            pthread_join(threads[i], NULL);
+        free(threads);
+        if (verification.size)
+            munmap((void *) verification.data, verification.size);
+    }
+    close(fd);
+
+    for (uint64_t k = 0; k < verification.n_chunks; k++) {
+        struct verify_chunk_s *c = &verification.chunks[k];
+        for (uint64_t i = 0; i < c->n_bad; i++)
+            printf("%llu,%s\n",
+                   (unsigned long long) (line + (c->bad[i] >> 2) + 1),
+                   verdict_names[c->bad[i] & 3]);
+        for (int v = 0; v <= VERIFY_MALFORMED; v++)
+            total[v] += c->verdicts[v];
+        line += c->lines;
+        free(c->bad);
+    }
+    free(verification.chunks);
+    printf_c(OPTIONAL, "%llu valid, %llu invalid, %llu not matching their "
+             "puzzle, %llu malformed\n",
+             (unsigned long long) total[VERIFY_VALID],
+             (unsigned long long) total[VERIFY_INVALID],
+             (unsigned long long) total[VERIFY_GIVENS],
+             (unsigned long long) total[VERIFY_MALFORMED]);
+}
 
-    printf_c(ESSENTIAL, "Puzzle: ", board->depth);
-    print_grid_as_str(board->grid);
+
+//////////// Portfolio functions
+
+/* Shared by the threads racing strategies on one puzzle */
+static struct {
+    pthread_mutex_t lock;
+    struct board_s puzzle;
+    int max_depth;
+    bool done; // Set by the first thread with an answer, to stop the rest
+    int winner; // Thread that answered, or -1
+    struct board_s result;
+    struct board_s fallback; // The default strategy's result, if no winner
+} portfolio = { PTHREAD_MUTEX_INITIALIZER };
+
+/*
+  The strategy thread id runs: one from the table each, then the ones with
+  random choices again.
+*/
+
+static const struct strategy_s *
+strategy_for_thread(long id)
+{
+    long n = sizeof(strategies) / sizeof(strategies[0]);
+    return &strategies[(id < n) ? id : (id % 2) ? 2 : n - 1];
 }
 
 /*
-  Prints the solutions to a puzzle.
- */
+  Worker thread. Solves the puzzle with its strategy until done or beaten.
+*/
+
+static void *
+race_strategy(void *arg)
+{
+    long id = (long) arg;
+    struct board_s board = portfolio.puzzle;
+    struct limits_s l;
+
+    seed_thread_rng(id + 1);
+    strategy = strategy_for_thread(id);
+    start_limits(&l, timeout_ms, max_nodes, &portfolio.done);
+    solve(&board, portfolio.max_depth);
+    end_limits();
+
+    pthread_mutex_lock(&portfolio.lock);
+    if (board.timed_out == false && board.too_difficult == false &&
+        portfolio.done == false) {
+        __atomic_store_n(&portfolio.done, true, __ATOMIC_RELAXED);
+        portfolio.winner = id;
+        portfolio.result = board;
+    }
+    if (id == 0)
+        portfolio.fallback = board;
+    pthread_mutex_unlock(&portfolio.lock);
+    return NULL;
+}
+
+/*
+  Solves a puzzle with a different strategy on each thread. The first to
+  finish (with the uniqueness verdict, as it searches for a second
+  solution too) wins and the others are cancelled.
+*/
+
+struct board_s
+solve_with_portfolio(const grid_t grid, int max_depth, int *winner)
+{
+    int n = get_num_threads();
+    pthread_t *threads = malloc(n * sizeof(pthread_t));
+
+    portfolio.puzzle = convert_to_bitboard(grid);
+    portfolio.max_depth = max_depth;
+    portfolio.done = false;
+    portfolio.winner = -1;
+    for (long i = 0; i < n; i++)
+        pthread_create(&threads[i], NULL, race_strategy, (void *) i);
+    for (int i = 0; i < n; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+
+    *winner = portfolio.winner;
+    return (portfolio.winner >= 0) ? portfolio.result : portfolio.fallback;
+}
+
+/*
+  Processes the command line option for solving with a portfolio. Prints
+  the same as --solve, and which strategy won.
+*/
 
 void
-output_solution(grid_t grid, int max_depth)
+process_arg_for_portfolio(char *puzzle_string, int max_depth)
 {
     struct board_s board;
-    int n;
-    board = convert_to_bitboard(grid);
-    if (verbose)
-        print_puzzle(board.grid);
-    solve(&board, max_depth, -1);
+    int winner;
+    grid_t grid;
+    const char *error = parse_puzzle(puzzle_string, grid);
 
-    if (verbose)
+    if (error) {
+        fprintf(stderr, "%s\n", error);
+        exit(EXIT_FAILURE);
+    }
+    board = solve_with_portfolio(grid,
+        (max_depth == -1) ? SOLVING_MAX_DEPTH : max_depth, &winner);
+    if (winner >= 0)
+        printf_c(OPTIONAL, "Won by thread %d: %s\n", winner,
+                 strategy_for_thread(winner)->name);
+    if (verbose || board.timed_out)
         print_result(&board);
-
-    n = num_solutions(&board);
-    for (int i = 0; i < n; i++) {
-        printf("%d,", i+1);
+    for (int i = 0; i < num_solutions(&board); i++) {
+        printf("%d,", i + 1);
         print_grid_as_str(board.solutions[i]);
     }
 }
 
+
+//////////// Parallel search functions
+
 /*
-  Shuffles an array of unsigned integers.
+  Searches one puzzle on all threads. The branches near the root are tasks
+  on per-thread deques: a thread pushes and pops tasks at the bottom of its
+  own deque (depth first, like search_solution) and, when that is empty,
+  steals from the top of another thread's, where the biggest subtrees are.
+  When there is nothing to steal it sleeps until a task is pushed or the
+  last one finishes. Below PARALLEL_CUTOFF a thread searches the whole
+  subtree itself with search_solution.
+*/
+static struct {
+    struct deque_s *deques;
+    int n; // Number of threads and deques
+    int max_depth;
+    long pending; // Tasks pushed but not finished
+    long pushes; // Tasks pushed so far, which idle threads wait for
+    bool stop; // Set once MAX_SOLUTIONS solutions are found
+    pthread_mutex_t lock; // For the rest
+    pthread_cond_t changed; // Signalled on a push and once pending is 0
+    struct board_s result;
+} parallel = {
+    .lock = PTHREAD_MUTEX_INITIALIZER, .changed = PTHREAD_COND_INITIALIZER
+};
+
+static bool
+push_task(struct deque_s *d, const struct board_s *board, int depth)
+{
+    struct task_s *t;
+
+    pthread_mutex_lock(&d->lock);
+    if (d->bottom - d->top == PARALLEL_DEQUE_SIZE) {
+        pthread_mutex_unlock(&d->lock);
+        return false;
+    }
+    t = &d->tasks[d->bottom % PARALLEL_DEQUE_SIZE];
+    t->board = *board;
+    t->depth = depth;
+    d->bottom++;
+    __atomic_add_fetch(&parallel.pending, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&d->lock);
+
+    pthread_mutex_lock(&parallel.lock);
+    __atomic_add_fetch(&parallel.pushes, 1, __ATOMIC_RELAXED);
+    pthread_cond_signal(&parallel.changed);
+    pthread_mutex_unlock(&parallel.lock);
+    return true;
+}
+
+/*
+  Takes a task from the bottom of a deque (own) or its top (stealing).
+*/
+
+static bool
+take_task(struct deque_s *d, bool steal, struct task_s *t)
+{
+    bool found;
+
+    pthread_mutex_lock(&d->lock);
+    found = (d->bottom > d->top);
+    if (found && steal)
+        *t = d->tasks[d->top++ % PARALLEL_DEQUE_SIZE];
+    else if (found)
+        *t = d->tasks[--d->bottom % PARALLEL_DEQUE_SIZE];
+    pthread_mutex_unlock(&d->lock);
+    return found;
+}
+
+/*
+  Adds what a subtree found to the result: new solutions, its depth and
+  whether it was cut short. Stops every thread once there are
+  MAX_SOLUTIONS solutions.
+*/
+
+static void
+merge_subtree(const struct board_s *board)
+{
+    struct board_s *r = &parallel.result;
+    int n;
+
+    pthread_mutex_lock(&parallel.lock);
+    n = num_solutions(r);
+    for (int i = 0; i < num_solutions(board) && n < MAX_SOLUTIONS; i++) {
+        bool known = false;
+        for (int j = 0; j < n; j++)
+            known = known || memcmp(r->solutions[j], board->solutions[i],
+                                    sizeof(grid_t)) == 0;
+        if (known == false)
+            memcpy(r->solutions[n++], board->solutions[i], sizeof(grid_t));
+    }
+    if (n == MAX_SOLUTIONS)
+        __atomic_store_n(&parallel.stop, true, __ATOMIC_RELAXED);
+    if (board->depth > r->depth)
+        r->depth = board->depth;
+    if (board->iterations > r->iterations)
+        r->iterations = board->iterations;
+    r->too_difficult = r->too_difficult || board->too_difficult;
+    r->timed_out = r->timed_out ||
+        (board->timed_out && parallel.stop == false);
+    pthread_mutex_unlock(&parallel.lock);
+}
+
+/*
+  Runs a task: the same as one call of search_solution, except that the
+  branches become tasks while they are above PARALLEL_CUTOFF. Those are
+  pushed last first, so that they are popped in search_solution's order.
+*/
+
+static void
+run_task(struct task_s *t, struct deque_s *own)
+{
+    struct board_s board = t->board, child;
+
+    if (t->depth > board.depth)
+        board.depth = t->depth;
+    if (board.depth > parallel.max_depth) {
+        board.too_difficult = true;
+        merge_subtree(&board);
+        return;
+    }
+    fill(&board);
+    check_bitboard(&board);
+    if ((board.complete && board.valid) || board.valid == false) {
+        merge_subtree(&board);
+        return;
+    }
+
+    get_next_cell(&board);
+    for (size_t k = 0; k < BLOCK_SIZE && parallel.stop == false; k++) {
+        size_t i = (t->depth + 1 < PARALLEL_CUTOFF) ? BLOCK_SIZE - 1 - k : k;
+        if ((masks[i] & board.grid[board.current_index]) == 0)
+            continue;
+        child = board;
+        child.grid[board.current_index] = masks[i];
+        if (t->depth + 1 < PARALLEL_CUTOFF &&
+            push_task(own, &child, t->depth + 1))
+            continue;
+        child = search_solution(child, t->depth + 1, parallel.max_depth);
+        merge_subtree(&child);
+    }
+}
+
+static void *
+steal_work(void *arg)
+{
+    long id = (long) arg;
+    struct deque_s *own = &parallel.deques[id];
+    struct limits_s l;
+    struct task_s t;
+    long pushes;
+    bool found;
+
+    start_limits(&l, timeout_ms, max_nodes, &parallel.stop);
+    while (__atomic_load_n(&parallel.pending, __ATOMIC_RELAXED) > 0) {
+        pushes = __atomic_load_n(&parallel.pushes, __ATOMIC_RELAXED);
+        found = take_task(own, false, &t);
+        for (int i = 1; i < parallel.n && found == false; i++)
+            found = take_task(&parallel.deques[(id + i) % parallel.n], true,
+                              &t);
+        if (found == false) {
+            pthread_mutex_lock(&parallel.lock);
+            while (parallel.pushes == pushes &&
+                   __atomic_load_n(&parallel.pending, __ATOMIC_RELAXED) > 0)
+                pthread_cond_wait(&parallel.changed, &parallel.lock);
+            pthread_mutex_unlock(&parallel.lock);
+            continue;
+        }
+        if (__atomic_load_n(&parallel.stop, __ATOMIC_RELAXED)) {
+            // Drop the task
+        } else if (out_of_budget(false)) {
+            t.board.timed_out = true;
+            merge_subtree(&t.board);
+        } else {
+            run_task(&t, own);
+        }
+        if (__atomic_sub_fetch(&parallel.pending, 1, __ATOMIC_RELAXED) == 0) {
+            pthread_mutex_lock(&parallel.lock);
+            pthread_cond_broadcast(&parallel.changed);
+            pthread_mutex_unlock(&parallel.lock);
+        }
+    }
+    end_limits();
+    return NULL;
+}
+
+/*
+  Solves a puzzle like solve, but searching on all threads (see
+  parallel).
 */
 
 void
-shuffle(uint32_t arr[],
-        size_t n)
+solve_in_parallel(struct board_s *bitboard, int max_depth)
 {
-    for (size_t i = n - 1; i > 0; i--) {
-        long r;
-        lrand48_r(&rng_buf, &r);
-        r = r % (i + 1);
-        uint32_t t = arr[r];
-        arr[r] = arr[i];
-        arr[i] = t;
+    pthread_t *threads;
+
+    check_bitboard_comprehensive(bitboard);
+    if (bitboard->valid == false || bitboard->complete)
+        return;
+
+    parallel.n = get_num_threads();
+    parallel.deques = calloc(parallel.n, sizeof(struct deque_s));
+    for (int i = 0; i < parallel.n; i++)
+        pthread_mutex_init(&parallel.deques[i].lock, NULL);
+    parallel.max_depth = max_depth;
+    parallel.pending = 0;
+    parallel.pushes = 0;
+    parallel.stop = false;
+    parallel.result = *bitboard;
+    push_task(&parallel.deques[0], bitboard, 0);
+
+    threads = malloc(parallel.n * sizeof(pthread_t));
+    for (long i = 0; i < parallel.n; i++)
+        pthread_create(&threads[i], NULL, steal_work, (void *) i);
+    for (int i = 0; i < parallel.n; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    for (int i = 0; i < parallel.n; i++)
+        pthread_mutex_destroy(&parallel.deques[i].lock);
+    free(parallel.deques);
+    *bitboard = parallel.result;
+}
+
+/*
+  Processes the command line option for solving in parallel. Prints the
+  same as --solve.
+*/
+
+void
+process_arg_for_parallel(char *puzzle_string, int max_depth)
+{
+    struct board_s board;
+    grid_t grid;
+    const char *error = parse_puzzle(puzzle_string, grid);
+
+    if (error) {
+        fprintf(stderr, "%s\n", error);
+        exit(EXIT_FAILURE);
+    }
+    board = convert_to_bitboard(grid);
+    solve_in_parallel(&board,
+                      (max_depth == -1) ? SOLVING_MAX_DEPTH : max_depth);
+    if (verbose || board.timed_out)
+        print_result(&board);
+    for (int i = 0; i < num_solutions(&board); i++) {
+        printf("%d,", i + 1);
+        print_grid_as_str(board.solutions[i]);
+    }
+}
+
+
+//////////// Benchmark functions
+
+/* Baseline for --bench to compare with and how much worse is a regression */
+static const char *bench_baseline;
+static double bench_threshold = BENCH_DEFAULT_THRESHOLD;
+static int bench_regressions = 0;
+
+static int
+compare_latencies(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+/*
+  Compares a result with the line for the same corpus in the baseline file,
+  if there is one. It is a regression if puzzles per second dropped, or the
+  99th percentile latency grew, by more than the threshold (in percent).
+*/
+
+static void
+compare_with_baseline(const struct bench_result_s *r)
+{
+    FILE *f = fopen(bench_baseline, "r");
+    char line[MAX_RESPONSE_LINE], key[MAX_RESPONSE_LINE];
+    double per_second, p99_us;
+    char *p, *q;
+
+    if (f == NULL) {
+        perror(bench_baseline);
+        return;
     }
+    snprintf(key, sizeof(key), "\"corpus\":\"%s\"", r->corpus);
+    while (fgets(line, sizeof(line), f)) {
+        if (strstr(line, key) == NULL ||
+            (p = strstr(line, "\"puzzles_per_second\":")) == NULL ||
+            (q = strstr(line, "\"p99_us\":")) == NULL ||
+            sscanf(p + 21, "%lf", &per_second) != 1 ||
+            sscanf(q + 9, "%lf", &p99_us) != 1)
+            continue;
+        if (r->per_second < per_second * (1.0 - bench_threshold / 100.0) ||
+            r->p99_us > p99_us * (1.0 + bench_threshold / 100.0)) {
+            fprintf(stderr, "Regression in %s: %.1f puzzles/s (was %.1f), "
+                    "p99 %.1f us (was %.1f)\n", r->corpus, r->per_second,
+                    per_second, r->p99_us, p99_us);
+            bench_regressions++;
+        }
+        break;
+    }
+    fclose(f);
 }
 
 /*
-  Fills an array from 0 to n-1.
- */
+  Runs one benchmark corpus: a file of puzzles to solve, one per line, or
+  create:<hardness> or easy:<blanks> for BENCH_GENERATED puzzles made from
+  the random seed (see -r). Times each puzzle and prints a line of JSON with
+  the throughput and latencies. Puzzles that aren't solved uniquely, or
+  couldn't be made in the budget (see --timeout), are counted as unsolved.
+*/
 
 void
-fill_0_to_n(uint32_t arr[],
-            size_t n)
+process_arg_for_bench(const char *corpus, int max_depth)
 {
-    for (size_t i = 0; i < n; i++)
-        arr[i] = i;
+    struct bench_result_s r = {0};
+    uint64_t *latencies = NULL, size = 0, start, total = 0;
+    struct board_s board;
+    struct limits_s l;
+    char line[MAX_REQUEST_LINE], kind = 0;
+    int level = 0;
+    grid_t grid;
+    FILE *f = NULL;
+
+    if (sscanf(corpus, "create:%d", &level) == 1)
+        kind = 'c';
+    else if (sscanf(corpus, "easy:%d", &level) == 1)
+        kind = 'e';
+    else if ((f = fopen(corpus, "r")) == NULL) {
+        perror(corpus);
+        exit(EXIT_FAILURE);
+    }
+    if (kind)
+        seed_thread_rng(0);
+
+    while (kind ? r.puzzles < BENCH_GENERATED :
+           fgets(line, sizeof(line), f) != NULL) {
+        line[strcspn(line, "\r\n")] = 0;
+        if (kind == 0 && parse_puzzle(line, grid) != NULL)
+            continue;
+        if (r.puzzles == size) {
+            size = size ? 2 * size : 1024;
+            latencies = realloc(latencies, size * sizeof(uint64_t));
+        }
+        start = monotonic_ns();
+        start_limits(&l, timeout_ms, max_nodes, NULL);
+        if (kind == 'c') {
+            board = create_puzzle(level, (max_depth == -1) ?
+                                  CREATING_MAX_DEPTH : max_depth, false);
+        } else if (kind == 'e') {
+            board = make_easy_puzzle(false, level);
+        } else {
+            board = convert_to_bitboard(grid);
+            solve(&board, (max_depth == -1) ? SOLVING_MAX_DEPTH : max_depth);
+        }
+        end_limits();
+        latencies[r.puzzles] = monotonic_ns() - start;
+        total += latencies[r.puzzles];
+        if (board.timed_out ||
+            (kind == 0 && result_status(&board) != STATUS_UNIQUE))
+            r.unsolved++;
+        r.puzzles++;
+    }
+    if (f)
+        fclose(f);
+
+    if (r.puzzles > 0) {
+        qsort(latencies, r.puzzles, sizeof(uint64_t), compare_latencies);
+        r.seconds = total / 1e9;
+        r.per_second = r.puzzles / r.seconds;
+        r.p50_us = latencies[(r.puzzles - 1) * 50 / 100] / 1e3;
+        r.p99_us = latencies[(r.puzzles - 1) * 99 / 100] / 1e3;
+        r.max_us = latencies[r.puzzles - 1] / 1e3;
+    }
+    free(latencies);
+    snprintf(r.corpus, sizeof(r.corpus), "%s", corpus);
+    printf("{\"corpus\":\"%s\",\"puzzles\":%llu,\"unsolved\":%llu,"
+           "\"seconds\":%.6f,\"puzzles_per_second\":%.1f,"
+           "\"p50_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f}\n",
+           r.corpus, (unsigned long long) r.puzzles,
+           (unsigned long long) r.unsolved, r.seconds, r.per_second,
+           r.p50_us, r.p99_us, r.max_us);
+    fflush(stdout);
+    if (bench_baseline)
+        compare_with_baseline(&r);
 }
 
+
+//////////// Inventory functions
+
 /*
-  Fills an array from 0 to n-1 and then shuffles it.
- */
+  The inventory keeps a stock of ready made puzzles for the server, so that
+  requests for new puzzles don't have to wait for create_puzzle or
+  make_easy_puzzle. Low priority threads keep every bucket topped up.
+*/
 
-void fill_and_shuffle(uint32_t arr[], size_t n)
-{
-    fill_0_to_n(arr, n);
-    shuffle(arr, n);
-}
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t wanted; // Signalled whenever a puzzle is taken
+    struct stock_s stocks[2 * INVENTORY_BUCKETS]; // Without and with symmetry
+    int target; // Number of puzzles to keep in each bucket
+    const char *path; // File the stock is kept in between runs
+    bool stopping;
+} inventory = {
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER
+};
 
 /*
-  Randomly sets an integer to have one and only one of the first n bits set
-  where n is the size of the Sudoku alphabet (9 in the default version).
+  Makes a puzzle with make_easy_puzzle and solves it to find its depth. The
+  grid of the returned board is the puzzle.
 */
 
-void
-set_random_bit(uint32_t *n)
+static struct board_s
+make_rated_easy_puzzle(bool symmetry, int blanks)
 {
-    int i = 0, j = rand() % count_bits(*n) + 1, count = 0;
+    struct board_s board = make_easy_puzzle(symmetry, blanks);
+    grid_t puzzle;
+
+    memcpy(puzzle, board.grid, sizeof(puzzle));
+    init_board(&board);
+    solve(&board, SOLVING_MAX_DEPTH);
+    memcpy(board.grid, puzzle, sizeof(board.grid));
+    return board;
+}
 
-    for (;count < j; i++)
-        if (masks[i] & *n)
-            ++count;
+static struct stock_s *
+find_stock(bool easy, int level, bool symmetry)
+{
+    for (int i = 0; i < 2 * INVENTORY_BUCKETS; i++) {
+        struct stock_s *stock = &inventory.stocks[i];
+        if (stock->easy == easy && stock->level == level &&
+            stock->symmetry == symmetry)
+            return stock;
+    }
+    return NULL;
+}
 
-    *n = masks[i - 1];
+static void
+add_to_stock(struct stock_s *stock, const struct board_s *board)
+{
+    if (stock->count < INVENTORY_CAPACITY) {
+        stock->puzzles[(stock->first + stock->count) % INVENTORY_CAPACITY] =
+            *board;
+        stock->count++;
+    }
 }
 
-/* Creates puzzles that are generally very hard to solve.
-   The higher min_depth the harder (and slower to create) it is. But
-   even leaving min_depth at 0 generally makes it hard enough. Setting
-   max_depth too high may result in a very long time to create some puzzles.
+/*
+  Takes a puzzle out of stock. Returns false if the inventory isn't running,
+  has no such bucket or the bucket is empty.
 */
 
-struct board_s
-create_puzzle(int min_depth,
-              int max_depth,
-              bool symmetry)
+static bool
+take_from_inventory(bool easy, int level, bool symmetry, struct board_s *board)
 {
-    uint32_t cells[BOARD_SIZE], *cell, *mirror_cell, i, mask, n, c = 0;
-    struct board_s board, test_board;
-
-    // Loop until we have a valid puzzle with a unique solution
-    // of sufficient depth
-    do {
-        printf_c(OPTIONAL, "Trying ... %u\n", c);
+    struct stock_s *stock;
+    bool found = false;
 
-        // We use two boards. One will be passed to the solving algorithm
-        // and will used to test for a solution.
-        // The other holds the current position.
-        init_board(&board);
-        init_board(&test_board);
-        n = 0;
-        memset(board.grid, 0, sizeof(board.grid));
+    if (inventory.path == NULL)
+        return false;
+    pthread_mutex_lock(&inventory.lock);
+    stock = find_stock(easy, level, symmetry);
+    if (stock && stock->count > 0) {
+        *board = stock->puzzles[stock->first];
+        stock->first = (stock->first + 1) % INVENTORY_CAPACITY;
+        stock->count--;
+        found = true;
+        pthread_cond_broadcast(&inventory.wanted);
+    }
+    pthread_mutex_unlock(&inventory.lock);
+    return found;
+}
 
-        // Shuffle an array of indices into the board
-        if (symmetry)
-            fill_and_shuffle(cells, BOARD_SIZE / 2 + 1);
-        else
-            fill_and_shuffle(cells, BOARD_SIZE);
+/*
+  Low priority thread that makes puzzles for the bucket that is furthest
+  below its target.
+*/
 
-        // Randomly, but legally, set 16 cells
-        for (i = 0; i < 16 / ((int) (symmetry + 1)); i++) {
-            fill(&board);
-            if (board.grid[cells[i]] == 0) {
-                board.valid = false;
-                break;
-            }
-            set_random_bit(&board.grid[cells[i]]);
-            if (symmetry && cells[i] != BOARD_SIZE / 2 + 1) {
-                fill(&board);
-                if (board.grid[BOARD_SIZE - cells[i] - 1] == 0) {
-                    board.valid = false;
-                } else {
-                    assert(count_bits(board.grid[BOARD_SIZE - cells[i] - 1]));
-                    set_random_bit(&board.grid[BOARD_SIZE - cells[i] - 1]);
-                }
-            }
+static void *
+refill_inventory(void *arg)
+{
+    long id = (long) arg;
+    struct stock_s *stock, *neediest;
+    struct board_s board;
+    struct limits_s l;
+
+    setpriority(PRIO_PROCESS, gettid(), 19);
+    seed_thread_rng(id);
+    quiet = true;
+    start_limits(&l, 0, 0, &inventory.stopping);
+    pthread_mutex_lock(&inventory.lock);
+    while (inventory.stopping == false) {
+        neediest = NULL;
+        for (int i = 0; i < 2 * INVENTORY_BUCKETS; i++) {
+            stock = &inventory.stocks[i];
+            if (stock->count + stock->refilling < inventory.target &&
+                (neediest == NULL || stock->count + stock->refilling <
+                 neediest->count + neediest->refilling))
+                neediest = stock;
         }
-
-        if (board.valid == false)
+        if (neediest == NULL) {
+            pthread_cond_wait(&inventory.wanted, &inventory.lock);
             continue;
-        fill(&board);
-
-        // Now loop until a solution is found or the board is invalid
-        // On each iteration, randomly select an unfilled cell,
-        // set it to a randomly selected legal value, and
-        // check for a solution
-        do {
-            cell = &board.grid[cells[i]];
-            mask = *cell;
-            if (*cell == 0) {
-                board.valid = false;
-                break;
-            }
-            assert(count_bits(*cell));
-            set_random_bit(cell);
-            memcpy(&test_board, &board, sizeof(board));
-            fill(&test_board);
-            if (symmetry && cells[i] != BOARD_SIZE / 2 + 1) {
-                mirror_cell = &board.grid[BOARD_SIZE - cells[i] - 1];
-                if (*mirror_cell == 0) {
-                    board.valid = false;
-                    break;
-                }
-                assert(count_bits(*mirror_cell));
-                set_random_bit(mirror_cell);
-                memcpy(&test_board, &board, sizeof(board));
-                fill(&test_board);
-            }
-            solve(&test_board, max_depth, -1);
-            n = num_solutions(&test_board);
-            if (n == 0) {
-                *cell = mask ^ *cell;
-                if (*cell == 0 || test_board.depth > max_depth) {
-                    board.valid = false;
-                    break;
-                }
-            } else {
-                i++;
-            }
-        } while (n != 1 && i < (BOARD_SIZE / ((int) symmetry + 1) ) );
-        c++;
-    } while (test_board.depth < min_depth || test_board.depth > max_depth ||
-             n != 1 || board.valid == false);
+        }
+        neediest->refilling++;
+        pthread_mutex_unlock(&inventory.lock);
 
-    // We have a valid solution in test_board and the starting grid in board.
-    // So copy the starting grid into test_board and that's what we return.
-    memcpy(test_board.grid, board.grid, sizeof(test_board.grid));
-    for (i = 0; i < BOARD_SIZE; i++)
-        if (count_bits(test_board.grid[i]) > 1)
-            test_board.grid[i] = 0;
+        if (neediest->easy)
+            board = make_rated_easy_puzzle(neediest->symmetry, neediest->level);
+        else
+            board = create_puzzle(neediest->level, CREATING_MAX_DEPTH,
+                                  neediest->symmetry);
 
-    return test_board;
+        pthread_mutex_lock(&inventory.lock);
+        neediest->refilling--;
+        if (board.timed_out == false)
+            add_to_stock(neediest, &board);
+    }
+    pthread_mutex_unlock(&inventory.lock);
+    return NULL;
 }
 
 /*
-  This is used to create a random complete Sudoku board from which simpler
-  puzzles can be created. It's an order of magnitude slower at solving than the
-  search_solution algorithm. But it is useful for calculating the likely number
-  of completed Sudoku puzzles.
+  Reads the stock saved by a previous run. Each line is
+  easy level symmetry depth iterations puzzle solution
 */
-struct board_choices_s
-make_random_complete_board(struct board_s *board)
+
+static void
+load_inventory()
 {
-    const size_t stack_size = 1000;
-    struct board_choices_s stack[stack_size];
-    struct board_s b, c;
-    int sp = 0;
+    FILE *f = fopen(inventory.path, "r");
+    char puzzle[BOARD_SIZE + 2], solution[BOARD_SIZE + 2];
+    int easy, level, symmetry, depth, iterations;
+    struct stock_s *stock;
+    struct board_s board;
+    grid_t grid;
+
+    if (f == NULL)
+        return;
+    while (fscanf(f, "%d %d %d %d %d %82s %82s", &easy, &level, &symmetry,
+                  &depth, &iterations, puzzle, solution) == 7) {
+        stock = find_stock(easy, level, symmetry);
+        if (stock == NULL || parse_puzzle(puzzle, grid))
+            continue;
+        board = convert_to_bitboard(grid);
+        if (parse_puzzle(solution, grid))
+            continue;
+        board.depth = depth;
+        board.iterations = iterations;
+        memcpy(board.solutions[0], convert_to_bitboard(grid).grid,
+               sizeof(board.solutions[0]));
+        add_to_stock(stock, &board);
+    }
+    fclose(f);
+}
 
-    b = *board;
+/*
+  Writes the stock to the inventory file so the next run can start with it.
+*/
 
-    fill(&b);
+static void
+save_inventory()
+{
+    FILE *f = fopen(inventory.path, "w");
+    char puzzle[BOARD_SIZE + 1], solution[BOARD_SIZE + 1];
+    struct stock_s *stock;
+    struct board_s *board;
+
+    if (f == NULL) {
+        perror(inventory.path);
+        return;
+    }
+    pthread_mutex_lock(&inventory.lock);
+    __atomic_store_n(&inventory.stopping, true, __ATOMIC_RELAXED);
+    for (int i = 0; i < 2 * INVENTORY_BUCKETS; i++) {
+        stock = &inventory.stocks[i];
+        for (int j = 0; j < stock->count; j++) {
+            board = &stock->puzzles[(stock->first + j) % INVENTORY_CAPACITY];
+            fprintf(f, "%d %d %d %d %d %s %s\n", stock->easy, stock->level,
+                    stock->symmetry, board->depth, board->iterations,
+                    grid_to_str(board->grid, puzzle),
+                    grid_to_str(board->solutions[0], solution));
+        }
+    }
+    pthread_mutex_unlock(&inventory.lock);
+    fclose(f);
+}
 
-    stack[sp].board = b;
-    stack[sp].choices = 1;
+/*
+  Loads the saved stock and starts the refilling threads. They aren't joined
+  on shutdown: a puzzle still being made when the server stops is lost.
+*/
 
-    init_board(&stack[sp].used);
-    memset(&stack[sp].used.grid, 0, sizeof(stack[sp].used.grid));
+static void
+start_inventory()
+{
+    int n = get_num_threads();
+    pthread_t thread;
 
-    ++sp;
-    check_bitboard(&stack[sp-1].board);
+    for (int i = 0; i < 2 * INVENTORY_BUCKETS; i++) {
+        inventory.stocks[i].easy = inventory_buckets[i / 2].easy;
+        inventory.stocks[i].level = inventory_buckets[i / 2].level;
+        inventory.stocks[i].symmetry = i % 2;
+    }
+    if (inventory.target <= 0)
+        inventory.target = INVENTORY_DEFAULT_TARGET;
+    if (inventory.target > INVENTORY_CAPACITY)
+        inventory.target = INVENTORY_CAPACITY;
+    load_inventory();
+    for (long i = 0; i < n; i++) {
+        pthread_create(&thread, NULL, refill_inventory, (void *) (n + i + 1));
+        pthread_detach(thread);
+    }
+}
 
-    while(sp > 0 && sp < stack_size && stack[sp-1].board.complete == false) {
-        b = stack[sp-1].board;
-        c = stack[sp-1].used;
 
-        fill(&b);
+//////////// Server functions
 
-        // Remove used options
-        for (int i = 0; i < BOARD_SIZE; i++) {
-            if (c.grid[i])
-                b.grid[i] = ~c.grid[i] & b.grid[i];
-        }
+/* Requests waiting for a worker thread */
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    struct job_s *head, *tail;
+    bool stopping;
+} job_queue = {
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL, false
+};
 
-        check_bitboard(&b);
-        if (b.valid == false) {
-            --sp;
-            continue;
-        }
+static volatile sig_atomic_t server_stopping = 0;
 
-        // Find the cell with the fewest options > 1
-        int min_index = 0, min_bits = BLOCK_SIZE + 1;
-        for (int i = 0; i < BOARD_SIZE; i++) {
-            int j = count_bits(b.grid[i]);
-            if (j > 1 && j < min_bits) {
-                min_index = i;
-                min_bits = j;
-            }
-        }
-        long n;
-        lrand48_r(&rng_buf, &n);
-        n = n % min_bits;
-        int nth_bit = get_nth_set_bit(b.grid[min_index], n);
-        b.grid[min_index] = masks[nth_bit];
-
-        stack[sp-1].used.grid[min_index] |= masks[nth_bit];
-        stack[sp].board = b;
-        init_board(&stack[sp].used);
-        memset(&stack[sp].used.grid, 0, sizeof(stack[sp].used.grid));
-        stack[sp].choices = min_bits;
-        ++sp;
-    }
-    if (sp == 0 || sp == stack_size) {
-        fill(&stack[0].board);
-        for (int i = 0; i < BOARD_SIZE; i++) {
-            if (stack[0].used.grid[i])
-                stack[0].board.grid[i] = ~stack[0].used.grid[i] &
-                    stack[0].board.grid[i];
-        }
-        init_board(&stack[0].board);
-        stack[0].board.valid = false;
-        stack[0].board.complete = false;
-        stack[0].choices = 0;
-        return stack[0];
-    } else {
-        uint64_t choices = 1;
-        for (int i = 0; i < sp; i++)
-            choices *= stack[i].choices;
-        stack[sp-1].board.complete = true;
-        stack[sp-1].board.valid = true;
-        memcpy(stack[sp-1].board.grid, stack[sp-1].board.solutions[0],
-               BOARD_SIZE*sizeof(uint32_t));
-        stack[sp-1].choices = choices;
-        return stack[sp-1];
-    }
+static void
+stop_server(int sig)
+{
+    server_stopping = 1;
 }
 
-bool
-unique_solution(struct board_s board)
+static void
+push_job(struct job_s *job)
 {
-    solve(&board, SOLVING_MAX_DEPTH, -1);
-    if (board.valid && num_solutions(&board) == 1)
-        return true;
+    job->next = NULL;
+    pthread_mutex_lock(&job_queue.lock);
+    if (job_queue.tail)
+        job_queue.tail->next = job;
     else
-        return false;
+        job_queue.head = job;
+    job_queue.tail = job;
+    pthread_cond_signal(&job_queue.ready);
+    pthread_mutex_unlock(&job_queue.lock);
 }
 
 /*
-  Makes easyish puzzles. At least not usually as hard as the default method.
-  The symmetry parameter ensures the puzzle is symmetrical. The min_removals
-  parameter is the minimum number of blank squares needed for the puzzle.
-  Note that the higher the value of min_removals the slower this will be and at
-  some high value it sends this function into an endless loop.
+  Waits for the next request. Returns NULL once the server is stopping and
+  the queue has been drained.
 */
 
-struct board_s
-make_easy_puzzle(bool symmetry, int min_removals) {
-    struct board_s board, prev;
-    int i;
-    if (symmetry) min_removals /= 2;
-    do {
-        i = 0;
-        struct board_choices_s bc;
-        uint32_t shuffled_indices[BOARD_SIZE];
-        int num_cells;
-
-        if (symmetry) {
-            num_cells = BOARD_SIZE / 2 + 1;
-        } else {
-            num_cells = BOARD_SIZE;
-        }
-        fill_and_shuffle(shuffled_indices, num_cells);
+static struct job_s *
+pop_job()
+{
+    struct job_s *job;
+
+    pthread_mutex_lock(&job_queue.lock);
+    while (job_queue.head == NULL && job_queue.stopping == false)
+        pthread_cond_wait(&job_queue.ready, &job_queue.lock);
+    job = job_queue.head;
+    if (job) {
+        job_queue.head = job->next;
+        if (job_queue.head == NULL)
+            job_queue.tail = NULL;
+    }
+    pthread_mutex_unlock(&job_queue.lock);
+    return job;
+}
 
-        init_board(&board);
-        memset(board.grid, 0, sizeof(board.grid));
-        bc = make_random_complete_board(&board);
+static const char *status_names[] = {
+    "unique", "multiple", "invalid", "too-difficult", "timed-out"
+};
 
-        memcpy(board.grid, bc.board.solutions[0], BOARD_SIZE * sizeof(uint32_t));
-        board.complete = false;
+/*
+  Appends the outcome of solving a board to a response, e.g.
+  status=unique depth=1 iterations=4 solution=123...
+*/
 
-        for (; i < num_cells && (i < min_removals || min_removals == 0); i++) {
-            int r = shuffled_indices[i];
-            prev = board;
-            board.grid[r] = 0;
-            if (symmetry && r != 40)
-                board.grid[80 - r] = 0;
-            if (unique_solution(board) == false)
-                break;
-        }
-    } while (i < min_removals);
-    if (min_removals)
-        return board;
-    else
-        return prev;
+static void
+format_result(const struct board_s *board, bool with_solutions,
+              char *response, size_t size)
+{
+    char s[BOARD_SIZE + 1];
+    int n = num_solutions(board);
+    size_t len = strlen(response);
+
+    len += snprintf(response + len, size - len,
+                    "status=%s depth=%d iterations=%d",
+                    status_names[result_status(board)], board->depth,
+                    board->iterations);
+    for (int i = 0; with_solutions && i < n && len < size; i++)
+        len += snprintf(response + len, size - len, " solution=%s",
+                        grid_to_str(board->solutions[i], s));
 }
 
 /*
-  Wrapper function for creating a new puzzle.
+  Answers a metrics request: the number of operations of a kind, its
+  latency percentiles in microseconds and how many timed out, e.g.
+  count=12 p50_us=80 p99_us=1024 p999_us=1024 timed_out=0
 */
 
-void
-output_puzzle(int min_depth, bool symmetry, int max_depth)
+static void
+format_metrics(const char *operation, char *response, size_t size)
 {
-    struct board_s board;
+    struct metrics_s *sum;
+    uint64_t count = 0;
+    int op;
 
-    if (max_depth - min_depth < 3) {
-        fprintf(stderr, "Depth for puzzle too close to max depth.\n");
-        exit(EXIT_FAILURE);
+    for (op = 0; op < NUM_OPERATIONS; op++)
+        if (strcmp(operation, operation_names[op]) == 0)
+            break;
+    if (op == NUM_OPERATIONS) {
+        snprintf(response, size, "error Unknown operation %s", operation);
+        return;
     }
+    sum = malloc(sizeof(*sum));
+    merge_metrics(sum);
+    for (int st = 0; st <= STATUS_TIMED_OUT; st++)
+        count += sum->outcomes[op][st];
+    snprintf(response, size, "ok count=%llu p50_us=%.3f p99_us=%.3f "
+             "p999_us=%.3f timed_out=%llu", (unsigned long long) count,
+             latency_quantile(sum, op, 0.5) / 1e3,
+             latency_quantile(sum, op, 0.99) / 1e3,
+             latency_quantile(sum, op, 0.999) / 1e3,
+             (unsigned long long) sum->outcomes[op][STATUS_TIMED_OUT]);
+    free(sum);
+}
 
-    if (max_depth < 0) {
-        fprintf(stderr, "Depths must be positive.\n");
-        exit(EXIT_FAILURE);
-    }
+/*
+  Writes all of buf to a socket, waiting if the socket is full.
+*/
 
-    if (min_depth > CREATING_MAX_DEPTH) {
-        fprintf(stderr, "A depth of %d is too ambitious.\n", min_depth);
-        exit(EXIT_FAILURE);
+static bool
+write_all(int fd, const char *buf, size_t n)
+{
+    struct pollfd p = { fd, POLLOUT, 0 };
+
+    while (n > 0) {
+        ssize_t w = send(fd, buf, n, MSG_NOSIGNAL);
+        if (w > 0) {
+            buf += w;
+            n -= w;
+        } else if (w < 0 && (errno == EAGAIN || errno == EINTR)) {
+            poll(&p, 1, -1);
+        } else {
+            return false;
+        }
     }
+    return true;
+}
 
-    board = create_puzzle(min_depth, max_depth, symmetry);
-    if (verbose)
-        print_puzzle(board.grid);
+/*
+  Writes a line (or several) to a client, none of it mixed with the lines
+  of other jobs.
+*/
+
+static void
+send_line(struct connection_s *conn, const char *line, size_t n)
+{
+    if (conn == NULL)
+        return;
+    pthread_mutex_lock(&conn->lock);
+    write_all(conn->fd, line, n);
+    pthread_mutex_unlock(&conn->lock);
+}
+
+/*
+  Lets go of a connection, for the event loop or for an answered job. The
+  last one closes it.
+*/
 
-    if (verbose)
-        print_result(&board);
+static void
+release_connection(struct connection_s *conn, bool job)
+{
+    bool last;
 
-    print_puzzle_info(&board);
+    pthread_mutex_lock(&conn->lock);
+    if (job)
+        conn->jobs--;
+    else
+        conn->reading = false;
+    last = (conn->reading == false && conn->jobs == 0);
+    pthread_mutex_unlock(&conn->lock);
+    if (last) {
+        close(conn->fd);
+        pthread_mutex_destroy(&conn->lock);
+        free(conn);
+    }
 }
 
 /*
-  CLI help.
- */
+  Answers a solutions request, streaming up to count solutions of the
+  puzzle to the client as they are found, each on a line of its own like
+  the response. The response then gives the status (see format_result),
+  how many there were and whether there are more, which takes looking for
+  one more solution.
+*/
 
-void
-print_help(const char *prog)
+static void
+stream_solutions(struct job_s *job, const grid_t grid, int count,
+                 struct board_s *board, char *response, size_t size)
 {
-    printf_c(ESSENTIAL, "%s: A Sudoku puzzle creater and solver\n", prog);
-    printf_c(ESSENTIAL, "Options are: \n\n");
-    for (int i = 0; i < sizeof(long_options)/sizeof(struct option) - 1; i++) {
-        printf_c(ESSENTIAL, "--%s (or -%c) ", long_options[i].name, long_options[i].val);
-        if (long_options[i].has_arg == required_argument)
-            printf_c(ESSENTIAL, "<%s>", arguments[i]);
-        putchar('\n');
-        printf_c(ESSENTIAL, "%s\n\n", descriptions[i]);
+    struct solution_iter_s *it = malloc(sizeof(*it));
+    char line[MAX_RESPONSE_LINE], s[BOARD_SIZE + 1];
+    int n = 0, len;
+    grid_t solution;
+    bool more;
+
+    *board = convert_to_bitboard(grid);
+    start_solutions(it, board, "", false, "");
+    while ( (more = next_solution(it, solution)) && n < count) {
+        if (n < MAX_SOLUTIONS)
+            memcpy(board->solutions[n], solution, sizeof(solution));
+        len = snprintf(line, sizeof(line), "%lu solution=%s\n", job->seq,
+                       grid_to_str(solution, s));
+        send_line(job->conn, line, len);
+        n++;
     }
-    printf_c(ESSENTIAL, "Examples:\n");
-    printf_c(ESSENTIAL, "%s -c 0\n (Creates a simple puzzle)\n", prog);
-    printf_c(ESSENTIAL, "%s -m -c 2\n (Creates a hard symmetry puzzle)\n", prog);
-    printf_c(ESSENTIAL, "%s -s 3009857000080000200004000080006304000058219000090470006"
-           "00004000010000200002106009\n"
-           "(Solves the puzzle)\n", prog);
+    if (more && n < MAX_SOLUTIONS)
+        memcpy(board->solutions[n], solution, sizeof(solution));
+    board->timed_out = it->timed_out;
+    free(it);
+    len = snprintf(response, size, "ok status=%s count=%d",
+                   status_names[result_status(board)], n);
+    if (board->timed_out == false)
+        snprintf(response + len, size - len, " more=%d", more);
 }
 
 /*
-  Processes the command line option for solving a puzzle.
- */
+  Runs one request and writes the response into response. A request is a
+  command, its argument and optional settings. E.g.
+
+     solve 300985700008000020000400008000630400005821900009047000600004000010000200002106009 depth=20
+     rate 300985700008000020000400008000630400005821900009047000600004000010000200002106009
+     solutions 000000000000003085001020000000507000004000100090000000500000073002010000000040009 count=5
+     create 1 symmetry=1
+     easy 40 timeout=100
+     metrics solve
+
+  The response is "ok" followed by the result, or "error" and a message.
+  Each request has a budget of timeout milliseconds and nodes steps (by
+  default those of --timeout and --nodes), and is cut short when the server
+  stops; it then has status=timed-out and says how many steps it took.
+*/
 
-void
-process_arg_for_solving(char *puzzle_string,
-                        int max_depth)
+static void
+run_request(struct job_s *job, char *response, size_t size)
 {
-    uint32_t *g;
-    int l;
-    char *c;
+    char *save, *command, *argument, *setting, s[BOARD_SIZE + 1];
+    int max_depth = -1, symmetry = 0, level, count = SOLUTIONS_DEFAULT_COUNT;
+    uint64_t timeout = timeout_ms, nodes = max_nodes;
+    const char *error = NULL;
+    struct board_s board;
+    struct limits_s l;
+    size_t len;
+    bool stocked;
     grid_t grid;
-
-    l = strlen(optarg);
-    if (l < BOARD_SIZE) {
-        fprintf(stderr, "Too few cells specified\n");
-        exit(EXIT_FAILURE);
-    } else if (l > BOARD_SIZE) {
-        fprintf(stderr, "Too many cells specified\n");
-        exit(EXIT_FAILURE);
+    uint64_t start = monotonic_ns();
+    int op;
+
+    command = strtok_r(job->line, " \t\r", &save);
+    argument = strtok_r(NULL, " \t\r", &save);
+    if (command == NULL || argument == NULL) {
+        snprintf(response, size, "error Expected a command and an argument");
+        return;
     }
-    for (c = puzzle_string, g = grid; *c; c++, g++) {
-        if (*c >= '0' && *c <= '9') {
-            *g = (uint32_t) (*c - '0');
+    while ( (setting = strtok_r(NULL, " \t\r", &save)) ) {
+        if (strncmp(setting, "depth=", 6) == 0) {
+            max_depth = atoi(setting + 6);
+        } else if (strncmp(setting, "symmetry=", 9) == 0) {
+            symmetry = atoi(setting + 9);
+        } else if (strncmp(setting, "timeout=", 8) == 0) {
+            timeout = strtoull(setting + 8, NULL, 10);
+        } else if (strncmp(setting, "nodes=", 6) == 0) {
+            nodes = strtoull(setting + 6, NULL, 10);
+        } else if (strncmp(setting, "count=", 6) == 0) {
+            count = atoi(setting + 6);
         } else {
-            fprintf(stderr, "Incorrect character used %c\n", *c);
-            exit(EXIT_FAILURE);
+            snprintf(response, size, "error Unknown setting %s", setting);
+            return;
         }
     }
-    output_solution(grid, (max_depth == -1) ? SOLVING_MAX_DEPTH : max_depth);
+
+    if (strcmp(command, "metrics") == 0) {
+        format_metrics(argument, response, size);
+        return;
+    } else if (strcmp(command, "solve") == 0 || strcmp(command, "rate") == 0) {
+        if ( (error = parse_puzzle(argument, grid)) ) {
+            snprintf(response, size, "error %s", error);
+            return;
+        }
+        op = (command[0] == 's') ? OP_SOLVE : OP_RATE;
+        board = convert_to_bitboard(grid);
+        start_limits(&l, timeout, nodes, &job_queue.stopping);
+        solve(&board, (max_depth == -1) ? SOLVING_MAX_DEPTH : max_depth);
+        end_limits();
+        snprintf(response, size, "ok ");
+        format_result(&board, command[0] == 's', response, size);
+    } else if (strcmp(command, "solutions") == 0) {
+        if (count < 1) {
+            snprintf(response, size, "error Count must be at least 1");
+            return;
+        }
+        if ( (error = parse_puzzle(argument, grid)) ) {
+            snprintf(response, size, "error %s", error);
+            return;
+        }
+        op = OP_SOLVE;
+        start_limits(&l, timeout, nodes, &job_queue.stopping);
+        stream_solutions(job, grid, count, &board, response, size);
+        end_limits();
+    } else if (strcmp(command, "create") == 0 ||
+               strcmp(command, "easy") == 0) {
+        level = atoi(argument);
+        if (command[0] == 'e' && (level < 0 || level > BOARD_SIZE - 17)) {
+            snprintf(response, size, "error Blanks must be from 0 to %d",
+                     BOARD_SIZE - 17);
+            return;
+        }
+        op = (command[0] == 'c') ? OP_CREATE : OP_EASY;
+        stocked = (max_depth == -1);
+        if (command[0] == 'c' && max_depth == -1)
+            max_depth = CREATING_MAX_DEPTH;
+        if (command[0] == 'c' &&
+            (error = check_creating_depths(level, max_depth)) ) {
+            snprintf(response, size, "error %s", error);
+            return;
+        }
+        start_limits(&l, timeout, nodes, &job_queue.stopping);
+        if (command[0] == 'e') {
+            if (take_from_inventory(true, level, symmetry, &board) == false)
+                board = make_rated_easy_puzzle(symmetry, level);
+        } else if (stocked == false ||
+                   take_from_inventory(false, level, symmetry, &board) == false) {
+            board = create_puzzle(level, max_depth, symmetry);
+        }
+        end_limits();
+        if (board.timed_out)
+            snprintf(response, size, "ok ");
+        else
+            snprintf(response, size, "ok puzzle=%s ",
+                     grid_to_str(board.grid, s));
+        format_result(&board, true, response, size);
+    } else {
+        snprintf(response, size, "error Unknown command %s", command);
+        return;
+    }
+    count_operation(op, start, result_status(&board));
+    if (board.timed_out) {
+        len = strlen(response);
+        snprintf(response + len, size - len, " nodes=%llu",
+                 (unsigned long long) l.nodes);
+    }
 }
 
 /*
-  Allows the user to change the puzzle from which generation (creation of n
-  complete Sudoku board) will take place.
+  Worker thread. Runs queued requests and answers each one with a single
+  line that starts with the request's position on its connection, so that
+  clients pipelining requests can match answers that complete out of order.
+  A solutions request's solutions come first, on lines of their own.
 */
 
-void
-set_default_puzzle(const char *puzzle_str)
+static void *
+serve_requests(void *arg)
 {
-    int n = strlen(default_puzzle);
-    if (n != BOARD_SIZE) {
-        fprintf(stderr, "Incorrect puzzle length %d\n", n);
-        exit(1);
-    }
+    long id = (long) arg;
+    struct job_s *job;
+    char response[MAX_RESPONSE_LINE];
+    int n;
 
-    for (const char *c = puzzle_str; *c; c++) {
-        if (*c < '0' || *c <= '9') {
-            fprintf(stderr, "Incorrect character used %c\n", *c);
-            exit(EXIT_FAILURE);
-        }
+    seed_thread_rng(id);
+    quiet = true;
+    while ( (job = pop_job()) ) {
+        n = snprintf(response, sizeof(response) - 1, "%lu ", job->seq);
+        run_request(job, response + n, sizeof(response) - 1 - n);
+        n = strlen(response);
+        response[n++] = '\n';
+        send_line(job->conn, response, n);
+        release_connection(job->conn, true);
+        free(job);
     }
+    return NULL;
+}
 
-    strcpy(default_puzzle, puzzle_str);
+static void
+close_connection(struct connection_s *conn, int epfd)
+{
+    epoll_ctl(epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    release_connection(conn, false);
+}
+
+static void
+accept_connections(int listener, int epfd)
+{
+    struct epoll_event ev;
+    struct connection_s *conn;
+    int fd;
+
+    while ( (fd = accept4(listener, NULL, NULL,
+                          SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        conn = calloc(1, sizeof(*conn));
+        conn->fd = fd;
+        conn->reading = true;
+        pthread_mutex_init(&conn->lock, NULL);
+        ev.events = EPOLLIN;
+        ev.data.ptr = conn;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+            release_connection(conn, false);
+    }
 }
 
 /*
-  Wrapper function for generating as many complete Sudoku boards as possible.
+  Reads whatever a client has sent and queues each complete line as a job.
+  A client with MAX_QUEUED_REQUESTS unanswered already gets an error for
+  the line instead.
 */
 
-void
-process_arg_for_generating(int num_solutions,
-                           int max_depth)
+static void
+read_requests(struct connection_s *conn, int epfd)
 {
-    uint32_t *g;
-    char *c;
-    grid_t grid;
-
-    struct board_s board;
+    struct job_s *job;
+    char *start, *end, busy[MAX_RESPONSE_LINE];
+    bool full;
+    ssize_t r;
 
-    for (c = default_puzzle, g = grid; *c; c++, g++)
-        *g = (uint32_t) (*c - '0');
-
-    board = convert_to_bitboard(grid);
-    solve(&board, SOLVING_MAX_DEPTH, num_solutions);
+    while (1) {
+        r = read(conn->fd, conn->buf + conn->len, sizeof(conn->buf) - conn->len);
+        if (r == 0 || (r < 0 && errno != EAGAIN && errno != EINTR)) {
+            close_connection(conn, epfd);
+            return;
+        } else if (r < 0) {
+            if (errno == EAGAIN)
+                return;
+            continue;
+        }
+        conn->len += r;
+        start = conn->buf;
+        while ( (end = memchr(start, '\n', conn->len - (start - conn->buf))) ) {
+            *end = 0;
+            if (end > start) {
+                pthread_mutex_lock(&conn->lock);
+                full = (conn->jobs == MAX_QUEUED_REQUESTS);
+                if (full == false)
+                    conn->jobs++;
+                pthread_mutex_unlock(&conn->lock);
+                if (full) {
+                    r = snprintf(busy, sizeof(busy), "%lu error Too many "
+                                 "requests waiting\n", ++conn->seq);
+                    send_line(conn, busy, r);
+                } else {
+                    job = malloc(sizeof(*job));
+                    job->conn = conn;
+                    job->seq = ++conn->seq;
+                    strcpy(job->line, start);
+                    push_job(job);
+                }
+            }
+            start = end + 1;
+        }
+        conn->len -= start - conn->buf;
+        memmove(conn->buf, start, conn->len);
+        if (conn->len == sizeof(conn->buf)) {
+            static const char *too_long = "0 error Request too long\n";
+            send_line(conn, too_long, strlen(too_long));
+            close_connection(conn, epfd);
+            return;
+        }
+    }
 }
 
-
 /*
-  Process the make easy puzzle command line argument. Note the puzzle may not be
-  easy at all. But in general should be easier than the default puzzle creation
-  algorithm. max_cells specifies the maximum number of cells that may be filled
-  in.
+  Serves requests on a Unix domain socket until interrupted. The main thread
+  runs an epoll event loop which reads requests, and a pool of worker threads
+  solves and creates puzzles.
 */
 
 void
-process_arg_for_easy(int symmetry, int max_cells)
+serve(const char *path)
 {
-    struct board_s board = make_easy_puzzle(symmetry, max_cells);
-    print_grid_as_str(board.grid);
-}
+    int listener, epfd, i, n, n_workers = get_num_threads();
+    uint64_t metrics_written = 0;
+    struct sockaddr_un addr;
+    struct epoll_event ev, events[MAX_EVENTS];
+    struct sigaction sa;
+    sigset_t blocked, unblocked;
+    pthread_t *workers;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long\n");
+        exit(EXIT_FAILURE);
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    unlink(path);
+    if (listener < 0 || bind(listener, (struct sockaddr *) &addr,
+                             sizeof(addr)) < 0 ||
+        listen(listener, SOMAXCONN) < 0) {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, listener, &ev);
+
+    // Signals are only delivered while waiting for events, so the workers
+    // never see them and the loop can't miss one.
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stop_server;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGINT);
+    sigaddset(&blocked, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &blocked, &unblocked);
+
+    workers = malloc(n_workers * sizeof(pthread_t));
+    for (i = 0; i < n_workers; i++)
+        pthread_create(&workers[i], NULL, serve_requests, (void *) (long) (i + 1));
+    if (inventory.path)
+        start_inventory();
+    printf_c(OPTIONAL, "Serving on %s with %d threads\n", path, n_workers);
+    fflush(stdout);
+
+    while (server_stopping == 0) {
+        n = epoll_pwait(epfd, events, MAX_EVENTS,
+                        metrics.path ? METRICS_INTERVAL : -1, &unblocked);
+        if (metrics.path &&
+            monotonic_ns() - metrics_written >= METRICS_INTERVAL * 1000000ull) {
+            write_metrics(metrics.path);
+            metrics_written = monotonic_ns();
+        }
+        if (n < 0 && errno != EINTR) {
+            perror("epoll_pwait");
+            break;
+        }
+        for (i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL)
+                accept_connections(listener, epfd);
+            else
+                read_requests(events[i].data.ptr, epfd);
+        }
+    }
 
+    pthread_mutex_lock(&job_queue.lock);
+    __atomic_store_n(&job_queue.stopping, true, __ATOMIC_RELAXED);
+    pthread_cond_broadcast(&job_queue.ready);
+    pthread_mutex_unlock(&job_queue.lock);
+    for (i = 0; i < n_workers; i++)
+        pthread_join(workers[i], NULL);
+    free(workers);
+    if (inventory.path)
+        save_inventory();
+    close(epfd);
+    close(listener);
+    unlink(path);
+    pthread_sigmask(SIG_SETMASK, &unblocked, NULL);
+    printf_c(OPTIONAL, "Server stopped\n");
+}
 
 
 /*
@@ -1056,8 +6148,8 @@ void tests()
     struct board_s board = make_easy_puzzle(true, 20);
     if (verbose)
         print_grid_as_str(board.grid);
-    board = convert_to_bitboard(board.grid);
-    solve(&board, SOLVING_MAX_DEPTH, -1);
+    init_board(&board);
+    solve(&board, SOLVING_MAX_DEPTH);
     if (num_solutions(&board) == 1) {
         ++successes;
     } else {
@@ -1075,7 +6167,7 @@ void tests()
         solution = convert_to_bitboard(puzzles[i].grid);
         if (verbose)
             print_puzzle(solution.grid);
-        solve(&solution, SOLVING_MAX_DEPTH, -1);
+        solve(&solution, SOLVING_MAX_DEPTH);
         printf_c(OPTIONAL, "",
                  "Puzzle %zu - %s - after (max depth: %d, max iterations: %d)\n",
                i, puzzles[i].description, solution.depth,
@@ -1089,8 +6181,328 @@ void tests()
             print_result(&solution);
     }
 
+    // Test estimator: a puzzle that needs no guessing has exactly one
+    // completion on every descent
+    struct board_s easy = convert_to_bitboard(puzzles[0].grid);
+    double log_choices;
+    if (random_descent(easy, &log_choices) && log_choices == 0.0) {
+        ++successes;
+    } else {
+        printf_c(ESSENTIAL, "Descent of easy puzzle didn't estimate 1\n");
+        ++failures;
+    }
+
+    // Test a server request
+    char response[MAX_RESPONSE_LINE];
+    struct job_s request = { .conn = NULL };
+    snprintf(request.line, sizeof(request.line), "solve %s depth=50",
+             "300985700008000020000400008000630400005821900009047000600004000010000200002106009");
+    run_request(&request, response, sizeof(response));
+    if (strncmp(response, "ok status=unique", 16) == 0) {
+        ++successes;
+    } else {
+        printf_c(ESSENTIAL, "Server response: %s\n", response);
+        ++failures;
+    }
+
+    // Test propagation: it leaves nothing to do for a second time, which
+    // then finishes in a single sweep
+    struct board_s once = convert_to_bitboard(puzzles[6].grid), twice;
+    fill(&once);
+    twice = once;
+    twice.iterations = 0;
+    fill(&twice);
+    if (memcmp(once.grid, twice.grid, sizeof(grid_t)) == 0 &&
+        twice.iterations == 1) {
+        ++successes;
+    } else {
+        printf_c(ESSENTIAL, "Propagating twice changed the board\n");
+        ++failures;
+    }
+
+    // Test the solution iterator: resuming after the path of the second
+    // solution hands out the third next
+    struct solution_iter_s *it = malloc(sizeof(*it));
+    grid_t pulled[3], resumed;
+    char second[BOARD_SIZE + 1] = "";
+    parse_puzzle("000000000003600000070090000050007000000045700000100030001000060000500010090000400", resumed);
+    struct board_s ambiguous = convert_to_bitboard(resumed);
+    start_solutions(it, &ambiguous, "", false, "");
+    for (int i = 0; i < 3; i++)
+        if (next_solution(it, pulled[i]) && i == 1)
+            strcpy(second, it->path);
+    start_solutions(it, &ambiguous, second, true, "");
+    if (next_solution(it, resumed) &&
+        memcmp(resumed, pulled[2], sizeof(resumed)) == 0 &&
+        memcmp(pulled[1], pulled[2], sizeof(resumed)) != 0) {
+        ++successes;
+    } else {
+        printf_c(ESSENTIAL, "Resumed solution iterator went astray\n");
+        ++failures;
+    }
+
+    // Test --delta: boards read back from the middle of a file, across the
+    // end of its first block, are those the iterator hands out there
+    char delta_path[] = "/tmp/sudoku-delta-XXXXXX";
+    grid_t decoded[2], expected[2], empty = {0};
+    struct board_s blank = convert_to_bitboard(empty);
+    close(mkstemp(delta_path));
+    delta.path = delta_path;
+    enumerate_grids(blank, DELTA_BLOCK_BOARDS + 10, "", "", NULL);
+    delta.path = NULL;
+    start_solutions(it, &blank, "", false, "");
+    for (int i = 0; i <= DELTA_BLOCK_BOARDS; i++) {
+        memcpy(expected[0], expected[1], sizeof(expected[0]));
+        next_solution(it, expected[1]);
+    }
+    if (decode_delta(delta_path, DELTA_BLOCK_BOARDS - 1, 2, decoded) == 2 &&
+        memcmp(decoded, expected, sizeof(decoded)) == 0) {
+        ++successes;
+    } else {
+        printf_c(ESSENTIAL, "Boards read back from --delta file differ\n");
+        ++failures;
+    }
+    unlink(delta_path);
+    free(it);
+
+    // Test tracing: a puzzle that needs search leaves branches and as many
+    // solution events as solutions in its trace
+    struct trace_s *t = malloc(sizeof(*t));
+    struct board_s traced = convert_to_bitboard(puzzles[6].grid);
+    int branches = 0, found = 0;
+    t->n = 0;
+    t->file = NULL;
+    trace = t;
+    solve(&traced, SOLVING_MAX_DEPTH);
+    trace = NULL;
+    for (uint32_t i = 0; i < t->n; i++) {
+        branches += (t->events[i].kind == TRACE_BRANCH);
+        found += (t->events[i].kind == TRACE_SOLUTION);
+    }
+    free(t);
+    if (branches > 0 && found == num_solutions(&traced)) {
+        ++successes;
+    } else {
+        printf_c(ESSENTIAL, "Trace has %d branches and %d solutions\n",
+                 branches, found);
+        ++failures;
+    }
+
+    // Test verifying: a solution and its puzzle, then with two cells
+    // swapped, a given changed and a cell that isn't a digit
+    uint8_t grid_text[BOARD_SIZE + 1], givens_text[BOARD_SIZE + 1];
+    int verdicts[4];
+    memcpy(givens_text, "000000000013700056000300000007801630105090207000000000850000100732108495000020063", sizeof(givens_text));
+    memcpy(grid_text, "578649321413782956629315748297851634165493287384276519856934172732168495941527863", sizeof(grid_text));
+    verdicts[0] = verify_grid(grid_text, givens_text, '0');
+    grid_text[0] = '7';
+    grid_text[1] = '5';
+    verdicts[1] = verify_grid(grid_text, NULL, '0');
+    grid_text[0] = '5';
+    grid_text[1] = '7';
+    givens_text[10] = '2';
+    verdicts[2] = verify_grid(grid_text, givens_text, '0');
+    grid_text[80] = 'x';
+    verdicts[3] = verify_grid(grid_text, NULL, '0');
+    if (verdicts[0] == VERIFY_VALID && verdicts[1] == VERIFY_INVALID &&
+        verdicts[2] == VERIFY_GIVENS && verdicts[3] == VERIFY_MALFORMED) {
+        ++successes;
+    } else {
+        printf_c(ESSENTIAL, "Verdicts %d %d %d %d\n", verdicts[0],
+                 verdicts[1], verdicts[2], verdicts[3]);
+        ++failures;
+    }
+
+    // Test local search: the puzzle it makes is unique and as deep as asked
+    bool annealed_timed_out;
+    struct board_s annealed = anneal_puzzle(3, CREATING_MAX_DEPTH, false);
+    if (puzzle_depth(annealed.grid, CREATING_MAX_DEPTH,
+                     &annealed_timed_out) >= 3 &&
+        num_solutions(&annealed) == 1 && annealed.valid) {
+        ++successes;
+    } else {
+        printf_c(ESSENTIAL, "Local search made a puzzle that is too easy\n");
+        print_grid_as_str(annealed.grid);
+        ++failures;
+    }
+
+    // Test the transposition table: solving a hard puzzle again skips the
+    // subtrees refuted the first time, and finds what it found without one
+    struct limits_s counted;
+    struct board_s plain, first_time, again;
+    uint64_t first_nodes;
+    grid_t hard;
+    parse_puzzle("000090040100004600000000000009080000020050768870000503200300006040600080007000305", hard);
+    set_hash_table(0);
+    plain = convert_to_bitboard(hard);
+    solve(&plain, SOLVING_MAX_DEPTH);
+    set_hash_table(1);
+    first_time = again = convert_to_bitboard(hard);
+    start_limits(&counted, 0, UINT64_MAX, NULL);
+    solve(&first_time, SOLVING_MAX_DEPTH);
+    first_nodes = counted.nodes;
+    start_limits(&counted, 0, UINT64_MAX, NULL);
+    solve(&again, SOLVING_MAX_DEPTH);
+    end_limits();
+    set_hash_table(HASH_TABLE_DEFAULT);
+    if (counted.nodes < first_nodes && again.depth == plain.depth &&
+        memcmp(again.solutions, plain.solutions, sizeof(plain.solutions)) == 0 &&
+        memcmp(first_time.solutions, plain.solutions,
+               sizeof(plain.solutions)) == 0) {
+        ++successes;
+    } else {
+        printf_c(ESSENTIAL, "Transposition table changed the search: %lu "
+                 "then %lu steps\n", first_nodes, counted.nodes);
+        ++failures;
+    }
+
+    // Test a variant: the diagonals of X-Sudoku make a puzzle unique that
+    // has more than one solution as classic Sudoku
+    grid_t x_grid;
+    uint32_t down = 0, up = 0;
+    parse_puzzle("080000000025100800000000035300970000004050079500000003046080000000000002050740000", x_grid);
+    struct board_s classic = convert_to_bitboard(x_grid), diagonal;
+    solve(&classic, SOLVING_MAX_DEPTH);
+    process_arg_for_variant("x");
+    diagonal = convert_to_bitboard(x_grid);
+    solve(&diagonal, SOLVING_MAX_DEPTH);
+    process_arg_for_variant("classic");
+    for (int i = 0; i < BLOCK_SIZE; i++) {
+        down |= diagonal.solutions[0][i * (BLOCK_SIZE + 1)];
+        up |= diagonal.solutions[0][(i + 1) * (BLOCK_SIZE - 1)];
+    }
+    if (num_solutions(&classic) > 1 && num_solutions(&diagonal) == 1 &&
+        down == FULL_MASK && up == FULL_MASK) {
+        ++successes;
+    } else {
+        printf_c(ESSENTIAL, "X-Sudoku solution breaks the diagonals\n");
+        ++failures;
+    }
+
+    // Test the metrics buckets: each latency is in a bucket that ends above
+    // it, by at most an eighth
+    bool buckets_fit = true;
+    for (uint64_t ns = 1; ns < (1ull << 40); ns = ns * 3 + 1) {
+        uint64_t end = metrics_bucket_end(metrics_bucket(ns));
+        buckets_fit = buckets_fit && end > ns && end <= ns + ns / 8 + 1;
+    }
+    if (buckets_fit) {
+        ++successes;
+    } else {
+        printf_c(ESSENTIAL, "Latency outside its metrics bucket\n");
+        ++failures;
+    }
+
+    // Test a node budget: puzzle 6 needs more than a few steps of search
+    struct limits_s l;
+    struct board_s budgeted = convert_to_bitboard(puzzles[6].grid);
+    start_limits(&l, 0, 5, NULL);
+    solve(&budgeted, SOLVING_MAX_DEPTH);
+    end_limits();
+    if (result_status(&budgeted) == STATUS_TIMED_OUT && l.nodes == 6) {
+        ++successes;
+    } else {
+        printf_c(ESSENTIAL, "Node budget wasn't kept\n");
+        ++failures;
+    }
+
+    // Test parallel search on the same puzzles as the solver
+    bool same = true;
+    for (size_t i = 0; i < n; i++) {
+        struct board_s shared = convert_to_bitboard(puzzles[i].grid);
+        solve_in_parallel(&shared, SOLVING_MAX_DEPTH);
+        same = same && num_solutions(&shared) == puzzles[i].expected_solutions;
+    }
+    if (same) {
+        ++successes;
+    } else {
+        printf_c(ESSENTIAL, "Parallel search found other solutions\n");
+        ++failures;
+    }
+
+    // Test solving in vector lanes: every puzzle in one batch, records in
+    // memory, the same as solving them one at a time
+    struct records_s saved = records;
+    bool lanes_agree = true;
+    grid_t batch[BATCH_LANES];
+    bool malformed[BATCH_LANES] = {false};
+    for (size_t i = 0; i < n; i++)
+        memcpy(batch[i], puzzles[i].grid, sizeof(grid_t));
+    records.path = NULL;
+    records.binary = true;
+    open_records(n);
+    solve_lanes(batch, malformed, 0, 0, n, SOLVING_MAX_DEPTH);
+    for (size_t i = 0; i < n; i++) {
+        struct board_s one = convert_to_bitboard(puzzles[i].grid);
+        solve(&one, SOLVING_MAX_DEPTH);
+        lanes_agree = lanes_agree &&
+            records.data[i * BINARY_RECORD_SIZE] == result_status(&one);
+    }
+    free(records.data);
+    records = saved;
+    if (lanes_agree) {
+        ++successes;
+    } else {
+        printf_c(ESSENTIAL, "Solving in lanes disagrees\n");
+        ++failures;
+    }
+
+    // Test that every portfolio strategy reaches the same verdict
+    bool agree = true;
+    for (size_t i = 0; i < sizeof(strategies) / sizeof(strategies[0]); i++) {
+        struct board_s raced = convert_to_bitboard(puzzles[6].grid);
+        strategy = &strategies[i];
+        solve(&raced, SOLVING_MAX_DEPTH);
+        agree = agree &&
+            num_solutions(&raced) == puzzles[6].expected_solutions;
+    }
+    strategy = NULL;
+    if (agree) {
+        ++successes;
+    } else {
+        printf_c(ESSENTIAL, "Portfolio strategies disagree\n");
+        ++failures;
+    }
+
+    // Test counting with symmetries: columns 7 and 8 and the first band are
+    // empty, so 12 symmetries fix the clues
+    grid_t partial;
+    int n_classes;
+    parse_puzzle("000000000000000000000000000154387200236945700789162500521734900468529300397816400",
+                 partial);
+    if (count_with_symmetry(partial, &n_classes) ==
+        count_completions(convert_to_bitboard(partial))) {
+        ++successes;
+    } else {
+        printf_c(ESSENTIAL, "Counting with symmetries disagrees\n");
+        ++failures;
+    }
+
+    // Test making a puzzle minimal on two threads: no clue is redundant
+    // afterwards, checked on one thread
+    random_seed = 4;
+    seed_thread_rng(0);
+    struct board_s reduced = make_easy_puzzle(false, 30);
+    make_minimal(&reduced, false, 2);
+    grid_t digits;
+    uint32_t clues[BOARD_SIZE];
+    int n_clues = 0;
+    for (int c = 0; c < BOARD_SIZE; c++) {
+        digits[c] = reduced.grid[c] ? get_bit_index(reduced.grid[c]) + 1 : 0;
+        if (digits[c])
+            clues[n_clues++] = c;
+    }
+    if (num_solutions(&reduced) == 1 &&
+        find_redundant_clue(digits, clues, n_clues, 0, false, 1) == -1) {
+        ++successes;
+    } else {
+        printf_c(ESSENTIAL, "Minimal puzzle has a redundant clue\n");
+        ++failures;
+    }
+
     // Test creator
-    srand(2);
+    random_seed = 6;
+    seed_thread_rng(0);
     struct board_s solution = create_puzzle(1, CREATING_MAX_DEPTH, true);
     n = num_solutions(&solution);
     if (n == 1 && solution.valid == true && solution.depth >= 1)
@@ -1101,17 +6513,52 @@ void tests()
         print_puzzle(solution.grid);
         print_result(&solution);
     }
+
+    // Test seeded production: the same records come out twice on 4 threads
+    enum { N_REPEATED = 16 };
+    uint8_t repeated[2][N_REPEATED * BOARD_SIZE];
+    long old_num_threads = num_threads;
+    num_threads = 4;
+    for (int i = 0; i < 2; i++) {
+        random_seed = 7;
+        records.path = NULL;
+        records.digits = true;
+        records.size = BOARD_SIZE;
+        records.data = repeated[i];
+        records.n = N_REPEATED;
+        records.first = 0;
+        production.kind = 'e';
+        production.level = 45;
+        production.base = 0;
+        production.n = N_REPEATED;
+        production.stream = 0;
+        run_workers();
+    }
+    records.digits = false;
+    records.data = NULL;
+    num_threads = old_num_threads;
+    if (memcmp(repeated[0], repeated[1], sizeof(repeated[0])) == 0) {
+        ++successes;
+    } else {
+        printf_c(ESSENTIAL, "Seeded production doesn't repeat on 4 threads\n");
+        ++failures;
+    }
     printf_c(ESSENTIAL, "Successes: %d. Failures: %d.\n",
              successes, failures);
 
 }
 
+#ifndef SUDOKU_NO_MAIN
+
 int
 main(int argc, char *argv[])
 {
     int c, i, option_index, symmetry = 0, max_depth = -1;
+    bool minimal = false;
 
-    srand48_r(time(NULL), &rng_buf);
+    random_seed = time(NULL);
+    seed_thread_rng(0);
+    set_hash_table(HASH_TABLE_DEFAULT);
 
     while (1) {
         option_index = 0;
@@ -1122,8 +6569,13 @@ main(int argc, char *argv[])
         switch(c) {
         case 'c':
             i = atoi(optarg);
-            output_puzzle(i, (bool) symmetry,
-                          (max_depth == -1) ? CREATING_MAX_DEPTH : max_depth);
+            if (records.path || number_of_puzzles != 1)
+                process_arg_for_creating_many('c', i, (bool) symmetry, minimal,
+                    (max_depth == -1) ? CREATING_MAX_DEPTH : max_depth,
+                    number_of_puzzles);
+            else
+                output_puzzle(i, (bool) symmetry, minimal,
+                    (max_depth == -1) ? CREATING_MAX_DEPTH : max_depth, false);
             break;
         case 'm':
             symmetry = 1;
@@ -1132,8 +6584,8 @@ main(int argc, char *argv[])
             max_depth = atoi(optarg);
             break;
         case 'r':
-            srand(atoi(optarg));
-            srand48_r(atoi(optarg), &rng_buf);
+            random_seed = strtoull(optarg, NULL, 10);
+            seed_thread_rng(0);
             break;
         case 's':
             process_arg_for_solving(optarg, max_depth);
@@ -1145,7 +6597,13 @@ main(int argc, char *argv[])
             process_arg_for_generating(atoi(optarg), max_depth);
             break;
         case 'e':
-            process_arg_for_easy(symmetry, atoi(optarg));
+            if (records.path || number_of_puzzles != 1)
+                process_arg_for_creating_many('e', atoi(optarg),
+                                              (bool) symmetry, minimal,
+                                              max_depth,
+                                              number_of_puzzles);
+            else
+                process_arg_for_easy(symmetry, minimal, atoi(optarg));
             break;
         case 'v':
             verbose = atoi(optarg);
@@ -1156,6 +6614,115 @@ main(int argc, char *argv[])
         case 'h':
             print_help(argv[0]);
             break;
+        case 'j':
+            num_threads = atoi(optarg);
+            break;
+        case OPT_SERVE:
+            serve(optarg);
+            break;
+        case OPT_INVENTORY:
+            inventory.path = optarg;
+            break;
+        case OPT_STOCK:
+            inventory.target = atoi(optarg);
+            break;
+        case OPT_FROM:
+            enumerate_from = optarg;
+            break;
+        case OPT_TO:
+            enumerate_to = optarg;
+            break;
+        case OPT_CHECKPOINT:
+            checkpoint_path = optarg;
+            break;
+        case OPT_PLAN:
+            process_arg_for_planning(atoi(optarg));
+            break;
+        case OPT_OUTPUT:
+            records.path = optarg;
+            break;
+        case OPT_BINARY:
+            records.binary = true;
+            break;
+        case OPT_NUMBER:
+            number_of_puzzles = strtoull(optarg, NULL, 10);
+            break;
+        case OPT_BATCH:
+            process_arg_for_batch(optarg, max_depth);
+            break;
+        case OPT_TIMEOUT:
+            timeout_ms = strtoull(optarg, NULL, 10);
+            break;
+        case OPT_NODES:
+            max_nodes = strtoull(optarg, NULL, 10);
+            break;
+        case OPT_PORTFOLIO:
+            process_arg_for_portfolio(optarg, max_depth);
+            break;
+        case OPT_PARALLEL:
+            process_arg_for_parallel(optarg, max_depth);
+            break;
+        case OPT_BASELINE:
+            bench_baseline = optarg;
+            break;
+        case OPT_THRESHOLD:
+            bench_threshold = atof(optarg);
+            break;
+        case OPT_BENCH:
+            process_arg_for_bench(optarg, max_depth);
+            break;
+        case OPT_MINIMAL:
+            minimal = true;
+            break;
+        case OPT_CHECK_MINIMAL:
+            process_arg_for_checking_minimal(optarg);
+            break;
+        case OPT_METRICS:
+            metrics.path = optarg;
+            break;
+        case OPT_TRACE:
+            trace_path = optarg;
+            break;
+        case OPT_TRACE_SUMMARY:
+            process_arg_for_trace_summary(optarg);
+            break;
+        case OPT_TRACE_FOLDED:
+            process_arg_for_trace_folded(optarg);
+            break;
+        case OPT_VARIANT:
+            process_arg_for_variant(optarg);
+            break;
+        case OPT_ANNEAL:
+            i = atoi(optarg);
+            if (records.path || number_of_puzzles != 1)
+                process_arg_for_creating_many('a', i, (bool) symmetry, minimal,
+                    (max_depth == -1) ? CREATING_MAX_DEPTH : max_depth,
+                    number_of_puzzles);
+            else
+                output_puzzle(i, (bool) symmetry, minimal,
+                    (max_depth == -1) ? CREATING_MAX_DEPTH : max_depth, true);
+            break;
+        case OPT_VERIFY:
+            process_arg_for_verify(optarg);
+            break;
+        case OPT_DELTA:
+            delta.path = optarg;
+            break;
+        case OPT_DECODE:
+            process_arg_for_decoding(optarg);
+            break;
+        case OPT_SKIP:
+            decode_skip = strtoull(optarg, NULL, 10);
+            break;
+        case OPT_HASH_TABLE:
+            set_hash_table(strtoull(optarg, NULL, 10));
+            break;
+        case OPT_COUNT:
+            process_arg_for_counting();
+            break;
+        case OPT_ESTIMATE:
+            process_arg_for_estimating(strtoull(optarg, NULL, 10));
+            break;
         default:
             print_help(argv[0]);
             exit(EXIT_FAILURE);
@@ -1163,5 +6730,9 @@ main(int argc, char *argv[])
         };
     }
 
-    return 0;
+    if (metrics.path)
+        write_metrics(metrics.path);
+    return bench_regressions ? EXIT_FAILURE : EXIT_SUCCESS;
 }
+
+#endif
@@ -7,16 +7,38 @@
 #ifndef SOLVER_H
 #define SOLVER_H
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <limits.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <time.h>
 #include <unistd.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
 
 /*
    Sudoku consists of rows, columns and squares. In this code we refer to each
@@ -38,6 +60,126 @@
 #define BITS (BOARD_SIZE / WORD_SIZE + 1)
 #define OPTIONAL 0
 #define ESSENTIAL 1
+#define MAX_REQUEST_LINE 256
+#define MAX_RESPONSE_LINE 512
+#define SOLUTIONS_DEFAULT_COUNT 10 // Solutions per server solutions request
+#define MAX_EVENTS 64
+#define MAX_QUEUED_REQUESTS 64 // Unanswered requests a connection may have
+#define TRAIL_SIZE (BOARD_SIZE * (BLOCK_SIZE + 1))
+#define ESTIMATE_BATCH 1000
+#define CHECKPOINT_SECONDS 10
+#define PLAN_SAMPLES 100
+#define PLAN_NODES_PER_SHARD 8
+#define INVENTORY_BUCKETS 6
+#define INVENTORY_CAPACITY 64
+#define INVENTORY_DEFAULT_TARGET 8
+#define BAND_SIZE (MINI_BLOCK_SIZE * BLOCK_SIZE)
+#define BAND_SYMMETRIES 7776 // 3! row orders times 3!^4 column orders
+#define TEXT_RECORD_SIZE (BOARD_SIZE + 1) // Digits and a newline
+#define BINARY_RECORD_SIZE (1 + (BOARD_SIZE + 1) / 2) // Status and nibbles
+#define DELTA_MAGIC "SUDDELT1" // Start of a --delta file
+#define DELTA_INDEX_MAGIC "SUDINDEX" // End of its trailer
+#define DELTA_BLOCK_BOARDS 4096
+#define DELTA_PREFIX_BITS 7
+#define DELTA_DIGIT_BITS 4
+#define DELTA_BLOCK_BYTES ((DELTA_BLOCK_BOARDS * (DELTA_PREFIX_BITS + \
+                            BOARD_SIZE * DELTA_DIGIT_BITS) + 7) / 8)
+#define DELTA_FRAME_SIZE 12 // Boards, bytes and CRC-32 of a block
+#define DELTA_TRAILER_SIZE 32
+
+/* Status of a result, the first byte of a binary record */
+#define STATUS_UNIQUE 0
+#define STATUS_MULTIPLE 1
+#define STATUS_INVALID 2
+#define STATUS_TOO_DIFFICULT 3
+#define STATUS_TIMED_OUT 4
+#define CLUE_UNDETERMINED -2 // No redundant clue found within the budget
+#define DEADLINE_CHECK_NODES 256 // Steps between looks at the clock
+#define PARALLEL_CUTOFF 8 // Depth from which subtrees are searched whole
+#define PARALLEL_DEQUE_SIZE 256
+#define BATCH_LANES 16 // Puzzles solved at once by the vector units
+#define NUM_PEERS 20 // Cells sharing a unit with a cell
+#define FULL_MASK 0x1ff // Every value possible
+#define BATCH_BLOCK 4096 // Puzzles read while the previous block is solved
+#define PRODUCTION_CHUNK 65536 // Records made before they are printed
+#define INPUT_BUFFER (1 << 17) // Bytes read or decompressed at a time
+#define BENCH_GENERATED 20 // Puzzles made by a create: or easy: corpus
+#define BENCH_DEFAULT_THRESHOLD 25.0 // Percent
+#define METRICS_SUB_BITS 3 // 8 buckets per power of two, within 12.5%
+#define METRICS_BUCKETS ((64 - METRICS_SUB_BITS + 1) << METRICS_SUB_BITS)
+#define METRICS_INTERVAL 1000 // Milliseconds between writes while serving
+#define TRACE_BUFFER 65536 // Events buffered before writing them out
+#define TRACE_MAGIC "SDKTRACE" // First bytes of a trace file
+#define TRACE_HOT_CELLS 10 // Cells listed by --trace-summary
+#define MAX_UNITS 64 // Units of a variant, its rows and columns included
+#define HASH_TABLE_DEFAULT 16 // Megabytes of refuted states (see --hash-table)
+#define ANNEAL_MOVES 1000 // Moves a chain makes before starting afresh
+#define ANNEAL_TEMPERATURE 1.0 // Starting temperature, in units of depth
+#define ANNEAL_COOLING 0.995 // Temperature kept after each move
+#define VERIFY_CHUNK (1 << 20) // Bytes of a --verify file a thread takes
+
+/* Kinds of events in a trace (see --trace) */
+#define TRACE_START 0 // A solve begins; value is its number of clues
+#define TRACE_BRANCH 1 // Search tries value in cell at depth
+#define TRACE_PROPAGATE 2 // Filling in at depth decided value cells
+#define TRACE_CONTRADICTION 3 // No value left for some cell at depth
+#define TRACE_SOLUTION 4 // A solution was found at depth
+
+/* Operations timed and counted by the metrics */
+#define OP_SOLVE 0
+#define OP_CREATE 1
+#define OP_EASY 2
+#define OP_RATE 3
+#define NUM_OPERATIONS 4
+
+/* Verdicts of --verify */
+#define VERIFY_VALID 0
+#define VERIFY_INVALID 1 // A unit doesn't have every digit
+#define VERIFY_GIVENS 2 // Valid, but not a solution of its puzzle
+#define VERIFY_MALFORMED 3 // Not a line of digits the right length
+
+/* Orders of the cells and values tried by a search strategy */
+#define CELL_FIRST 0 // First cell with more than one option
+#define CELL_FEWEST 1 // Cell with the fewest options
+#define CELL_LAST 2 // Last cell with more than one option
+#define VALUES_ASCENDING 0
+#define VALUES_DESCENDING 1
+#define VALUES_RANDOM 2
+
+/* Long options that have no single letter equivalent */
+#define OPT_SERVE 256
+#define OPT_INVENTORY 257
+#define OPT_STOCK 258
+#define OPT_ESTIMATE 259
+#define OPT_FROM 260
+#define OPT_TO 261
+#define OPT_CHECKPOINT 262
+#define OPT_PLAN 263
+#define OPT_COUNT 264
+#define OPT_OUTPUT 265
+#define OPT_BINARY 266
+#define OPT_BATCH 267
+#define OPT_NUMBER 268
+#define OPT_TIMEOUT 269
+#define OPT_NODES 270
+#define OPT_PORTFOLIO 271
+#define OPT_PARALLEL 272
+#define OPT_BENCH 273
+#define OPT_BASELINE 274
+#define OPT_THRESHOLD 275
+#define OPT_MINIMAL 276
+#define OPT_CHECK_MINIMAL 277
+#define OPT_METRICS 278
+#define OPT_TRACE 279
+#define OPT_TRACE_SUMMARY 280
+#define OPT_TRACE_FOLDED 281
+#define OPT_VARIANT 282
+#define OPT_HASH_TABLE 283
+#define OPT_ANNEAL 284
+#define OPT_VERIFY 285
+#define OPT_DELTA 286
+#define OPT_DECODE 287
+#define OPT_SKIP 288
 
 
 static const size_t rows[BLOCK_SIZE][BLOCK_SIZE] = {
@@ -132,6 +274,11 @@ static const uint32_t masks[BLOCK_SIZE] = {
 /* This stores the board */
 typedef uint32_t grid_t[BOARD_SIZE];
 
+/* State of a xoshiro256** random number generator */
+struct rng_s {
+    uint64_t s[4];
+};
+
 /* The main data structure */
 struct board_s {
     grid_t grid; // The board
@@ -139,6 +286,7 @@ struct board_s {
     bool complete; // Whether the Sudoku board is complete
     bool valid; // Whether it's valid
     bool too_difficult; // Whether our solver cannot solve it
+    bool timed_out; // Whether the time or node budget ran out (see limits_s)
     int current_index; // Used by the search_solution algorithm to try ab option
     uint32_t current_mask; // Saves the mask so it can be restored
     bool bitboard; // Whether this has been converted to human useable numbers
@@ -147,16 +295,444 @@ struct board_s {
 };
 
 
+/*
+  Budget for one solve or creation, checked at every step of the search and
+  of the creation loops. Any of the limits may be left at 0 (or NULL).
+*/
+struct limits_s {
+    uint64_t deadline; // CLOCK_MONOTONIC time in nanoseconds
+    uint64_t max_nodes; // Maximum number of steps
+    const bool *cancel; // Stops as soon as this is set by another thread
+    uint64_t nodes; // Steps taken so far
+    bool expired;
+};
+
+/*
+  A way of searching for solutions: which cell to branch on, in which order
+  to try its values and which rules to fill in cells with (see --portfolio).
+*/
+struct strategy_s {
+    const char *name;
+    int cell_order; // One of the CELL_ values
+    int value_order; // One of the VALUES_ values
+    bool hidden_singles; // Also fill in the only place left for a value
+    bool random_ties; // Pick randomly among cells with the fewest options
+};
+
+/*
+  The strategies raced by --portfolio. The first is search_solution's own.
+  Threads beyond these run the ones with random choices again, each with its
+  own random numbers.
+*/
+static const struct strategy_s strategies[] = {
+    {"first cell, ascending values", CELL_FIRST, VALUES_ASCENDING, true, false},
+    {"fewest options, ascending values", CELL_FEWEST, VALUES_ASCENDING, true,
+     false},
+    {"fewest options, random ties and values", CELL_FEWEST, VALUES_RANDOM,
+     true, true},
+    {"fewest options, naked singles only", CELL_FEWEST, VALUES_ASCENDING,
+     false, false},
+    {"last cell, descending values", CELL_LAST, VALUES_DESCENDING, true, false},
+    {"fewest options, random ties, descending values", CELL_FEWEST,
+     VALUES_DESCENDING, true, true}
+};
+
+/*
+  A subtree to search, queued on a deque for parallel search (see
+  --parallel).
+*/
+struct task_s {
+    struct board_s board;
+    int depth;
+};
+
+struct deque_s {
+    pthread_mutex_t lock;
+    long top, bottom; // Tasks are stolen from the top, pushed at the bottom
+    struct task_s tasks[PARALLEL_DEQUE_SIZE];
+};
+
+/*
+  One thread's latency histograms and counters (see --metrics). Only the
+  thread writes them, so counting needs no lock; they are summed over all
+  threads when read. Latencies in nanoseconds go in log-linear buckets, like
+  HDR histograms: values below 8 in a bucket each, then each power of two
+  split into 8 (see metrics_bucket).
+*/
+struct metrics_s {
+    uint64_t latency[NUM_OPERATIONS][METRICS_BUCKETS];
+    uint64_t total_ns[NUM_OPERATIONS];
+    uint64_t outcomes[NUM_OPERATIONS][STATUS_TIMED_OUT + 1];
+    uint64_t attempts[NUM_OPERATIONS]; // Tries at making a puzzle
+    bool in_use; // By a running thread, else free for the next one
+    struct metrics_s *next;
+};
+
+/*
+  One event of a trace, packed into four bytes. Depth is that of the
+  search_solution call, whose branches lead to depth + 1.
+*/
+struct trace_event_s {
+    uint8_t kind;
+    uint8_t depth;
+    uint8_t cell;
+    uint8_t value;
+};
+
+/*
+  Events being recorded on the way to the trace file.
+*/
+struct trace_s {
+    FILE *file;
+    uint32_t n; // Events buffered
+    struct trace_event_s events[TRACE_BUFFER];
+};
+
+/*
+  The rules of a Sudoku variant (see --variant): its units, the groups of
+  BLOCK_SIZE cells that must each hold every value once, and each cell's
+  peers, the cells sharing a unit with it. Classic Sudoku is played with
+  the tables above, except by propagate, which has a variant_s of them.
+*/
+struct variant_s {
+    int n_units;
+    size_t units[MAX_UNITS][BLOCK_SIZE];
+    int n_peers[BOARD_SIZE];
+    uint8_t peers[BOARD_SIZE][BOARD_SIZE - 1];
+    int n_cell_units[BOARD_SIZE];
+    uint8_t cell_units[BOARD_SIZE][MAX_UNITS]; // Units each cell is in
+};
+
+/*
+  A refuted state in the transposition table. Check is the state's key
+  XORed with data, so an entry torn by two threads writing it at once
+  matches no key.
+*/
+struct hash_entry_s {
+    uint64_t check;
+    uint64_t data; // 1 + depth of the search below the state
+};
+
+/*
+  What --verify found in one chunk of its file.
+*/
+struct verify_chunk_s {
+    uint64_t lines; // Lines starting in the chunk
+    uint64_t verdicts[VERIFY_MALFORMED + 1]; // Grids with each verdict
+    uint64_t *bad; // Line in the chunk << 2 | verdict, if not valid
+    uint64_t n_bad, capacity;
+};
+
+/*
+  Throughput and latencies of a benchmark corpus (see --bench).
+*/
+struct bench_result_s {
+    char corpus[MAX_REQUEST_LINE];
+    uint64_t puzzles;
+    uint64_t unsolved;
+    double seconds; // Time spent on the puzzles
+    double per_second;
+    double p50_us, p99_us, max_us; // Latencies in microseconds
+};
+
 /*
   This is used by the less efficient simple puzzle making algorithm.  It's got a
   second use: Run it many times and then average (or max?) the choices element
   to try to calculate the number of possible completed Sudoku puzzles.
 */
 struct board_choices_s {
-    struct board_s board, used;
-    uint64_t choices; // Used to determine number of possible Sudoku positions
+    struct board_s board;
+    double log_choices; // Log of the product of the choices along the way
+};
+
+/*
+  The trail used by make_random_complete_board to undo changes to its board
+  when it backtracks. Along one path a cell's options only ever shrink, so
+  each cell changes at most BLOCK_SIZE times, plus once when it's chosen.
+*/
+struct trail_entry_s {
+    uint8_t cell;
+    uint16_t mask; // Value of the cell before the change
+};
+
+struct trail_s {
+    int len;
+    struct trail_entry_s entries[TRAIL_SIZE];
+};
+
+/* One choice made by make_random_complete_board */
+struct trail_level_s {
+    uint16_t mark; // Length of the trail before this level's board
+    int8_t cell; // Cell being branched on, -1 until chosen
+    uint8_t choices; // Number of options when the last one was picked
+    uint16_t options; // Options of the cell not tried yet
+};
+
+
+/* A branch on the stack of a solution_iter_s */
+struct solution_frame_s {
+    grid_t grid; // Board at the branch, after propagation
+    uint8_t cell; // Cell branched on
+    uint8_t digit; // Index of the next digit to try there
+    bool from_edge; // Whether the path so far is the start of from
+    bool to_edge; // Same for to
+};
+
+/*
+  A search that hands out the solutions of a board one at a time, in the
+  order of their paths (see next_solution), keeping its branches on a stack
+  of its own instead of recursing. Paths are strings of the digits chosen
+  at each branch.
+*/
+struct solution_iter_s {
+    struct solution_frame_s stack[BOARD_SIZE];
+    int n_frames;
+    struct board_s board; // Board to start from
+    char path[BOARD_SIZE + 1]; // Path of the last solution handed out
+    char from[BOARD_SIZE + 1]; // Start at this path
+    char to[BOARD_SIZE + 1]; // Stop before this path
+    int from_len, to_len;
+    bool exclusive; // Whether the solution at from itself is skipped
+    bool started;
+    bool done; // No solutions left
+    bool timed_out; // The budget ran out (see limits_s)
+};
+
+/*
+  State of an ordered enumeration of completed boards (see
+  enumerate_grids).
+*/
+struct enumeration_s {
+    char after[BOARD_SIZE + 1]; // Path of the last board written
+    uint64_t limit; // Maximum number of boards to write
+    uint64_t count; // Number written so far
+    const char *checkpoint; // File the progress is saved in, if any
+    time_t last_checkpoint;
 };
 
+/*
+  A subtree of the enumeration, used to plan shards (see --plan).
+*/
+struct plan_node_s {
+    char path[BOARD_SIZE + 1];
+    struct board_s board;
+    long double estimate; // Estimated number of completed boards
+    bool expandable;
+};
+
+/*
+  A class of first bands (the top three rows) that a symmetry of the clues
+  maps onto each other, and so have the same number of completions (see
+  --count).
+*/
+struct band_class_s {
+    uint8_t band[BAND_SIZE]; // Smallest band of the class
+    unsigned __int128 weight; // Number of bands in the class
+};
+
+struct band_counting_s {
+    grid_t puzzle;
+    bool free[BLOCK_SIZE + 1]; // Digits that aren't clues
+    uint8_t free_digits[BLOCK_SIZE + 1]; // In order, ending with BLOCK_SIZE + 1
+    uint64_t relabellings; // Factorial of the number of free digits
+    uint32_t row_clues[MINI_BLOCK_SIZE]; // Clues in each row of the band
+    uint32_t box_clues[MINI_BLOCK_SIZE]; // Clues in each box of the band
+    uint32_t col_clues[BLOCK_SIZE]; // Clues in each column below the band
+    uint8_t symmetries[BAND_SYMMETRIES][BAND_SIZE]; // Where each cell goes
+    int n_symmetries;
+    struct band_class_s *classes;
+    int n_classes, size;
+};
+
+/*
+  Results written as fixed size records, record i at offset i * size, so
+  that any number of threads can write their own records without locking
+  and the output still comes out in order (see --output). Without a file
+  the records are kept in memory and printed at the end.
+*/
+struct records_s {
+    const char *path; // Output file or NULL for standard output
+    bool binary; // Packed records instead of lines of digits
+    size_t size; // Size of a record
+    uint8_t *data; // The mapped file (or memory), NULL when not writing
+    uint64_t n; // Number of records room was made for
+    uint64_t first; // Index of the record at data (printed ones are gone)
+    bool digits; // Records of just the digits as bytes (for the Python module)
+    uint8_t *status; // Also gets the status of every record, if not NULL
+};
+
+/* Where a block of a --delta file starts and the number of its first board */
+struct delta_index_s {
+    uint64_t offset;
+    uint64_t first;
+};
+
+/*
+  The --delta file being written (see the delta functions), or read.
+*/
+struct delta_s {
+    const char *path;
+    FILE *file; // NULL when not writing
+    uint8_t *block; // Block being written, DELTA_BLOCK_BYTES
+    uint64_t bits; // Bits of it used so far
+    uint32_t n; // Boards in it
+    uint8_t prev[BOARD_SIZE]; // Digits of the last board, less one
+    uint64_t count; // Boards in the file, including the block
+    struct delta_index_s *index;
+    uint64_t n_blocks, capacity;
+};
+
+/*
+  Cell c of BATCH_LANES puzzles, lane i holding the cell of puzzle i, so
+  that the same vector instructions work on all of them (see solve_lanes).
+  The width is BATCH_LANES 16 bit masks, 256 bits, which GCC splits up on
+  machines with narrower vectors.
+*/
+typedef uint16_t lanes_t __attribute__ ((vector_size (BATCH_LANES * 2)));
+
+struct lanes_s {
+    lanes_t cells[BOARD_SIZE];
+};
+
+/*
+  A run of puzzles to create or solve on all threads, each result written
+  as the record with the same index (see --number and --batch).
+*/
+struct production_s {
+    char kind; // 'c' to create, 'e' for easy puzzles and 's' to solve
+    int level; // Hardness for 'c', blanks for 'e'
+    bool symmetry;
+    bool minimal; // Make the puzzles minimal (see make_minimal)
+    int max_depth;
+    grid_t *puzzles; // Puzzles to solve
+    bool *malformed; // Puzzles that couldn't be read
+    uint64_t n;
+    uint64_t next; // Index of the next record to produce
+    uint64_t base; // Index of the record of puzzles[0]
+    uint64_t stream; // Random stream of record 0 (see seed_record_rng)
+};
+
+/*
+  A search for a redundant clue of a puzzle (see find_redundant_clue).
+  Threads check clues in order and the first redundant one wins, so the
+  checks of later clues are cancelled once one is found, or once a check
+  runs out of budget, which leaves the answer undetermined.
+*/
+struct clue_check_s {
+    pthread_mutex_t lock;
+    grid_t puzzle; // Digits, 0 for blanks
+    const uint32_t *cells; // Cells of the clues, in the order checked
+    bool symmetry; // Clues are removed with their mirror
+    bool threaded; // Else checked on the calling thread, under its budget
+    int n_threads;
+    int next; // Index of the next clue to check
+    int found; // Index of the first redundant clue so far, n if none
+    bool expired; // The check of clue found ran out of budget instead
+    uint64_t deadline; // The caller's budget, shared by the threads
+    uint64_t max_nodes;
+    uint64_t nodes; // Steps taken so far, by the caller and the threads
+    int workers; // For the threads to number themselves
+    int *current; // Clue each thread is checking
+    bool *cancel; // Set to stop a thread's check
+};
+
+/*
+  A file of puzzles being read, decompressed on the fly: zlib reads gzip
+  and plain text alike, zstd needs HAVE_ZSTD.
+*/
+struct input_s {
+    const char *path;
+    gzFile gz; // NULL when reading zstd
+#ifdef HAVE_ZSTD
+    FILE *file;
+    ZSTD_DStream *zstd;
+    ZSTD_inBuffer in;
+    ZSTD_outBuffer out;
+    size_t pos; // Next byte of out to hand out
+    size_t left; // Nonzero in the middle of a frame
+#endif
+};
+
+/*
+  One of the two blocks of puzzles of --batch: the reader thread fills one
+  while the workers solve the other.
+*/
+struct batch_block_s {
+    grid_t puzzles[BATCH_BLOCK];
+    bool malformed[BATCH_BLOCK];
+    uint64_t first; // Index of the record of puzzles[0]
+    int n; // 0 when the input is exhausted
+    bool full; // Filled and not solved yet
+};
+
+/*
+  Running mean and variance of the estimates of the number of completed
+  boards (see --estimate). Each estimate is a product of the choices at
+  every level of a descent, summed as logs (see random_descent). The
+  estimates differ by orders of magnitude, and the sums take millions of
+  small corrections, so long doubles keep their rounding errors down.
+*/
+struct estimate_s {
+    uint64_t n;
+    long double mean;
+    long double m2; // Sum of squared differences from the mean
+};
+
+/*
+  A request line read by the server (see --serve), queued until one of the
+  worker threads runs it.
+*/
+struct job_s {
+    struct connection_s *conn; // Where the answer goes, NULL for nowhere
+    unsigned long seq; // Position of the request on its connection
+    char line[MAX_REQUEST_LINE];
+    struct job_s *next;
+};
+
+/*
+  A client connection of the server. Bytes are gathered in buf until a
+  complete line is available. Answers are written a whole line at a time
+  under lock, so that the lines of different jobs never mix, and the
+  connection lives on until it is no longer read and its last job has been
+  answered.
+*/
+struct connection_s {
+    int fd;
+    unsigned long seq; // Number of requests read so far
+    size_t len; // Bytes used in buf
+    char buf[MAX_REQUEST_LINE];
+    pthread_mutex_t lock;
+    bool reading; // Still watched by the event loop
+    int jobs; // Requests not answered yet
+};
+
+/*
+  The kinds of puzzle the inventory keeps in stock (see --inventory). Each
+  is kept both with and without symmetry. The level is the hardness for
+  create_puzzle and the number of blanks for make_easy_puzzle.
+*/
+
+static const struct {
+    bool easy;
+    int level;
+} inventory_buckets[INVENTORY_BUCKETS] = {
+    {false, 0}, {false, 1}, {false, 2},
+    {true, 30}, {true, 40}, {true, 50}
+};
+
+/*
+  A bucket of ready made puzzles, kept as a ring buffer. The grid of each
+  board is the puzzle and its first solution is the answer.
+*/
+struct stock_s {
+    bool easy;
+    int level;
+    bool symmetry;
+    int first; // Index of the oldest puzzle
+    int count; // Number of puzzles in stock
+    int refilling; // Number of threads making a puzzle for this bucket
+    struct board_s puzzles[INVENTORY_CAPACITY];
+};
 
 /*
   Used solely for the test cases.
@@ -350,10 +926,44 @@ const struct option long_options[] = {
     {"verbose",      required_argument, 0,  'v' },
     {"test",         no_argument,       0,  't' },
     {"help",         no_argument,       0,  'h' },
+    {"threads",      required_argument, 0,  'j' },
+    {"serve",        required_argument, 0,  OPT_SERVE },
+    {"inventory",    required_argument, 0,  OPT_INVENTORY },
+    {"stock",        required_argument, 0,  OPT_STOCK },
+    {"estimate",     required_argument, 0,  OPT_ESTIMATE },
+    {"from",         required_argument, 0,  OPT_FROM },
+    {"to",           required_argument, 0,  OPT_TO },
+    {"checkpoint",   required_argument, 0,  OPT_CHECKPOINT },
+    {"plan",         required_argument, 0,  OPT_PLAN },
+    {"count",        no_argument,       0,  OPT_COUNT },
+    {"output",       required_argument, 0,  OPT_OUTPUT },
+    {"binary",       no_argument,       0,  OPT_BINARY },
+    {"batch",        required_argument, 0,  OPT_BATCH },
+    {"number",       required_argument, 0,  OPT_NUMBER },
+    {"timeout",      required_argument, 0,  OPT_TIMEOUT },
+    {"nodes",        required_argument, 0,  OPT_NODES },
+    {"portfolio",    required_argument, 0,  OPT_PORTFOLIO },
+    {"parallel",     required_argument, 0,  OPT_PARALLEL },
+    {"bench",        required_argument, 0,  OPT_BENCH },
+    {"baseline",     required_argument, 0,  OPT_BASELINE },
+    {"threshold",    required_argument, 0,  OPT_THRESHOLD },
+    {"minimal",      no_argument,       0,  OPT_MINIMAL },
+    {"check-minimal", required_argument, 0, OPT_CHECK_MINIMAL },
+    {"metrics",      required_argument, 0,  OPT_METRICS },
+    {"trace",        required_argument, 0,  OPT_TRACE },
+    {"trace-summary", required_argument, 0, OPT_TRACE_SUMMARY },
+    {"trace-folded", required_argument, 0,  OPT_TRACE_FOLDED },
+    {"variant",      required_argument, 0,  OPT_VARIANT },
+    {"hash-table",   required_argument, 0,  OPT_HASH_TABLE },
+    {"anneal",       required_argument, 0,  OPT_ANNEAL },
+    {"verify",       required_argument, 0,  OPT_VERIFY },
+    {"delta",        required_argument, 0,  OPT_DELTA },
+    {"decode",       required_argument, 0,  OPT_DECODE },
+    {"skip",         required_argument, 0,  OPT_SKIP },
     {0,              0,                 0,   0  }
 };
 
-const char *options = "c:ms:p:g:e:d:r:v:th";
+const char *options = "c:ms:p:g:e:d:r:v:thj:";
 const char *arguments[] = {
     "hardness",
     "",
@@ -366,6 +976,40 @@ const char *arguments[] = {
     "0 or 1",
     "",
     "",
+    "integer",
+    "socket",
+    "file",
+    "integer",
+    "integer",
+    "path",
+    "path",
+    "file",
+    "integer",
+    "",
+    "file",
+    "",
+    "file",
+    "integer",
+    "milliseconds",
+    "integer",
+    "puzzle",
+    "puzzle",
+    "corpus",
+    "file",
+    "percent",
+    "",
+    "puzzle",
+    "file",
+    "file",
+    "file",
+    "file",
+    "rules",
+    "megabytes",
+    "hardness",
+    "file",
+    "file",
+    "file",
+    "integer",
     ""
 };
 
@@ -381,9 +1025,46 @@ const char *descriptions[] = {
     "Print out less (0) or more (1). By default, output is verbose.",
     "Runs a test suite.",
     "Prints this message.",
+    "Number of worker threads (default is one per core).",
+    "Serves solve, create, easy and rate requests on a Unix socket.",
+    "Keeps a stock of puzzles for the server, saved in this file.",
+    "Number of puzzles to keep in stock for each kind of puzzle (default 8).",
+    "Estimates the number of completed boards from n random descents.",
+    "Generating starts at the board with this path.",
+    "Generating stops before the board with this path.",
+    "Saves the progress of generating in this file and resumes from it.",
+    "Splits generating into n shards of about the same size.",
+    "Counts the completions of the default puzzle using its symmetries.",
+    "Writes results as fixed size records into this file.",
+    "Makes the records of --output packed binary instead of text.",
+    "Solves every puzzle in a file (one per line) on all threads.",
+    "Number of puzzles to create with -c or -e (default 1).",
+    "Gives up on each solve or creation after this long.",
+    "Gives up on each solve or creation after this many search steps.",
+    "Solves a puzzle by racing differently configured searches on all threads.",
+    "Solves a puzzle by sharing out its search tree among all threads.",
+    "Times a file of puzzles, or create:<hardness> or easy:<blanks>, as JSON.",
+    "Results of an earlier --bench for later ones to be compared with.",
+    "Slowdown in percent counted as a regression (default 25).",
+    "Makes the puzzles of -c and -e minimal: no clue can be removed.",
+    "Checks whether every clue of a puzzle is needed, on all threads.",
+    "Writes latency histograms and counters to this file, for Prometheus.",
+    "Records the search of every -s after it in this binary file.",
+    "Summarises a trace: hot cells, subtree sizes and dead ends.",
+    "Prints a trace as folded stacks, for flamegraph.pl.",
+    "Plays x, windoku or the units in a file instead of classic Sudoku.",
+    "Size of the table of refuted states shared by searches (default 16).",
+    "Creates a puzzle like -c, by local search from an easy one on all threads.",
+    "Checks a file of solved grids (or puzzle,grid lines) on all threads.",
+    "Writes the boards of --generate to this file, compressed and indexed.",
+    "Prints the boards in a --delta file, one per line.",
+    "Makes --decode start after this many boards (default 0).",
     ""
 };
 
 static int verbose = 1;
+static int num_threads = 0;
+static uint64_t timeout_ms = 0;
+static uint64_t max_nodes = 0;
 
 #endif
@@ -395,6 +395,14 @@ def str_to_board(s):
     board = list(s)
     return [int(b) for b in board]
 
+# The C engine, when built (see setup.py), replaces the functions above
+# with the same signatures and adds batch functions for arrays of puzzles.
+try:
+    from _sudoku import (find_solutions, make_complete, make_puzzle,
+                         solve_batch, create_batch, verify_batch, seed)
+except ImportError:
+    pass
+
 if __name__ == "__main__":
     parser = argparse.ArgumentParser(description='Sudoku solver and generator')
     parser.add_argument("-s", "--solve",
@@ -0,0 +1,466 @@
+/*
+  Python extension: the C engine behind sudoku.py
+
+  Copyright 2019 Nathan Geffen (See LICENSE)
+
+  Builds sudoku.c as a module (_sudoku, see setup.py). find_solutions,
+  make_complete and make_puzzle take and return boards as lists of 81
+  digits, like the functions of sudoku.py they replace. solve_batch,
+  create_batch and verify_batch work on arrays of puzzles instead: any
+  buffer (a NumPy array of shape (N, 81) and dtype uint8, a bytearray, ...)
+  of N * 81 digits.
+  Results are written straight into the arrays given, and the GIL is
+  released while the engine runs on all threads.
+*/
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#define SUDOKU_NO_MAIN
+#include "sudoku.c"
+
+#define PYTHON_STREAMS 1024 // Random streams below this are left to workers
+
+/* The batch functions share records and production, one call at a time */
+static pthread_mutex_t engine_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Bumped by seed(), so that every thread takes a fresh stream */
+static long seed_generation = 1;
+static long next_stream = PYTHON_STREAMS;
+static _Thread_local long thread_generation;
+
+/*
+  Gives the calling thread its own random stream, once per seed.
+*/
+
+static void
+seed_calling_thread(void)
+{
+    long generation = __atomic_load_n(&seed_generation, __ATOMIC_RELAXED);
+
+    if (thread_generation == generation)
+        return;
+    seed_thread_rng(__atomic_fetch_add(&next_stream, 1, __ATOMIC_RELAXED));
+    thread_generation = generation;
+}
+
+/*
+  Reads a board, a sequence of 81 digits, into a grid. Returns false with a
+  Python exception set if it isn't one.
+*/
+
+static bool
+board_from_python(PyObject *board, grid_t grid)
+{
+    PyObject *seq = PySequence_Fast(board, "board must be a sequence");
+    long digit;
+
+    if (seq == NULL)
+        return false;
+    if (PySequence_Fast_GET_SIZE(seq) != BOARD_SIZE) {
+        PyErr_Format(PyExc_ValueError, "board must have %d cells",
+                     BOARD_SIZE);
+        Py_DECREF(seq);
+        return false;
+    }
+    for (int i = 0; i < BOARD_SIZE; i++) {
+        digit = PyLong_AsLong(PySequence_Fast_GET_ITEM(seq, i));
+        if (digit == -1 && PyErr_Occurred()) {
+            Py_DECREF(seq);
+            return false;
+        }
+        if (digit < 0 || digit > BLOCK_SIZE) {
+            PyErr_SetString(PyExc_ValueError, "cells must be 0 to 9");
+            Py_DECREF(seq);
+            return false;
+        }
+        grid[i] = digit;
+    }
+    Py_DECREF(seq);
+    return true;
+}
+
+/*
+  Returns a grid of bit masks as a list of digits, 0 for a blank.
+*/
+
+static PyObject *
+board_to_python(const grid_t grid)
+{
+    PyObject *board = PyList_New(BOARD_SIZE);
+
+    for (int i = 0; board && i < BOARD_SIZE; i++)
+        PyList_SET_ITEM(board, i, PyLong_FromLong(
+            count_bits(grid[i]) == 1 ? get_bit_index(grid[i]) + 1 : 0));
+    return board;
+}
+
+/*
+  Gets a buffer of n puzzles of 81 one byte cells each, n taken from the
+  buffer if it is -1. Returns false with a Python exception set otherwise.
+*/
+
+static bool
+get_puzzles_buffer(PyObject *obj, Py_buffer *view, bool writable,
+                   Py_ssize_t *n)
+{
+    int flags = PyBUF_C_CONTIGUOUS | PyBUF_FORMAT;
+
+    if (PyObject_GetBuffer(obj, view, writable ? flags | PyBUF_WRITABLE :
+                           flags) < 0)
+        return false;
+    if (view->itemsize != 1 || view->len % BOARD_SIZE != 0 ||
+        (*n >= 0 && view->len != *n * BOARD_SIZE)) {
+        PyErr_Format(PyExc_ValueError, "expected %s%d one byte cells per "
+                     "puzzle", (*n >= 0) ? "the same number of puzzles, " :
+                     "", BOARD_SIZE);
+        PyBuffer_Release(view);
+        return false;
+    }
+    *n = view->len / BOARD_SIZE;
+    return true;
+}
+
+/*
+  Points the records at a caller's arrays: digits into solutions, and the
+  status of each into status if not NULL.
+*/
+
+static void
+records_into(uint8_t *solutions, uint8_t *status, uint64_t n)
+{
+    records.path = NULL;
+    records.binary = false;
+    records.digits = true;
+    records.size = BOARD_SIZE;
+    records.data = solutions;
+    records.status = status;
+    records.n = n;
+    records.first = 0;
+}
+
+static void
+records_done(void)
+{
+    records.digits = false;
+    records.status = NULL;
+    records.data = NULL;
+}
+
+static PyObject *
+py_find_solutions(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *keywords[] = {"board", "max_solutions", NULL};
+    PyObject *board, *solutions;
+    int max_solutions = MAX_SOLUTIONS, n;
+    struct board_s b;
+    grid_t grid;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|i", keywords, &board,
+                                     &max_solutions) ||
+        !board_from_python(board, grid))
+        return NULL;
+    if (max_solutions < 1 || max_solutions > MAX_SOLUTIONS)
+        return PyErr_Format(PyExc_ValueError,
+                            "max_solutions must be 1 to %d", MAX_SOLUTIONS);
+
+    b = convert_to_bitboard(grid);
+    Py_BEGIN_ALLOW_THREADS
+    solve(&b, SOLVING_MAX_DEPTH);
+    Py_END_ALLOW_THREADS
+    n = b.valid ? num_solutions(&b) : 0;
+    if (n > max_solutions)
+        n = max_solutions;
+    if ((solutions = PyList_New(n)) == NULL)
+        return NULL;
+    for (int i = 0; i < n; i++)
+        PyList_SET_ITEM(solutions, i, board_to_python(b.solutions[i]));
+    return solutions;
+}
+
+static PyObject *
+py_make_complete(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *keywords[] = {"board", NULL};
+    PyObject *board = Py_None;
+    struct board_choices_s bc;
+    struct board_s b;
+    grid_t grid = {0};
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|O", keywords, &board) ||
+        (board != Py_None && !board_from_python(board, grid)))
+        return NULL;
+
+    b = convert_to_bitboard(grid);
+    Py_BEGIN_ALLOW_THREADS
+    seed_calling_thread();
+    bc = make_random_complete_board(&b);
+    Py_END_ALLOW_THREADS
+    if (bc.board.valid == false)
+        return Py_BuildValue("[O[]]", Py_None);
+    // sudoku.py lists the options at each branch; their product is all
+    // that is used, and all the engine keeps
+    return Py_BuildValue("[N[d]]", board_to_python(bc.board.grid),
+                         exp(bc.log_choices));
+}
+
+static PyObject *
+py_make_puzzle(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *keywords[] = {"symmetrical", "max_removals", "min_ones",
+                               "simple", NULL};
+    int symmetrical = 1, max_removals = 55, min_ones = 2, simple = 1;
+    struct board_s b;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|piip", keywords,
+                                     &symmetrical, &max_removals, &min_ones,
+                                     &simple))
+        return NULL;
+
+    Py_BEGIN_ALLOW_THREADS
+    seed_calling_thread();
+    if (simple)
+        b = make_easy_puzzle(symmetrical, 0);
+    else
+        b = create_puzzle(0, CREATING_MAX_DEPTH, symmetrical);
+    Py_END_ALLOW_THREADS
+    return board_to_python(b.grid);
+}
+
+static PyObject *
+py_solve_batch(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *keywords[] = {"puzzles", "solutions", "status", "max_depth",
+                               "threads", NULL};
+    PyObject *puzzles_obj, *solutions_obj, *status_obj = Py_None;
+    Py_buffer puzzles, solutions, status = {NULL};
+    Py_ssize_t n = -1, solved = 0;
+    int max_depth = SOLVING_MAX_DEPTH, threads = 0;
+    const uint8_t *cells;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|Oii", keywords,
+                                     &puzzles_obj, &solutions_obj,
+                                     &status_obj, &max_depth, &threads) ||
+        !get_puzzles_buffer(puzzles_obj, &puzzles, false, &n))
+        return NULL;
+    if (!get_puzzles_buffer(solutions_obj, &solutions, true, &n)) {
+        PyBuffer_Release(&puzzles);
+        return NULL;
+    }
+    if (status_obj != Py_None &&
+        (PyObject_GetBuffer(status_obj, &status, PyBUF_C_CONTIGUOUS |
+                            PyBUF_WRITABLE) < 0 || status.len != n)) {
+        if (status.obj) {
+            PyErr_SetString(PyExc_ValueError,
+                            "status must have one byte per puzzle");
+            PyBuffer_Release(&status);
+        }
+        PyBuffer_Release(&puzzles);
+        PyBuffer_Release(&solutions);
+        return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    pthread_mutex_lock(&engine_lock);
+    production.puzzles = malloc(n * sizeof(grid_t));
+    production.malformed = malloc(n * sizeof(bool));
+    cells = puzzles.buf;
+    for (Py_ssize_t i = 0; i < n; i++) {
+        production.malformed[i] = false;
+        for (int c = 0; c < BOARD_SIZE; c++) {
+            production.puzzles[i][c] = cells[i * BOARD_SIZE + c];
+            production.malformed[i] |= (cells[i * BOARD_SIZE + c] > 9);
+        }
+    }
+    records_into(solutions.buf, status.buf ? status.buf : malloc(n), n);
+    production.kind = 's';
+    production.max_depth = max_depth;
+    production.base = 0;
+    production.n = n;
+    num_threads = threads;
+    run_workers();
+    for (Py_ssize_t i = 0; i < n; i++)
+        solved += (records.status[i] == STATUS_UNIQUE);
+    if (status.buf == NULL)
+        free(records.status);
+    records_done();
+    free(production.puzzles);
+    free(production.malformed);
+    pthread_mutex_unlock(&engine_lock);
+    Py_END_ALLOW_THREADS
+
+    PyBuffer_Release(&puzzles);
+    PyBuffer_Release(&solutions);
+    if (status.obj)
+        PyBuffer_Release(&status);
+    return PyLong_FromSsize_t(solved);
+}
+
+static PyObject *
+py_create_batch(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *keywords[] = {"puzzles", "hardness", "blanks", "symmetrical",
+                               "minimal", "threads", NULL};
+    PyObject *puzzles_obj;
+    Py_buffer puzzles;
+    Py_ssize_t n = -1;
+    int hardness = 0, blanks = 0, symmetrical = 0, minimal = 0, threads = 0;
+    const char *error;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|iippi", keywords,
+                                     &puzzles_obj, &hardness, &blanks,
+                                     &symmetrical, &minimal, &threads))
+        return NULL;
+    if (blanks == 0 &&
+        (error = check_creating_depths(hardness, CREATING_MAX_DEPTH)) != NULL)
+        return PyErr_Format(PyExc_ValueError, "%s", error);
+    if (!get_puzzles_buffer(puzzles_obj, &puzzles, true, &n))
+        return NULL;
+
+    Py_BEGIN_ALLOW_THREADS
+    pthread_mutex_lock(&engine_lock);
+    records_into(puzzles.buf, NULL, n);
+    production.kind = blanks ? 'e' : 'c';
+    production.level = blanks ? blanks : hardness;
+    production.symmetry = symmetrical;
+    production.minimal = minimal;
+    production.max_depth = CREATING_MAX_DEPTH;
+    production.base = 0;
+    production.n = n;
+    num_threads = threads;
+    run_workers();
+    records_done();
+    pthread_mutex_unlock(&engine_lock);
+    Py_END_ALLOW_THREADS
+
+    PyBuffer_Release(&puzzles);
+    Py_RETURN_NONE;
+}
+
+static PyObject *
+py_verify_batch(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    static char *keywords[] = {"grids", "verdicts", "puzzles", NULL};
+    PyObject *grids_obj, *verdicts_obj = Py_None, *puzzles_obj = Py_None;
+    Py_buffer grids, verdicts = {NULL}, puzzles = {NULL};
+    Py_ssize_t n = -1, valid = 0;
+    const uint8_t *cells, *givens;
+    int verdict;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|OO", keywords,
+                                     &grids_obj, &verdicts_obj, &puzzles_obj) ||
+        !get_puzzles_buffer(grids_obj, &grids, false, &n))
+        return NULL;
+    if (puzzles_obj != Py_None &&
+        !get_puzzles_buffer(puzzles_obj, &puzzles, false, &n)) {
+        PyBuffer_Release(&grids);
+        return NULL;
+    }
+    if (verdicts_obj != Py_None &&
+        (PyObject_GetBuffer(verdicts_obj, &verdicts, PyBUF_C_CONTIGUOUS |
+                            PyBUF_WRITABLE) < 0 || verdicts.len != n)) {
+        if (verdicts.obj) {
+            PyErr_SetString(PyExc_ValueError,
+                            "verdicts must have one byte per grid");
+            PyBuffer_Release(&verdicts);
+        }
+        PyBuffer_Release(&grids);
+        if (puzzles.obj)
+            PyBuffer_Release(&puzzles);
+        return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    cells = grids.buf;
+    givens = puzzles.buf;
+    for (Py_ssize_t i = 0; i < n; i++) {
+        verdict = verify_grid(cells + i * BOARD_SIZE,
+                              givens ? givens + i * BOARD_SIZE : NULL, 0);
+        valid += (verdict == VERIFY_VALID);
+        if (verdicts.buf)
+            ((uint8_t *) verdicts.buf)[i] = verdict;
+    }
+    Py_END_ALLOW_THREADS
+
+    PyBuffer_Release(&grids);
+    if (puzzles.obj)
+        PyBuffer_Release(&puzzles);
+    if (verdicts.obj)
+        PyBuffer_Release(&verdicts);
+    return PyLong_FromSsize_t(valid);
+}
+
+static PyObject *
+py_seed(PyObject *self, PyObject *args)
+{
+    unsigned long long seed;
+
+    if (!PyArg_ParseTuple(args, "K", &seed))
+        return NULL;
+    pthread_mutex_lock(&engine_lock);
+    random_seed = seed;
+    next_stream = PYTHON_STREAMS;
+    production.stream = 0;
+    __atomic_fetch_add(&seed_generation, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&engine_lock);
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef sudoku_methods[] = {
+    {"find_solutions", (PyCFunction) py_find_solutions,
+     METH_VARARGS | METH_KEYWORDS,
+     "find_solutions(board, max_solutions=2)\n\n"
+     "Solutions of a board (a list of 81 digits, 0 for blanks), at most "
+     "max_solutions of them."},
+    {"make_complete", (PyCFunction) py_make_complete,
+     METH_VARARGS | METH_KEYWORDS,
+     "make_complete(board=None)\n\n"
+     "A random completion of board (blank by default) and a list whose "
+     "product estimates the number of completions, or [None, []]."},
+    {"make_puzzle", (PyCFunction) py_make_puzzle,
+     METH_VARARGS | METH_KEYWORDS,
+     "make_puzzle(symmetrical=True, max_removals=55, min_ones=2, "
+     "simple=True)\n\n"
+     "A puzzle with a unique solution: an easy one if simple, else a hard "
+     "one. max_removals and min_ones are accepted for compatibility."},
+    {"solve_batch", (PyCFunction) py_solve_batch,
+     METH_VARARGS | METH_KEYWORDS,
+     "solve_batch(puzzles, solutions, status=None, max_depth=100000, "
+     "threads=0)\n\n"
+     "Solves N puzzles (a buffer of N * 81 digits) into solutions (the same "
+     "shape), zeros where there is none, and the status of each (0 unique, "
+     "1 multiple, 2 invalid, 3 too difficult, 4 timed out) into status, N "
+     "bytes. Runs on all threads without the GIL. Returns the number "
+     "with a unique solution."},
+    {"create_batch", (PyCFunction) py_create_batch,
+     METH_VARARGS | METH_KEYWORDS,
+     "create_batch(puzzles, hardness=0, blanks=0, symmetrical=False, "
+     "minimal=False, threads=0)\n\n"
+     "Fills a buffer of N * 81 digits with N new puzzles: hard ones of the "
+     "given hardness, or easy ones with at least blanks blanks. Runs on all "
+     "threads without the GIL."},
+    {"verify_batch", (PyCFunction) py_verify_batch,
+     METH_VARARGS | METH_KEYWORDS,
+     "verify_batch(grids, verdicts=None, puzzles=None)\n\n"
+     "Checks N solved grids (a buffer of N * 81 digits), and that each has "
+     "the givens of its puzzle if puzzles (the same shape) is given. Writes "
+     "the verdict of each (0 valid, 1 invalid, 2 not matching its puzzle, "
+     "3 malformed) into verdicts, N bytes. Runs without the GIL. Returns "
+     "the number of valid grids."},
+    {"seed", py_seed, METH_VARARGS,
+     "seed(n)\n\nSeeds the random numbers, so that runs repeat."},
+    {NULL, NULL, 0, NULL}
+};
+
+static struct PyModuleDef sudoku_module = {
+    PyModuleDef_HEAD_INIT, "_sudoku",
+    "The C Sudoku engine for sudoku.py.", -1, sudoku_methods
+};
+
+PyMODINIT_FUNC
+PyInit__sudoku(void)
+{
+    verbose = 0;
+    random_seed = time(NULL);
+    return PyModule_Create(&sudoku_module);
+}